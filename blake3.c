@@ -7,7 +7,11 @@
  * Copyright (c) 2021-2022 Tino Reichardt
  */
 
+#include <stddef.h>
 #include <string.h>
+#ifndef _KERNEL
+#include <pthread.h>
+#endif
 
 #include "blake3.h"
 #include "blake3_impl.h"
@@ -20,7 +24,10 @@
 #endif
 
 /*
- * We need 1056 byte stack for blake3_compress_subtree_wide()
+ * compress_subtree_iter() works in the scratch space of its caller, and
+ * Blake3_Update2() keeps SUBTREE_STACK_LEN bytes of it on the stack:
+ * 2784 bytes with a MAX_SIMD_DEGREE of 16, 2016 bytes with 4. That is
+ * enough for any input, more scratch space from the heap is optional.
  * - we define this pragma to make gcc happy
  */
 //#if defined(__GNUC__)
@@ -29,6 +36,7 @@
 
 /* internal used */
 typedef struct {
+	const blake3_impl_ops_t *ops;
 	uint32_t input_cv[8];
 	uint64_t counter;
 	uint8_t block[BLAKE3_BLOCK_LEN];
@@ -55,41 +63,36 @@ static size_t chunk_state_len(const blake3_chunk_state_t *ctx);
 static size_t chunk_state_fill_buf(blake3_chunk_state_t *ctx,
     const uint8_t *input, size_t input_len);
 static uint8_t chunk_state_maybe_start_flag(const blake3_chunk_state_t *ctx);
-static output_t make_output(const uint32_t input_cv[8],
-    const uint8_t *block, uint8_t block_len, uint64_t counter,
-    uint8_t flags);
+static output_t make_output(const blake3_impl_ops_t *ops,
+    const uint32_t input_cv[8], const uint8_t *block, uint8_t block_len,
+    uint64_t counter, uint8_t flags);
 static void output_chaining_value(const output_t *ctx, uint8_t cv[32]);
 
 static void output_root_bytes(const output_t *ctx, uint64_t seek,
     uint8_t *out, size_t out_len);
 
-static void chunk_state_update(blake3_chunk_state_t *ctx,
-    const uint8_t *input, size_t input_len);
-
-static output_t chunk_state_output(const blake3_chunk_state_t *ctx);
-static output_t parent_output(const uint8_t block[BLAKE3_BLOCK_LEN],
-    const uint32_t key[8], uint8_t flags);
-static size_t left_len(size_t content_len);
-
-static size_t compress_parents_parallel(const uint8_t *child_chaining_values,
-    size_t num_chaining_values, const uint32_t key[8], uint8_t flags,
-    uint8_t *out);
+static void chunk_state_update(const blake3_impl_ops_t *ops,
+    blake3_chunk_state_t *ctx, const uint8_t *input, size_t input_len);
 
-static size_t blake3_compress_subtree_wide(const uint8_t *input,
-    size_t input_len, const uint32_t key[8], uint64_t chunk_counter,
-    uint8_t flags, uint8_t *out);
+static output_t chunk_state_output(const blake3_impl_ops_t *ops,
+    const blake3_chunk_state_t *ctx);
+static output_t parent_output(const blake3_impl_ops_t *ops,
+    const uint8_t block[BLAKE3_BLOCK_LEN], const uint32_t key[8],
+    uint8_t flags);
 
-static void compress_subtree_to_parent_node(const uint8_t *input,
-    size_t input_len, const uint32_t key[8], uint64_t chunk_counter,
-    uint8_t flags, uint8_t out[2 * BLAKE3_OUT_LEN]);
+static void compress_subtree_to_parent_node(const blake3_impl_ops_t *ops,
+    const uint8_t *input, size_t input_len, const uint32_t key[8],
+    uint64_t chunk_counter, uint8_t flags, uint8_t out[2 * BLAKE3_OUT_LEN],
+    uint8_t *scratch, size_t scratch_len, const blake3_executor_t *ex,
+    const blake3_outboard_t *ob);
 
 static void hasher_merge_cv_stack(BLAKE3_CTX *ctx, uint64_t total_len);
 
 static void hasher_push_cv(BLAKE3_CTX *ctx, uint8_t new_cv[BLAKE3_OUT_LEN],
     uint64_t chunk_counter);
 
-static void Blake3_Update2(BLAKE3_CTX *ctx, const void *input,
-    size_t input_len);
+static int Blake3_Update2(BLAKE3_CTX *ctx, const void *input,
+    size_t input_len, const blake3_executor_t *ex);
 
 /* internal start */
 static void chunk_state_init(blake3_chunk_state_t *ctx,
@@ -143,12 +146,13 @@ static uint8_t chunk_state_maybe_start_flag(const blake3_chunk_state_t *ctx)
 	}
 }
 
-static output_t make_output(const uint32_t input_cv[8],
-    const uint8_t *block, uint8_t block_len,
+static output_t make_output(const blake3_impl_ops_t *ops,
+    const uint32_t input_cv[8], const uint8_t *block, uint8_t block_len,
     uint64_t counter, uint8_t flags)
 {
 	dprintf("%s\n", __func__);
 	output_t ret;
+	ret.ops = ops;
 	memcpy(ret.input_cv, input_cv, 32);
 	memcpy(ret.block, block, BLAKE3_BLOCK_LEN);
 	ret.block_len = block_len;
@@ -168,10 +172,9 @@ static output_t make_output(const uint32_t input_cv[8],
 static void output_chaining_value(const output_t *ctx, uint8_t cv[32])
 {
 	dprintf("%s\n", __func__);
-	const blake3_impl_ops_t *ops = blake3_impl_get_ops();
 	uint32_t cv_words[8];
 	memcpy(cv_words, ctx->input_cv, 32);
-	ops->compress_in_place(cv_words, ctx->block, ctx->block_len,
+	ctx->ops->compress_in_place(cv_words, ctx->block, ctx->block_len,
 	    ctx->counter, ctx->flags);
 	store_cv_words(cv, cv_words);
 }
@@ -180,10 +183,39 @@ static void output_root_bytes(const output_t *ctx, uint64_t seek,
     uint8_t *out, size_t out_len)
 {
 	dprintf("%s\n", __func__);
-	const blake3_impl_ops_t *ops = blake3_impl_get_ops();
+	const blake3_impl_ops_t *ops = ctx->ops;
 	uint64_t output_block_counter = seek / 64;
 	size_t offset_within_block = seek % 64;
 	uint8_t wide_buf[64];
+
+	/* the rest of a block, when seek is not aligned */
+	if (offset_within_block > 0) {
+		size_t memcpy_len = 64 - offset_within_block;
+		if (memcpy_len > out_len)
+			memcpy_len = out_len;
+		ops->compress_xof(ctx->input_cv, ctx->block, ctx->block_len,
+		    output_block_counter, ctx->flags | ROOT, wide_buf);
+		memcpy(out, wide_buf + offset_within_block, memcpy_len);
+		out += memcpy_len;
+		out_len -= memcpy_len;
+		output_block_counter += 1;
+		offset_within_block = 0;
+	}
+
+	/*
+	 * Whole output blocks are written directly, with as many blocks per
+	 * call as the implementation can do in parallel.
+	 */
+	if (out_len >= 2 * 64) {
+		size_t outblocks = out_len / 64;
+		ops->compress_xof_many(ctx->input_cv, ctx->block,
+		    ctx->block_len, output_block_counter, ctx->flags | ROOT,
+		    out, outblocks);
+		output_block_counter += outblocks;
+		out += outblocks * 64;
+		out_len -= outblocks * 64;
+	}
+
 	while (out_len > 0) {
 		ops->compress_xof(ctx->input_cv, ctx->block, ctx->block_len,
 		    output_block_counter, ctx->flags | ROOT, wide_buf);
@@ -202,11 +234,10 @@ static void output_root_bytes(const output_t *ctx, uint64_t seek,
 	}
 }
 
-static void chunk_state_update(blake3_chunk_state_t *ctx,
-    const uint8_t *input, size_t input_len)
+static void chunk_state_update(const blake3_impl_ops_t *ops,
+    blake3_chunk_state_t *ctx, const uint8_t *input, size_t input_len)
 {
 	dprintf("%s\n", __func__);
-	const blake3_impl_ops_t *ops = blake3_impl_get_ops();
 	if (ctx->buf_len > 0) {
 		size_t take = chunk_state_fill_buf(ctx, input, input_len);
 		input += take;
@@ -235,257 +266,543 @@ static void chunk_state_update(blake3_chunk_state_t *ctx,
 	input_len -= take;
 }
 
-static output_t chunk_state_output(const blake3_chunk_state_t *ctx)
+static output_t chunk_state_output(const blake3_impl_ops_t *ops,
+    const blake3_chunk_state_t *ctx)
 {
 	dprintf("%s\n", __func__);
 	uint8_t block_flags =
 	    ctx->flags | chunk_state_maybe_start_flag(ctx) | CHUNK_END;
-	return (make_output(ctx->cv, ctx->buf, ctx->buf_len, ctx->chunk_counter,
-	    block_flags));
+	return (make_output(ops, ctx->cv, ctx->buf, ctx->buf_len,
+	    ctx->chunk_counter, block_flags));
 }
 
-static output_t parent_output(const uint8_t block[BLAKE3_BLOCK_LEN],
-    const uint32_t key[8], uint8_t flags)
+static output_t parent_output(const blake3_impl_ops_t *ops,
+    const uint8_t block[BLAKE3_BLOCK_LEN], const uint32_t key[8],
+    uint8_t flags)
 {
-	return (make_output(key, block, BLAKE3_BLOCK_LEN, 0, flags | PARENT));
+	return (make_output(ops, key, block, BLAKE3_BLOCK_LEN, 0,
+	    flags | PARENT));
 }
 
-/*
- * Given some input larger than one chunk, return the number of bytes that
- * should go in the left subtree. This is the largest power-of-2 number of
- * chunks that leaves at least 1 byte for the right subtree.
- */
-static size_t left_len(size_t content_len)
+/* the outboard starts with the input length */
+#define	OUTBOARD_HEADER_LEN	8
+
+/* number of chunks in the tree, an empty input has one empty chunk */
+static uint64_t outboard_chunks(uint64_t input_len)
 {
-	/*
-	 * Subtract 1 to reserve at least one byte for the right side.
-	 * content_len
-	 * should always be greater than BLAKE3_CHUNK_LEN.
-	 */
-	size_t full_chunks = (content_len - 1) / BLAKE3_CHUNK_LEN;
-	return (round_down_to_power_of_2(full_chunks) * BLAKE3_CHUNK_LEN);
+	if (input_len <= BLAKE3_CHUNK_LEN)
+		return (1);
+
+	return ((input_len + BLAKE3_CHUNK_LEN - 1) / BLAKE3_CHUNK_LEN);
+}
+
+uint64_t
+Blake3_OutboardSize(uint64_t input_len)
+{
+	return (OUTBOARD_HEADER_LEN +
+	    (outboard_chunks(input_len) - 1) * BLAKE3_BLOCK_LEN);
 }
 
 /*
- * Use SIMD parallelism to hash up to MAX_SIMD_DEGREE chunks at the same time
- * on a single thread. Write out the chunk chaining values and return the
- * number of chunks hashed. These chunks are never the root and never empty;
- * those cases use a different codepath.
+ * Pre-order position of the parent node over the chunks [chunk, chunk +
+ * num_chunks). In front of it are its ancestors and the parents of the
+ * complete subtrees left of it. The sizes of these subtrees are distinct
+ * powers of 2 which sum up to chunk, so they hold chunk - popcnt(chunk)
+ * parents.
+ *
+ * The right edge of the tree follows the binary representation of the
+ * index of the last chunk: the left children along it are complete
+ * subtrees of the sizes of its set bits. A node on the right edge starts
+ * at a prefix of these bits and has one ancestor per bit of the prefix.
+ * Every other node lies within one of the complete subtrees. Nodes which
+ * don't exist in the tree give UINT64_MAX.
  */
-static size_t compress_chunks_parallel(const uint8_t *input,
-    size_t input_len, const uint32_t key[8], uint64_t chunk_counter,
-    uint8_t flags, uint8_t *out)
+static uint64_t outboard_offset(uint64_t input_len, uint64_t chunk,
+    uint64_t num_chunks)
 {
-	dprintf("%s\n", __func__);
-	const blake3_impl_ops_t *ops = blake3_impl_get_ops();
-	const uint8_t *chunks_array[MAX_SIMD_DEGREE];
-	size_t input_position = 0;
-	size_t chunks_array_len = 0;
-	while (input_len - input_position >= BLAKE3_CHUNK_LEN) {
-		chunks_array[chunks_array_len] = &input[input_position];
-		input_position += BLAKE3_CHUNK_LEN;
-		chunks_array_len += 1;
-	}
+	uint64_t last = outboard_chunks(input_len) - 1;
+	uint64_t depth, k;
 
-	ops->hash_many(chunks_array, chunks_array_len, BLAKE3_CHUNK_LEN /
-	    BLAKE3_BLOCK_LEN, key, chunk_counter, B_TRUE, flags, CHUNK_START,
-	    CHUNK_END, out);
+	if (num_chunks < 2 || chunk > last || num_chunks > last + 1 - chunk)
+		return (UINT64_MAX);
 
-	/*
-	 * Hash the remaining partial chunk, if there is one. Note that the
-	 * empty chunk (meaning the empty message) is a different codepath.
-	 */
-	if (input_len > input_position) {
-		uint64_t counter = chunk_counter + (uint64_t)chunks_array_len;
-		blake3_chunk_state_t chunk_state;
-		chunk_state_init(&chunk_state, key, flags);
-		chunk_state.chunk_counter = counter;
-		chunk_state_update(&chunk_state, &input[input_position],
-		    input_len - input_position);
-		output_t output = chunk_state_output(&chunk_state);
-		output_chaining_value(&output, &out[chunks_array_len *
-		    BLAKE3_OUT_LEN]);
-		return (chunks_array_len + 1);
+	if (chunk + num_chunks == last + 1) {
+		if (chunk != 0 && last - chunk >= (chunk & -chunk))
+			return (UINT64_MAX);
+		depth = popcnt(chunk);
 	} else {
-		return (chunks_array_len);
+		if ((num_chunks & (num_chunks - 1)) != 0 ||
+		    (chunk & (num_chunks - 1)) != 0)
+			return (UINT64_MAX);
+		/* the complete subtree of size 2^k on the right edge */
+		k = highest_one(chunk ^ last);
+		depth = popcnt(last >> k >> 1) + 1 + k - highest_one(num_chunks);
 	}
+
+	return (OUTBOARD_HEADER_LEN +
+	    (depth + chunk - popcnt(chunk)) * BLAKE3_BLOCK_LEN);
+}
+
+/* write the parent node over the chunks [chunk, chunk + num_chunks) */
+static void outboard_node(const blake3_outboard_t *ob, uint64_t chunk,
+    uint64_t num_chunks, const uint8_t node[BLAKE3_BLOCK_LEN])
+{
+	uint64_t offset;
+
+	if (ob == NULL)
+		return;
+
+	offset = outboard_offset(ob->input_len, chunk, num_chunks);
+	if (offset != UINT64_MAX)
+		ob->write(ob->priv, offset, node, BLAKE3_BLOCK_LEN);
+}
+
+void
+Blake3_SetOutboard(BLAKE3_CTX *ctx, const blake3_outboard_t *ob)
+{
+	uint8_t header[OUTBOARD_HEADER_LEN];
+	int i;
+
+	ctx->outboard = ob;
+	if (ob == NULL)
+		return;
+
+	for (i = 0; i < OUTBOARD_HEADER_LEN; i++)
+		header[i] = (uint8_t)(ob->input_len >> (8 * i));
+	ob->write(ob->priv, 0, header, OUTBOARD_HEADER_LEN);
 }
 
 /*
- * Use SIMD parallelism to hash up to MAX_SIMD_DEGREE parents at the same time
- * on a single thread. Write out the parent chaining values and return the
- * number of parents hashed. (If there's an odd input chaining value left over,
- * return it as an additional output.) These parents are never the root and
- * never empty; those cases use a different codepath.
+ * Subtrees of at least this size are forked via the executor by default,
+ * smaller ones are not worth the synchronization.
  */
-static size_t compress_parents_parallel(const uint8_t *child_chaining_values,
-    size_t num_chaining_values, const uint32_t key[8], uint8_t flags,
-    uint8_t *out)
+#define	BLAKE3_PARALLEL_MIN_LEN	(128 * 1024)
+
+/*
+ * Blake3_Update2() hashes the bulk of its input as complete subtrees with
+ * a power-of-2 number of chunks, which are never the root. These are hashed
+ * without recursion: hash_many() compresses ops->degree chunks at a time,
+ * and their chaining values go up through a few levels of wide buffers. A
+ * full level holds 2 * degree chaining values, which are compressed into
+ * degree parents with one hash_many() call and added to the next level.
+ * The top level is condensed into a single chaining value, which is merged
+ * on a plain stack of chaining values.
+ *
+ * The levels and the stack live in scratch space of the caller. A subtree
+ * of n chunks needs up to highest_one(n) + 1 stack entries, and as many
+ * levels of up to SUBTREE_WIDE_LEVELS as fit into the rest, at least one.
+ * SUBTREE_STACK_LEN holds one level and the stack of the largest subtree.
+ * Outside of the kernel, subtrees of more than SUBTREE_STACK_CHUNKS chunks
+ * get heap scratch space with all levels, if that allocation succeeds.
+ */
+#define	SUBTREE_WIDE_LEVELS	3
+#define	SUBTREE_LEVEL_LEN	(2 * MAX_SIMD_DEGREE_OR_2 * BLAKE3_OUT_LEN)
+#define	SUBTREE_STACK_CHUNKS	64
+#define	SUBTREE_STACK_LEN	\
+	(SUBTREE_LEVEL_LEN + (BLAKE3_MAX_DEPTH + 1) * BLAKE3_OUT_LEN)
+
+/* bytes of scratch space for subtrees of up to num_chunks chunks */
+static size_t subtree_scratch_len(uint64_t num_chunks, size_t levels)
+{
+	return (levels * SUBTREE_LEVEL_LEN +
+	    (highest_one(num_chunks | 1) + 1) * BLAKE3_OUT_LEN);
+}
+
+/*
+ * Return scratch space for subtrees of up to num_chunks chunks, and set
+ * scratch_len. This is stack_scratch, unless heap scratch space with all
+ * levels is worth it and available.
+ */
+static uint8_t *subtree_scratch_get(uint64_t num_chunks,
+    uint8_t stack_scratch[SUBTREE_STACK_LEN], size_t *scratch_len)
+{
+	*scratch_len = SUBTREE_STACK_LEN;
+#ifndef _KERNEL
+	if (num_chunks > SUBTREE_STACK_CHUNKS) {
+		size_t len = subtree_scratch_len(num_chunks,
+		    SUBTREE_WIDE_LEVELS);
+		uint8_t *heap_scratch = malloc(len);
+
+		if (heap_scratch != NULL) {
+			*scratch_len = len;
+			return (heap_scratch);
+		}
+	}
+#else
+	(void) num_chunks;
+#endif
+	return (stack_scratch);
+}
+
+static void subtree_scratch_put(uint8_t *scratch,
+    uint8_t stack_scratch[SUBTREE_STACK_LEN])
+{
+#ifndef _KERNEL
+	if (scratch != stack_scratch)
+		free(scratch);
+#else
+	(void) scratch, (void) stack_scratch;
+#endif
+}
+
+/*
+ * Compress num_cvs adjacent chaining values into num_cvs / 2 parents with
+ * one hash_many() call. The output may overlap the input, parent i is only
+ * written after the children 2 * i and 2 * i + 1 have been read. The first
+ * child starts at chunk, every child has child_chunks chunks.
+ */
+static void compress_parents_wide(const blake3_impl_ops_t *ops,
+    const uint8_t *cvs, size_t num_cvs, const uint32_t key[8],
+    uint8_t flags, uint8_t *out, const blake3_outboard_t *ob, uint64_t chunk,
+    uint64_t child_chunks)
 {
-	dprintf("%s\n", __func__);
-	const blake3_impl_ops_t *ops = blake3_impl_get_ops();
 	const uint8_t *parents_array[MAX_SIMD_DEGREE_OR_2];
-	size_t parents_array_len = 0;
+	size_t i;
 
-	while (num_chaining_values - (2 * parents_array_len) >= 2) {
-		parents_array[parents_array_len] = &child_chaining_values[2 *
-		    parents_array_len * BLAKE3_OUT_LEN];
-		parents_array_len += 1;
+	for (i = 0; i < num_cvs / 2; i++) {
+		parents_array[i] = &cvs[2 * i * BLAKE3_OUT_LEN];
+		outboard_node(ob, chunk + 2 * i * child_chunks,
+		    2 * child_chunks, parents_array[i]);
 	}
 
-	ops->hash_many(parents_array, parents_array_len, 1, key, 0, B_FALSE,
+	ops->hash_many(parents_array, num_cvs / 2, 1, key, 0, B_FALSE,
 	    flags | PARENT, 0, 0, out);
+}
 
-	/* If there's an odd child left over, it becomes an output. */
-	if (num_chaining_values > 2 * parents_array_len) {
-		memcpy(&out[parents_array_len * BLAKE3_OUT_LEN],
-		    &child_chaining_values[2 * parents_array_len *
-		    BLAKE3_OUT_LEN], BLAKE3_OUT_LEN);
-		return (parents_array_len + 1);
-	} else {
-		return (parents_array_len);
+/* condense a power-of-2 number of chaining values in place into one */
+static void condense_cvs(const blake3_impl_ops_t *ops, uint8_t *cvs,
+    size_t num_cvs, const uint32_t key[8], uint8_t flags,
+    const blake3_outboard_t *ob, uint64_t chunk, uint64_t child_chunks)
+{
+	while (num_cvs > 1) {
+		compress_parents_wide(ops, cvs, num_cvs, key, flags, cvs, ob,
+		    chunk, child_chunks);
+		num_cvs /= 2;
+		child_chunks *= 2;
 	}
 }
 
 /*
- * The wide helper function returns (writes out) an array of chaining values
- * and returns the length of that array. The number of chaining values returned
- * is the dyanmically detected SIMD degree, at most MAX_SIMD_DEGREE. Or fewer,
- * if the input is shorter than that many chunks. The reason for maintaining a
- * wide array of chaining values going back up the tree, is to allow the
- * implementation to hash as many parents in parallel as possible.
- *
- * As a special case when the SIMD degree is 1, this function will still return
- * at least 2 outputs. This guarantees that this function doesn't perform the
- * root compression. (If it did, it would use the wrong flags, and also we
- * wouldn't be able to implement exendable ouput.) Note that this function is
- * not used when the whole input is only 1 chunk long; that's a different
- * codepath.
- *
- * Why not just have the caller split the input on the first update(), instead
- * of implementing this special rule? Because we don't want to limit SIMD or
- * multi-threading parallelism for that update().
+ * Write the chaining value of a subtree of num_chunks complete chunks,
+ * num_chunks is a power of 2. The scratch space has at least
+ * subtree_scratch_len(num_chunks, 1) bytes.
  */
-static size_t blake3_compress_subtree_wide(const uint8_t *input,
-    size_t input_len, const uint32_t key[8], uint64_t chunk_counter,
-    uint8_t flags, uint8_t *out)
+static void compress_subtree_iter(const blake3_impl_ops_t *ops,
+    const uint8_t *input, size_t num_chunks, const uint32_t key[8],
+    uint64_t chunk_counter, uint8_t flags, uint8_t cv[BLAKE3_OUT_LEN],
+    uint8_t *scratch, size_t scratch_len, const blake3_outboard_t *ob)
 {
-	const blake3_impl_ops_t *ops = blake3_impl_get_ops();
+	size_t degree = ops->degree, group, i, k;
+	size_t stride = 2 * degree * BLAKE3_OUT_LEN;
+	size_t stack_bytes = subtree_scratch_len(num_chunks, 0);
+	size_t num_levels = (scratch_len - stack_bytes) / stride;
+	size_t level_len[SUBTREE_WIDE_LEVELS] = { 0 };
+	uint8_t *levels[SUBTREE_WIDE_LEVELS];
+	uint8_t *stack;
+	size_t stack_len = 0;
+	uint64_t pushed = 0, n, size;
+	const uint8_t *chunks_array[MAX_SIMD_DEGREE];
+	size_t top;
+
 	dprintf("%s\n", __func__);
+	if (num_levels > SUBTREE_WIDE_LEVELS)
+		num_levels = SUBTREE_WIDE_LEVELS;
+	for (k = 0; k < num_levels; k++)
+		levels[k] = &scratch[k * stride];
+	stack = &scratch[num_levels * stride];
+	top = num_levels - 1;
+
+	group = (num_chunks < degree) ? num_chunks : degree;
+	while (num_chunks > 0) {
+		for (i = 0; i < group; i++)
+			chunks_array[i] = &input[i * BLAKE3_CHUNK_LEN];
+		ops->hash_many(chunks_array, group, BLAKE3_CHUNK_LEN /
+		    BLAKE3_BLOCK_LEN, key, chunk_counter, B_TRUE, flags,
+		    CHUNK_START, CHUNK_END,
+		    &levels[0][level_len[0] * BLAKE3_OUT_LEN]);
+		level_len[0] += group;
+		input += group * BLAKE3_CHUNK_LEN;
+		chunk_counter += group;
+		num_chunks -= group;
 
-	/*
-	 * Note that the single chunk case does *not* bump the SIMD degree up
-	 * to 2 when it is 1. If this implementation adds multi-threading in
-	 * the future, this gives us the option of multi-threading even the
-	 * 2-chunk case, which can help performance on smaller platforms.
-	 */
-	if (input_len <= (size_t)(ops->degree * BLAKE3_CHUNK_LEN)) {
-		return (compress_chunks_parallel(input, input_len, key,
-		    chunk_counter, flags, out));
-	}
+		/*
+		 * full levels become half a level of parents one level up, the
+		 * levels below are empty, so a full level ends at chunk_counter
+		 */
+		for (k = 0; k < top && level_len[k] == 2 * degree; k++) {
+			compress_parents_wide(ops, levels[k], 2 * degree, key,
+			    flags,
+			    &levels[k + 1][level_len[k + 1] * BLAKE3_OUT_LEN],
+			    ob, chunk_counter - ((2 * degree) << k),
+			    (uint64_t)1 << k);
+			level_len[k + 1] += degree;
+			level_len[k] = 0;
+		}
 
+		if (level_len[top] < 2 * degree)
+			continue;
+
+		/* the full top level becomes one entry of the stack */
+		condense_cvs(ops, levels[top], 2 * degree, key, flags, ob,
+		    chunk_counter - ((2 * degree) << top), (uint64_t)1 << top);
+		level_len[top] = 0;
+		memcpy(&stack[stack_len * BLAKE3_OUT_LEN], levels[top],
+		    BLAKE3_OUT_LEN);
+		stack_len += 1;
+
+		/* merge as many pairs as the number of entries allows */
+		size = (2 * degree) << top;
+		for (n = ++pushed; (n & 1) == 0; n >>= 1) {
+			uint8_t *parent_node =
+			    &stack[(stack_len - 2) * BLAKE3_OUT_LEN];
+			output_t output =
+			    parent_output(ops, parent_node, key, flags);
+			size *= 2;
+			outboard_node(ob, chunk_counter - size, size,
+			    parent_node);
+			output_chaining_value(&output, parent_node);
+			stack_len -= 1;
+		}
+	}
 
 	/*
-	 * With more than simd_degree chunks, we need to recurse. Start by
-	 * dividing the input into left and right subtrees. (Note that this is
-	 * only optimal as long as the SIMD degree is a power of 2. If we ever
-	 * get a SIMD degree of 3 or something, we'll need a more complicated
-	 * strategy.)
+	 * As num_chunks is a power of 2, either the stack holds the result, or
+	 * all the remaining chaining values are on one level.
 	 */
-	size_t left_input_len = left_len(input_len);
-	size_t right_input_len = input_len - left_input_len;
-	const uint8_t *right_input = &input[left_input_len];
-	uint64_t right_chunk_counter = chunk_counter +
-	    (uint64_t)(left_input_len / BLAKE3_CHUNK_LEN);
+	for (k = 0; k < num_levels; k++) {
+		if (level_len[k] > 0) {
+			condense_cvs(ops, levels[k], level_len[k], key, flags,
+			    ob, chunk_counter - (level_len[k] << k),
+			    (uint64_t)1 << k);
+			memcpy(cv, levels[k], BLAKE3_OUT_LEN);
+			return;
+		}
+	}
+	memcpy(cv, stack, BLAKE3_OUT_LEN);
+}
 
-	/*
-	 * Make space for the child outputs. Here we use MAX_SIMD_DEGREE_OR_2
-	 * to account for the special case of returning 2 outputs when the
-	 * SIMD degree is 1.
-	 */
-	uint8_t cv_array[2 * MAX_SIMD_DEGREE_OR_2 * BLAKE3_OUT_LEN];
-	size_t degree = ops->degree;
-	if (left_input_len > BLAKE3_CHUNK_LEN && degree == 1) {
+/* arguments of a subtree, which is hashed by some executor thread */
+typedef struct {
+	const blake3_impl_ops_t *ops;
+	const uint8_t *input;
+	size_t num_chunks;
+	const uint32_t *key;
+	uint64_t chunk_counter;
+	uint8_t flags;
+	uint8_t *cv;
+	uint8_t *scratch;
+	size_t scratch_len;
+	const blake3_executor_t *ex;
+	const blake3_outboard_t *ob;
+} subtree_task_t;
+
+static boolean_t executor_may_fork(const blake3_executor_t *ex,
+    size_t input_len)
+{
+	if (ex == NULL)
+		return (B_FALSE);
 
-		/*
-		 * The special case: We always use a degree of at least two,
-		 * to make sure there are two outputs. Except, as noted above,
-		 * at the chunk level, where we allow degree=1. (Note that the
-		 * 1-chunk-input case is a different codepath.)
-		 */
-		degree = 2;
-	}
-	uint8_t *right_cvs = &cv_array[degree * BLAKE3_OUT_LEN];
+	if (ex->min_len == 0)
+		return (input_len >= BLAKE3_PARALLEL_MIN_LEN);
 
-	/*
-	 * Recurse! If this implementation adds multi-threading support in the
-	 * future, this is where it will go.
-	 */
-	size_t left_n = blake3_compress_subtree_wide(input, left_input_len,
-	    key, chunk_counter, flags, cv_array);
-	size_t right_n = blake3_compress_subtree_wide(right_input,
-	    right_input_len, key, right_chunk_counter, flags, right_cvs);
+	return (input_len >= ex->min_len);
+}
 
-	/*
-	 * The special case again. If simd_degree=1, then we'll have left_n=1
-	 * and right_n=1. Rather than compressing them into a single output,
-	 * return them directly, to make sure we always have at least two
-	 * outputs.
-	 */
-	if (left_n == 1) {
-		memcpy(out, cv_array, 2 * BLAKE3_OUT_LEN);
-		return (2);
+/*
+ * Write the chaining value of a subtree of num_chunks complete chunks. With
+ * an executor, large subtrees are split into halves for other threads.
+ */
+static void compress_subtree_cv(const blake3_impl_ops_t *ops,
+    const uint8_t *input, size_t num_chunks, const uint32_t key[8],
+    uint64_t chunk_counter, uint8_t flags, uint8_t cv[BLAKE3_OUT_LEN],
+    uint8_t *scratch, size_t scratch_len, const blake3_executor_t *ex,
+    const blake3_outboard_t *ob)
+{
+	if (num_chunks > 1 &&
+	    executor_may_fork(ex, num_chunks * BLAKE3_CHUNK_LEN)) {
+		uint8_t parent_node[BLAKE3_BLOCK_LEN];
+
+		compress_subtree_to_parent_node(ops, input,
+		    num_chunks * BLAKE3_CHUNK_LEN, key, chunk_counter, flags,
+		    parent_node, scratch, scratch_len, ex, ob);
+		outboard_node(ob, chunk_counter, num_chunks, parent_node);
+		output_t output = parent_output(ops, parent_node, key, flags);
+		output_chaining_value(&output, cv);
+	} else {
+		compress_subtree_iter(ops, input, num_chunks, key,
+		    chunk_counter, flags, cv, scratch, scratch_len, ob);
 	}
+}
+
+static void compress_subtree_task(void *arg)
+{
+	subtree_task_t *t = arg;
 
-	/* Otherwise, do one layer of parent node compression. */
-	size_t num_chaining_values = left_n + right_n;
-	return compress_parents_parallel(cv_array, num_chaining_values, key,
-	    flags, out);
+	compress_subtree_cv(t->ops, t->input, t->num_chunks, t->key,
+	    t->chunk_counter, t->flags, t->cv, t->scratch, t->scratch_len,
+	    t->ex, t->ob);
 }
 
 /*
- * Hash a subtree with compress_subtree_wide(), and then condense the resulting
- * list of chaining values down to a single parent node. Don't compress that
- * last parent node, however. Instead, return its message bytes (the
- * concatenated chaining values of its children). This is necessary when the
- * first call to update() supplies a complete subtree, because the topmost
- * parent node of that subtree could end up being the root. It's also necessary
- * for extended output in the general case.
+ * Hash a subtree of a power-of-2 number of complete chunks, and return the
+ * message bytes of its topmost parent node (the concatenated chaining values
+ * of both halves) without compressing it. This is necessary when the first
+ * call to update() supplies a complete subtree, because the topmost parent
+ * node of that subtree could end up being the root. It's also necessary for
+ * extended output in the general case.
  *
- * As with compress_subtree_wide(), this function is not used on inputs of 1
- * chunk or less. That's a different codepath.
+ * With an executor, the left half is forked off to some other thread, while
+ * we continue with the right one. The result is the same as for the serial
+ * computation. The forked half runs concurrently with the right one, so it
+ * gets scratch space of its own from the heap. Without that, and always in
+ * the kernel, both halves run here.
+ *
+ * This function is not used on inputs of 1 chunk or less. That's a different
+ * codepath.
  */
-static void compress_subtree_to_parent_node(const uint8_t *input,
-    size_t input_len, const uint32_t key[8], uint64_t chunk_counter,
-    uint8_t flags, uint8_t out[2 * BLAKE3_OUT_LEN])
+static void compress_subtree_to_parent_node(const blake3_impl_ops_t *ops,
+    const uint8_t *input, size_t input_len, const uint32_t key[8],
+    uint64_t chunk_counter, uint8_t flags, uint8_t out[2 * BLAKE3_OUT_LEN],
+    uint8_t *scratch, size_t scratch_len, const blake3_executor_t *ex,
+    const blake3_outboard_t *ob)
 {
-	uint8_t cv_array[MAX_SIMD_DEGREE_OR_2 * BLAKE3_OUT_LEN];
+	size_t half = input_len / BLAKE3_CHUNK_LEN / 2;
+	subtree_task_t left = {
+		.ops = ops,
+		.input = input,
+		.num_chunks = half,
+		.key = key,
+		.chunk_counter = chunk_counter,
+		.flags = flags,
+		.cv = out,
+		.scratch = scratch,
+		.scratch_len = scratch_len,
+		.ex = ex,
+		.ob = ob
+	};
+#ifndef _KERNEL
+	uint8_t *left_scratch = NULL;
+#endif
+	void *handle = NULL;
+
 	dprintf("%s\n", __func__);
-	size_t num_cvs = blake3_compress_subtree_wide(input, input_len, key,
-	    chunk_counter, flags, cv_array);
+#ifndef _KERNEL
+	if (executor_may_fork(ex, input_len)) {
+		size_t len = subtree_scratch_len(half, SUBTREE_WIDE_LEVELS);
+
+		left_scratch = malloc(len);
+		if (left_scratch != NULL) {
+			left.scratch = left_scratch;
+			left.scratch_len = len;
+			handle = ex->fork(ex->priv, compress_subtree_task,
+			    &left);
+		}
+	}
+#endif
+	if (handle == NULL)
+		compress_subtree_task(&left);
 
+	compress_subtree_cv(ops, &input[half * BLAKE3_CHUNK_LEN], half, key,
+	    chunk_counter + half, flags, &out[BLAKE3_OUT_LEN], scratch,
+	    scratch_len, ex, ob);
 
-	/*
-	 * If MAX_SIMD_DEGREE is greater than 2 and there's enough input,
-	 * compress_subtree_wide() returns more than 2 chaining values. Condense
-	 * them into 2 by forming parent nodes repeatedly.
-	 */
-	uint8_t out_array[MAX_SIMD_DEGREE_OR_2 * BLAKE3_OUT_LEN / 2];
-	while (num_cvs > 2) {
-		num_cvs = compress_parents_parallel(cv_array, num_cvs, key,
-		    flags, out_array);
-		memcpy(cv_array, out_array, num_cvs * BLAKE3_OUT_LEN);
-	}
-	memcpy(out, cv_array, 2 * BLAKE3_OUT_LEN);
+	if (handle != NULL)
+		ex->join(ex->priv, handle);
+#ifndef _KERNEL
+	free(left_scratch);
+#endif
 }
 
 static void hasher_init_base(BLAKE3_CTX *ctx, const uint32_t key[8],
     uint8_t flags)
 {
+	blake3_impl_get_class_ops(ctx->ops);
 	memcpy(ctx->key, key, BLAKE3_KEY_LEN);
 	//dprintf("%s\n", __func__);
 	chunk_state_init(&ctx->chunk, key, flags);
+	ctx->outboard = NULL;
 	ctx->cv_stack_len = 0;
+	ctx->cv_stack_size = BLAKE3_MAX_DEPTH + 1;
+}
+
+/*
+ * Copy the ops, the key and the chunk state of a context, which may be a
+ * compact one, into a context with an empty stack of the full size.
+ */
+static void hasher_copy_base(BLAKE3_CTX *dst, const BLAKE3_CTX *src)
+{
+	memcpy(dst, src, offsetof(BLAKE3_CTX, cv_stack));
+	dst->outboard = NULL;
+	dst->cv_stack_len = 0;
+	dst->cv_stack_size = BLAKE3_MAX_DEPTH + 1;
+}
+
+/*
+ * A stack of size entries holds the CVs of up to 2^(size - 1) chunks, see
+ * cv_stack_entries() below. Check that input_len more bytes fit.
+ */
+static boolean_t hasher_fits(const BLAKE3_CTX *ctx, uint64_t input_len)
+{
+	uint64_t len, max_len;
+
+	if (ctx->cv_stack_size > BLAKE3_MAX_DEPTH)
+		return (B_TRUE);
+
+	max_len = (1ULL << (ctx->cv_stack_size - 1)) * BLAKE3_CHUNK_LEN;
+	len = ctx->chunk.chunk_counter * BLAKE3_CHUNK_LEN +
+	    chunk_state_len(&ctx->chunk);
+
+	return (len <= max_len && input_len <= max_len - len);
+}
+
+/*
+ * CV stack entries for inputs of up to max_len bytes. A CV is pushed at a
+ * chunk counter below the number of chunks, the stack holds one entry per
+ * 1-bit of that counter (after merging) and the new one.
+ */
+static size_t cv_stack_entries(uint64_t max_len)
+{
+	uint64_t chunks = max_len / BLAKE3_CHUNK_LEN +
+	    (max_len % BLAKE3_CHUNK_LEN != 0);
+	size_t entries;
+
+	if (chunks < 2)
+		return (1);
+
+	entries = highest_one(chunks - 1) + 2;
+	return ((entries < BLAKE3_MAX_DEPTH + 1) ?
+	    entries : BLAKE3_MAX_DEPTH + 1);
+}
+
+size_t
+Blake3_CtxSize(uint64_t max_len)
+{
+	size_t size = offsetof(BLAKE3_CTX, cv_stack) +
+	    cv_stack_entries(max_len) * BLAKE3_OUT_LEN;
+
+	/* arrays of compact contexts stay aligned */
+	return ((size + sizeof (uint64_t) - 1) & ~(sizeof (uint64_t) - 1));
+}
+
+int
+Blake3_SetMaxLen(BLAKE3_CTX *ctx, uint64_t max_len)
+{
+	size_t entries = cv_stack_entries(max_len);
+
+	if (ctx->cv_stack_len > entries)
+		return (-EINVAL);
+
+	ctx->cv_stack_size = (uint8_t)entries;
+	return (0);
+}
+
+void
+Blake3_InitCompact(BLAKE3_CTX *ctx, const BLAKE3_CTX *tmpl, uint64_t max_len)
+{
+	dprintf("%s\n", __func__);
+	hasher_copy_base(ctx, tmpl);
+	chunk_state_reset(&ctx->chunk, ctx->key, 0);
+	ctx->cv_stack_size = (uint8_t)cv_stack_entries(max_len);
 }
 
 /*
@@ -503,14 +820,29 @@ static void hasher_init_base(BLAKE3_CTX *ctx, const uint32_t key[8],
  */
 static void hasher_merge_cv_stack(BLAKE3_CTX *ctx, uint64_t total_len)
 {
+	const blake3_impl_ops_t *ops = ctx->ops[BLAKE3_IMPL_SMALL];
 	size_t post_merge_stack_len = (size_t)popcnt(total_len);
+	uint64_t size;
 
 	dprintf("%s\n", __func__);
+	if (ctx->cv_stack_len <= post_merge_stack_len)
+		return;
+
+	/*
+	 * The stack below the top entry is merged already, it is the binary
+	 * representation of total_len minus the top entry. Every extra entry
+	 * halves the size of the top one, relative to the lowest set bit.
+	 */
+	size = (total_len & -total_len) >>
+	    (ctx->cv_stack_len - post_merge_stack_len);
 	while (ctx->cv_stack_len > post_merge_stack_len) {
 		uint8_t *parent_node =
 		    &ctx->cv_stack[(ctx->cv_stack_len - 2) * BLAKE3_OUT_LEN];
-		output_t output =
-		    parent_output(parent_node, ctx->key, ctx->chunk.flags);
+		output_t output = parent_output(ops, parent_node,
+		    ctx->key, ctx->chunk.flags);
+		size *= 2;
+		outboard_node(ctx->outboard, total_len - size, size,
+		    parent_node);
 		output_chaining_value(&output, parent_node);
 		ctx->cv_stack_len -= 1;
 	}
@@ -522,7 +854,7 @@ static void hasher_merge_cv_stack(BLAKE3_CTX *ctx, uint64_t total_len)
  * we know none of the merges are root.
  *
  * This setting is different. We want to feed as much input as possible to
- * compress_subtree_wide(), without setting aside anything for the chunk_state.
+ * the subtree engine, without setting aside anything for the chunk_state.
  * If the user gives us 64 KiB, we want to parallelize over all 64 KiB at once
  * as a single subtree, if at all possible.
  *
@@ -576,10 +908,127 @@ Blake3_InitKeyed(BLAKE3_CTX *ctx, const uint8_t key[BLAKE3_KEY_LEN])
 	hasher_init_base(ctx, key_words, KEYED_HASH);
 }
 
-static void
-Blake3_Update2(BLAKE3_CTX *ctx, const void *input, size_t input_len)
+void
+Blake3_PrepareDeriveKeyRaw(blake3_derive_ctx_t *dctx, const void *context,
+    size_t context_len)
+{
+	BLAKE3_CTX context_hasher;
+	uint8_t context_key[BLAKE3_KEY_LEN];
+
+	dprintf("%s\n", __func__);
+	hasher_init_base(&context_hasher, IV, DERIVE_KEY_CONTEXT);
+	Blake3_Update(&context_hasher, context, context_len);
+	Blake3_Final(&context_hasher, context_key);
+	load_key_words(context_key, dctx->key);
+}
+
+void
+Blake3_PrepareDeriveKey(blake3_derive_ctx_t *dctx, const char *context)
+{
+	Blake3_PrepareDeriveKeyRaw(dctx, context, strlen(context));
+}
+
+void
+Blake3_InitDeriveKeyPrepared(BLAKE3_CTX *ctx, const blake3_derive_ctx_t *dctx)
+{
+	dprintf("%s\n", __func__);
+	hasher_init_base(ctx, dctx->key, DERIVE_KEY_MATERIAL);
+}
+
+void
+Blake3_InitDeriveKeyRaw(BLAKE3_CTX *ctx, const void *context,
+    size_t context_len)
+{
+	blake3_derive_ctx_t dctx;
+
+	Blake3_PrepareDeriveKeyRaw(&dctx, context, context_len);
+	Blake3_InitDeriveKeyPrepared(ctx, &dctx);
+}
+
+void
+Blake3_InitDeriveKey(BLAKE3_CTX *ctx, const char *context)
+{
+	Blake3_InitDeriveKeyRaw(ctx, context, strlen(context));
+}
+
+/*
+ * Key material of up to one chunk is hashed with a bare chunk state, the
+ * hasher is only needed for longer material.
+ */
+void
+Blake3_DeriveKey(const blake3_derive_ctx_t *dctx, const void *material,
+    size_t material_len, uint8_t *out, size_t out_len)
+{
+	dprintf("%s\n", __func__);
+	if (material_len <= BLAKE3_CHUNK_LEN) {
+		const blake3_impl_ops_t *ops =
+		    blake3_impl_get_ops_len(material_len);
+		blake3_chunk_state_t chunk;
+		output_t output;
+
+		chunk_state_init(&chunk, dctx->key, DERIVE_KEY_MATERIAL);
+		chunk_state_update(ops, &chunk, material, material_len);
+		output = chunk_state_output(ops, &chunk);
+		output.ops = blake3_impl_get_ops_len(out_len);
+		if (out_len > 0)
+			output_root_bytes(&output, 0, out, out_len);
+	} else {
+		BLAKE3_CTX ctx;
+
+		Blake3_InitDeriveKeyPrepared(&ctx, dctx);
+		Blake3_Update(&ctx, material, material_len);
+		Blake3_FinalSeek(&ctx, 0, out, out_len);
+	}
+}
+
+/*
+ * Add input to a partial chunk in the chunk_state and return the number of
+ * bytes taken. If the chunk gets full and there's more input coming, its CV
+ * is pushed and the chunk_state is clear afterwards.
+ */
+static size_t hasher_fill_chunk(BLAKE3_CTX *ctx, const uint8_t *input,
+    size_t input_len)
+{
+	const blake3_impl_ops_t *ops = ctx->ops[BLAKE3_IMPL_SMALL];
+
+	if (chunk_state_len(&ctx->chunk) == 0) {
+		return (0);
+	}
+
+	size_t take = BLAKE3_CHUNK_LEN - chunk_state_len(&ctx->chunk);
+	if (take > input_len) {
+		take = input_len;
+	}
+	chunk_state_update(ops, &ctx->chunk, input, take);
+
+	/*
+	 * If we've filled the current chunk and there's more coming, finalize
+	 * this chunk and proceed. In this case we know it's not the root.
+	 */
+	if (input_len > take) {
+		output_t output = chunk_state_output(ops, &ctx->chunk);
+		uint8_t chunk_cv[32];
+		output_chaining_value(&output, chunk_cv);
+		hasher_push_cv(ctx, chunk_cv, ctx->chunk.chunk_counter);
+		chunk_state_reset(&ctx->chunk, ctx->key,
+		    ctx->chunk.chunk_counter + 1);
+	}
+
+	return (take);
+}
+
+/*
+ * The stack of a compact context is checked once here, so hasher_push_cv()
+ * never goes beyond cv_stack_size.
+ */
+static int
+Blake3_Update2(BLAKE3_CTX *ctx, const void *input, size_t input_len,
+    const blake3_executor_t *ex)
 {
 	dprintf("%s\n", __func__);
+	if (!hasher_fits(ctx, input_len))
+		return (-EFBIG);
+
 	/*
 	 * Explicitly checking for zero avoids causing UB by passing a null
 	 * pointer to memcpy. This comes up in practice with things like:
@@ -587,7 +1036,7 @@ Blake3_Update2(BLAKE3_CTX *ctx, const void *input, size_t input_len)
 	 *   blake3_hasher_update(&hasher, v.data(), v.size());
 	 */
 	if (input_len == 0) {
-		return;
+		return (0);
 	}
 
 	const uint8_t *input_bytes = (const uint8_t *)input;
@@ -596,36 +1045,28 @@ Blake3_Update2(BLAKE3_CTX *ctx, const void *input, size_t input_len)
 	 * If we have some partial chunk bytes in the internal chunk_state, we
 	 * need to finish that chunk first.
 	 */
-	if (chunk_state_len(&ctx->chunk) > 0) {
-		size_t take = BLAKE3_CHUNK_LEN - chunk_state_len(&ctx->chunk);
-		if (take > input_len) {
-			take = input_len;
-		}
-		chunk_state_update(&ctx->chunk, input_bytes, take);
-		input_bytes += take;
-		input_len -= take;
-		/*
-		 * If we've filled the current chunk and there's more coming,
-		 * finalize this chunk and proceed. In this case we know it's
-		 * not the root.
-		 */
-		if (input_len > 0) {
-			output_t output = chunk_state_output(&ctx->chunk);
-			uint8_t chunk_cv[32];
-			output_chaining_value(&output, chunk_cv);
-			hasher_push_cv(ctx, chunk_cv, ctx->chunk.chunk_counter);
-			chunk_state_reset(&ctx->chunk, ctx->key,
-			    ctx->chunk.chunk_counter + 1);
-		} else {
-			return;
-		}
+	size_t take = hasher_fill_chunk(ctx, input_bytes, input_len);
+	input_bytes += take;
+	input_len -= take;
+	if (input_len == 0) {
+		return (0);
 	}
 
+	/*
+	 * Scratch space for compress_subtree_iter(). The stack is enough for
+	 * subtrees of any size, the heap only makes large ones faster.
+	 */
+	uint8_t stack_scratch[SUBTREE_STACK_LEN];
+	size_t scratch_len;
+	uint8_t *scratch = subtree_scratch_get(
+	    round_down_to_power_of_2(input_len) / BLAKE3_CHUNK_LEN,
+	    stack_scratch, &scratch_len);
+
 	/*
 	 * Now the chunk_state is clear, and we have more input. If there's
 	 * more than a single chunk (so, definitely not the root chunk), hash
 	 * the largest whole subtree we can, with the full benefits of SIMD
-	 * (and maybe in the future, multi-threading) parallelism. Two
+	 * (and with a thread pool, multi-threading) parallelism. Two
 	 * restrictions:
 	 * - The subtree has to be a power-of-2 number of chunks. Only
 	 *   subtrees along the right edge can be incomplete, and we don't know
@@ -675,9 +1116,10 @@ Blake3_Update2(BLAKE3_CTX *ctx, const void *input, size_t input_len)
 			chunk_state_init(&chunk_state, ctx->key,
 			    ctx->chunk.flags);
 			chunk_state.chunk_counter = ctx->chunk.chunk_counter;
-			chunk_state_update(&chunk_state, input_bytes,
-			    subtree_len);
-			output_t output = chunk_state_output(&chunk_state);
+			chunk_state_update(ctx->ops[BLAKE3_IMPL_SMALL],
+			    &chunk_state, input_bytes, subtree_len);
+			output_t output = chunk_state_output(
+			    ctx->ops[BLAKE3_IMPL_SMALL], &chunk_state);
 			uint8_t cv[BLAKE3_OUT_LEN];
 			output_chaining_value(&output, cv);
 			hasher_push_cv(ctx, cv, chunk_state.chunk_counter);
@@ -688,9 +1130,12 @@ Blake3_Update2(BLAKE3_CTX *ctx, const void *input, size_t input_len)
 			 * enough input.
 			 */
 			uint8_t cv_pair[2 * BLAKE3_OUT_LEN];
-			compress_subtree_to_parent_node(input_bytes,
-			    subtree_len, ctx->key, ctx-> chunk.chunk_counter,
-			    ctx->chunk.flags, cv_pair);
+			compress_subtree_to_parent_node(
+			    ctx->ops[blake3_impl_class(subtree_len)],
+			    input_bytes, subtree_len, ctx->key,
+			    ctx->chunk.chunk_counter,
+			    ctx->chunk.flags, cv_pair, scratch, scratch_len, ex,
+			    ctx->outboard);
 			hasher_push_cv(ctx, cv_pair, ctx->chunk.chunk_counter);
 			hasher_push_cv(ctx, &cv_pair[BLAKE3_OUT_LEN],
 			    ctx->chunk.chunk_counter + (subtree_chunks / 2));
@@ -699,6 +1144,7 @@ Blake3_Update2(BLAKE3_CTX *ctx, const void *input, size_t input_len)
 		input_bytes += subtree_len;
 		input_len -= subtree_len;
 	}
+	subtree_scratch_put(scratch, stack_scratch);
 
 	/*
 	 * If there's any remaining input less than a full chunk, add it to
@@ -710,58 +1156,657 @@ Blake3_Update2(BLAKE3_CTX *ctx, const void *input, size_t input_len)
 	 * blake3_hasher_finalize below.
 	 */
 	if (input_len > 0) {
-		chunk_state_update(&ctx->chunk, input_bytes, input_len);
+		chunk_state_update(ctx->ops[BLAKE3_IMPL_SMALL], &ctx->chunk,
+		    input_bytes, input_len);
 		hasher_merge_cv_stack(ctx, ctx->chunk.chunk_counter);
 	}
+
+	return (0);
 }
 
-#if 1
-#define	BLAKE3_MAX	1024 * 64
-void
-Blake3_Update(BLAKE3_CTX *ctx, const void *input, size_t todo)
+int
+Blake3_Update(BLAKE3_CTX *ctx, const void *input, size_t input_len)
 {
 	dprintf("%s\n", __func__);
-	size_t done = 0;
-	const uint8_t *data = input;
-
-	/* max feed buffer to leave the stack size small */
-	while (todo != 0) {
-		size_t block = (todo >= BLAKE3_MAX) ? BLAKE3_MAX : todo;
-		Blake3_Update2(ctx, data + done, block);
-		done += block;
-		todo -= block;
-	}
+	return (Blake3_Update2(ctx, input, input_len, NULL));
 }
-#undef BLAKE3_MAX
-#endif
 
-void
-Blake3_Final(const BLAKE3_CTX *ctx, uint8_t *out)
+int
+Blake3_UpdateParallel(BLAKE3_CTX *ctx, const void *input, size_t input_len,
+    const blake3_executor_t *executor)
 {
 	dprintf("%s\n", __func__);
-	Blake3_FinalSeek(ctx, 0, out, BLAKE3_OUT_LEN);
+
+	return (Blake3_Update2(ctx, input, input_len, executor));
 }
 
-void
-Blake3_FinalSeek(const BLAKE3_CTX *ctx, uint64_t seek, uint8_t *out,
-    size_t out_len)
+#ifndef _KERNEL
+int
+Blake3_UpdatePool(BLAKE3_CTX *ctx, const void *input, size_t input_len,
+    blake3_pool_t *pool)
 {
+	blake3_executor_t executor;
+
 	dprintf("%s\n", __func__);
-	/*
-	 * Explicitly checking for zero avoids causing UB by passing a null
-	 * pointer to memcpy. This comes up in practice with things like:
-	 *   std::vector<uint8_t> v;
-	 *   blake3_hasher_finalize(&hasher, v.data(), v.size());
+	blake3_pool_executor(pool, &executor);
+	return (Blake3_UpdateParallel(ctx, input, input_len, &executor));
+}
+#endif
+
+uint64_t
+Blake3_Count(const BLAKE3_CTX *ctx)
+{
+	return (ctx->chunk.chunk_counter * BLAKE3_CHUNK_LEN +
+	    chunk_state_len(&ctx->chunk));
+}
+
+/*
+ * Layout of a saved state, all numbers are little endian:
+ *   0  magic "b3s" and version
+ *   4  flags, blocks_compressed, buf_len, cv_stack_len
+ *   8  chunk counter
+ *  16  key words
+ *  48  chaining value words of the chunk
+ *  80  buf_len bytes of the buffer, then cv_stack_len chaining values
+ */
+#define	STATE_VERSION		1
+#define	STATE_HEADER_LEN	80
+
+static void store64(uint8_t *dst, uint64_t w)
+{
+	store32(dst, counter_low(w));
+	store32(dst + 4, counter_high(w));
+}
+
+int
+Blake3_SaveState(const BLAKE3_CTX *ctx, uint8_t *buf, size_t len)
+{
+	const blake3_chunk_state_t *chunk = &ctx->chunk;
+	size_t size = STATE_HEADER_LEN + chunk->buf_len +
+	    (size_t)ctx->cv_stack_len * BLAKE3_OUT_LEN;
+	int i;
+
+	dprintf("%s\n", __func__);
+	if (len < size)
+		return (-ENOSPC);
+
+	memcpy(buf, "b3s", 3);
+	buf[3] = STATE_VERSION;
+	buf[4] = chunk->flags;
+	buf[5] = chunk->blocks_compressed;
+	buf[6] = chunk->buf_len;
+	buf[7] = ctx->cv_stack_len;
+	store64(&buf[8], chunk->chunk_counter);
+	for (i = 0; i < 8; i++) {
+		store32(&buf[16 + 4 * i], ctx->key[i]);
+		store32(&buf[48 + 4 * i], chunk->cv[i]);
+	}
+	memcpy(&buf[STATE_HEADER_LEN], chunk->buf, chunk->buf_len);
+	memcpy(&buf[STATE_HEADER_LEN + chunk->buf_len], ctx->cv_stack,
+	    (size_t)ctx->cv_stack_len * BLAKE3_OUT_LEN);
+
+	return ((int)size);
+}
+
+int
+Blake3_LoadState(BLAKE3_CTX *ctx, const uint8_t *buf, size_t len)
+{
+	blake3_chunk_state_t *chunk = &ctx->chunk;
+	uint8_t flags, blocks, buf_len, stack_len, stack_size;
+	uint64_t counter, merged;
+	int i;
+
+	dprintf("%s\n", __func__);
+	if (len < STATE_HEADER_LEN || memcmp(buf, "b3s", 3) != 0 ||
+	    buf[3] != STATE_VERSION)
+		return (-EINVAL);
+
+	/*
+	 * A full block stays buffered until more input comes, so a chunk
+	 * has at most 15 compressed blocks, and a compressed block is
+	 * followed by a buffered one.
 	 */
-	if (out_len == 0) {
-		return;
+	flags = buf[4];
+	blocks = buf[5];
+	buf_len = buf[6];
+	stack_len = buf[7];
+	counter = (uint64_t)load32(&buf[8]) |
+	    ((uint64_t)load32(&buf[12]) << 32);
+	if ((flags & ~(KEYED_HASH | DERIVE_KEY_CONTEXT |
+	    DERIVE_KEY_MATERIAL)) != 0 ||
+	    blocks >= BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN ||
+	    (blocks > 0 && buf_len == 0) ||
+	    buf_len > BLAKE3_BLOCK_LEN || stack_len > ctx->cv_stack_size ||
+	    len != STATE_HEADER_LEN + buf_len +
+	    (size_t)stack_len * BLAKE3_OUT_LEN)
+		return (-EINVAL);
+
+	/*
+	 * The stack holds one CV per 1-bit of the chunk counter, and one
+	 * more, which is not merged yet (see hasher_push_cv()). Anything
+	 * else would break the merges of the next update.
+	 */
+	merged = popcnt(counter);
+	if (counter > (1ULL << BLAKE3_MAX_DEPTH) ||
+	    (stack_len != merged && stack_len != merged + 1))
+		return (-EINVAL);
+
+	/* a compact context takes no state beyond its limit */
+	if (ctx->cv_stack_size <= BLAKE3_MAX_DEPTH &&
+	    counter * BLAKE3_CHUNK_LEN + blocks * BLAKE3_BLOCK_LEN + buf_len >
+	    (1ULL << (ctx->cv_stack_size - 1)) * BLAKE3_CHUNK_LEN)
+		return (-EINVAL);
+
+	/* a compact context keeps its limit */
+	stack_size = ctx->cv_stack_size;
+	hasher_init_base(ctx, IV, flags);
+	ctx->cv_stack_size = stack_size;
+	for (i = 0; i < 8; i++) {
+		ctx->key[i] = load32(&buf[16 + 4 * i]);
+		chunk->cv[i] = load32(&buf[48 + 4 * i]);
 	}
-	/* If the subtree stack is empty, then the current chunk is the root. */
-	if (ctx->cv_stack_len == 0) {
-		output_t output = chunk_state_output(&ctx->chunk);
-		output_root_bytes(&output, seek, out, out_len);
-		return;
+	chunk->chunk_counter = counter;
+	chunk->blocks_compressed = blocks;
+	chunk->buf_len = buf_len;
+	memcpy(chunk->buf, &buf[STATE_HEADER_LEN], buf_len);
+	memcpy(ctx->cv_stack, &buf[STATE_HEADER_LEN + buf_len],
+	    (size_t)stack_len * BLAKE3_OUT_LEN);
+	ctx->cv_stack_len = stack_len;
+
+	return (0);
+}
+
+#ifndef _KERNEL
+/* a context, which may share a hash_many() call with others */
+typedef struct {
+	BLAKE3_CTX *ctx;
+	const uint8_t *input;
+	size_t input_len;
+} update_lane_t;
+
+/*
+ * The hash_many() kernels start all lanes with one key and use one counter
+ * (or consecutive counters). So only contexts with the same key and flags,
+ * which are at the same chunk counter, can advance together.
+ */
+static int update_lane_cmp(const void *a, const void *b)
+{
+	const BLAKE3_CTX *x = ((const update_lane_t *)a)->ctx;
+	const BLAKE3_CTX *y = ((const update_lane_t *)b)->ctx;
+
+	if (x->chunk.chunk_counter != y->chunk.chunk_counter)
+		return (x->chunk.chunk_counter < y->chunk.chunk_counter ?
+		    -1 : 1);
+	if (x->chunk.flags != y->chunk.flags)
+		return (x->chunk.flags < y->chunk.flags ? -1 : 1);
+
+	return (memcmp(x->key, y->key, BLAKE3_KEY_LEN));
+}
+
+/* hash the next chunk of every lane and push the CVs to the contexts */
+static void update_lanes_chunk(const blake3_impl_ops_t *ops,
+    update_lane_t *lanes, size_t num_lanes)
+{
+	const uint8_t *chunks_array[MAX_SIMD_DEGREE];
+	uint8_t cvs[MAX_SIMD_DEGREE * BLAKE3_OUT_LEN];
+	BLAKE3_CTX *first = lanes[0].ctx;
+	size_t i;
+
+	/* there are always at least two lanes */
+	chunks_array[0] = lanes[0].input;
+	for (i = 1; i < num_lanes; i++)
+		chunks_array[i] = lanes[i].input;
+
+	ops->hash_many(chunks_array, num_lanes, BLAKE3_CHUNK_LEN /
+	    BLAKE3_BLOCK_LEN, first->key, first->chunk.chunk_counter, B_FALSE,
+	    first->chunk.flags, CHUNK_START, CHUNK_END, cvs);
+
+	for (i = 0; i < num_lanes; i++) {
+		BLAKE3_CTX *ctx = lanes[i].ctx;
+		hasher_push_cv(ctx, &cvs[i * BLAKE3_OUT_LEN],
+		    ctx->chunk.chunk_counter);
+		ctx->chunk.chunk_counter += 1;
+		lanes[i].input += BLAKE3_CHUNK_LEN;
+		lanes[i].input_len -= BLAKE3_CHUNK_LEN;
 	}
+}
+
+/* the rest of an input takes the normal path, keep the first error */
+static void update_rest(BLAKE3_CTX *ctx, const uint8_t *input,
+    size_t input_len, int *err)
+{
+	int ret = Blake3_Update(ctx, input, input_len);
+
+	if (*err == 0)
+		*err = ret;
+}
+
+int
+Blake3_UpdateMany(BLAKE3_CTX * const *ctxs, const uint8_t * const *inputs,
+    const size_t *lens, size_t n)
+{
+	const blake3_impl_ops_t *ops;
+	size_t degree, total = 0;
+	update_lane_t *lanes;
+	size_t i, j, num_lanes, grouped;
+	int cls, err = 0;
+
+	dprintf("%s\n", __func__);
+	if (n == 0)
+		return (0);
+	for (i = 0; i < n; i++) {
+		if (!hasher_fits(ctxs[i], lens[i]))
+			return (-EFBIG);
+		total += lens[i];
+	}
+
+	/* every group uses the ops bound to its first context */
+	cls = blake3_impl_class(total);
+	degree = (size_t)ctxs[0]->ops[cls]->degree;
+
+	lanes = malloc(n * sizeof (update_lane_t));
+	if (lanes == NULL) {
+		for (i = 0; i < n; i++)
+			update_rest(ctxs[i], inputs[i], lens[i], &err);
+		return (err);
+	}
+
+	/*
+	 * Finish the partial chunks first. Contexts with enough input to fill
+	 * all lanes by themselves take the normal subtree path.
+	 */
+	num_lanes = 0;
+	for (i = 0; i < n; i++) {
+		size_t take = hasher_fill_chunk(ctxs[i], inputs[i], lens[i]);
+		if (lens[i] - take > degree * BLAKE3_CHUNK_LEN) {
+			update_rest(ctxs[i], inputs[i] + take, lens[i] - take,
+			    &err);
+			continue;
+		}
+		lanes[num_lanes].ctx = ctxs[i];
+		lanes[num_lanes].input = inputs[i] + take;
+		lanes[num_lanes].input_len = lens[i] - take;
+		num_lanes++;
+	}
+
+	/*
+	 * Advance all contexts, which have more than one chunk left (so the
+	 * chunk is not the root), one chunk per round. Groups with only one
+	 * context left don't gain anything from that and are done below.
+	 */
+	do {
+		grouped = 0;
+		for (i = 0, j = 0; i < num_lanes; i++) {
+			if (lanes[i].input_len > BLAKE3_CHUNK_LEN)
+				lanes[j++] = lanes[i];
+			else
+				update_rest(lanes[i].ctx, lanes[i].input,
+				    lanes[i].input_len, &err);
+		}
+		num_lanes = j;
+		qsort(lanes, num_lanes, sizeof (update_lane_t),
+		    update_lane_cmp);
+
+		for (i = 0; i < num_lanes; i = j) {
+			ops = lanes[i].ctx->ops[cls];
+			degree = (size_t)ops->degree;
+			for (j = i + 1; j < num_lanes && j - i < degree &&
+			    update_lane_cmp(&lanes[i], &lanes[j]) == 0; j++)
+				;
+			if (j - i > 1) {
+				update_lanes_chunk(ops, &lanes[i], j - i);
+				grouped += j - i;
+			}
+		}
+	} while (grouped > 0);
+
+	for (i = 0; i < num_lanes; i++)
+		update_rest(lanes[i].ctx, lanes[i].input, lanes[i].input_len,
+		    &err);
+
+	free(lanes);
+	return (err);
+}
+#endif
+
+/*
+ * Lanes of the batch hashing, these messages have the same number of full
+ * blocks and can be fed to hash_many() together.
+ */
+typedef struct {
+	size_t idx[MAX_SIMD_DEGREE];
+	size_t len;
+} batch_lanes_t;
+
+/*
+ * Hash the full blocks of all lanes with one hash_many() call. When the
+ * messages end with a full block, hash_many() also does the CHUNK_END and
+ * ROOT compression and the output is already the digest. Otherwise the
+ * kernel can't do the trailing partial block, because it always uses a
+ * block_len of 64, so that block is compressed on its own afterwards.
+ */
+static void hash_batch_lanes(const blake3_impl_ops_t *ops,
+    const uint8_t * const *inputs, const size_t *lens, uint8_t * const *outs,
+    batch_lanes_t *lanes, size_t blocks, boolean_t complete)
+{
+	const uint8_t *lane_inputs[MAX_SIMD_DEGREE];
+	uint8_t cvs[MAX_SIMD_DEGREE * BLAKE3_OUT_LEN];
+	size_t i;
+
+	for (i = 0; i < lanes->len; i++)
+		lane_inputs[i] = inputs[lanes->idx[i]];
+
+	ops->hash_many(lane_inputs, lanes->len, blocks, IV, 0, B_FALSE, 0,
+	    CHUNK_START, complete ? CHUNK_END | ROOT : 0, cvs);
+
+	for (i = 0; i < lanes->len; i++) {
+		size_t idx = lanes->idx[i];
+		size_t tail = lens[idx] - blocks * BLAKE3_BLOCK_LEN;
+		uint8_t block[BLAKE3_BLOCK_LEN];
+		uint32_t cv[8];
+
+		if (complete) {
+			memcpy(outs[idx], &cvs[i * BLAKE3_OUT_LEN],
+			    BLAKE3_OUT_LEN);
+			continue;
+		}
+
+		load_key_words(&cvs[i * BLAKE3_OUT_LEN], cv);
+		memset(block, 0, BLAKE3_BLOCK_LEN);
+		memcpy(block, inputs[idx] + blocks * BLAKE3_BLOCK_LEN, tail);
+		ops->compress_in_place(cv, block, (uint8_t)tail, 0,
+		    CHUNK_END | ROOT);
+		store_cv_words(outs[idx], cv);
+	}
+	lanes->len = 0;
+}
+
+void
+Blake3_HashBatch(const uint8_t * const *inputs, const size_t *lens,
+    uint8_t * const *outs, size_t n)
+{
+	const blake3_impl_ops_t *ops;
+	/* indexed by number of full blocks and if these are all blocks */
+	batch_lanes_t lanes[BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN + 1][2];
+	size_t i, blocks, total = 0;
+	int complete;
+
+	dprintf("%s\n", __func__);
+	for (i = 0; i < n; i++)
+		total += lens[i];
+	ops = blake3_impl_get_ops_len(total);
+
+	for (blocks = 0; blocks < ARRAY_SIZE(lanes); blocks++) {
+		lanes[blocks][0].len = 0;
+		lanes[blocks][1].len = 0;
+	}
+
+	for (i = 0; i < n; i++) {
+		batch_lanes_t *b;
+
+		/* more than one chunk, there is a tree to build */
+		if (lens[i] > BLAKE3_CHUNK_LEN) {
+			BLAKE3_CTX ctx;
+			Blake3_Init(&ctx);
+			Blake3_Update(&ctx, inputs[i], lens[i]);
+			Blake3_Final(&ctx, outs[i]);
+			continue;
+		}
+
+		/* a single block, nothing to share with other lanes */
+		if (lens[i] < BLAKE3_BLOCK_LEN) {
+			uint8_t block[BLAKE3_BLOCK_LEN];
+			uint32_t cv[8];
+
+			memcpy(cv, IV, BLAKE3_KEY_LEN);
+			memset(block, 0, BLAKE3_BLOCK_LEN);
+			if (lens[i] > 0)
+				memcpy(block, inputs[i], lens[i]);
+			ops->compress_in_place(cv, block, (uint8_t)lens[i], 0,
+			    CHUNK_START | CHUNK_END | ROOT);
+			store_cv_words(outs[i], cv);
+			continue;
+		}
+
+		blocks = lens[i] / BLAKE3_BLOCK_LEN;
+		complete = (lens[i] % BLAKE3_BLOCK_LEN) == 0;
+		b = &lanes[blocks][complete];
+		b->idx[b->len++] = i;
+		if (b->len == (size_t)ops->degree)
+			hash_batch_lanes(ops, inputs, lens, outs, b, blocks,
+			    complete);
+	}
+
+	/* the remaining lanes */
+	for (blocks = 0; blocks < ARRAY_SIZE(lanes); blocks++) {
+		for (complete = 0; complete < 2; complete++) {
+			batch_lanes_t *b = &lanes[blocks][complete];
+			if (b->len > 0)
+				hash_batch_lanes(ops, inputs, lens, outs, b,
+				    blocks, complete);
+		}
+	}
+}
+
+#ifndef _KERNEL
+/*
+ * Hash n chunks of chunk_len bytes, one per hash_many() lane, lane i uses
+ * the chunk counter counter + i * step and writes its CV to cvs[i]. The
+ * trailing partial block of a chunk is compressed on its own, like in
+ * hash_batch_lanes().
+ */
+static void hash_records_chunks(const blake3_impl_ops_t *ops,
+    const uint8_t * const *inputs, size_t n, size_t chunk_len,
+    uint64_t counter, boolean_t step, uint8_t * const *cvs)
+{
+	uint8_t out[MAX_SIMD_DEGREE * BLAKE3_OUT_LEN];
+	size_t blocks = chunk_len / BLAKE3_BLOCK_LEN;
+	size_t tail = chunk_len % BLAKE3_BLOCK_LEN;
+	size_t i;
+
+	if (blocks > 0)
+		ops->hash_many(inputs, n, blocks, IV, counter, step, 0,
+		    CHUNK_START, tail ? 0 : CHUNK_END, out);
+
+	for (i = 0; i < n; i++) {
+		uint8_t flags = CHUNK_END;
+		uint8_t block[BLAKE3_BLOCK_LEN];
+		uint32_t words[8];
+
+		if (tail == 0) {
+			memcpy(cvs[i], &out[i * BLAKE3_OUT_LEN],
+			    BLAKE3_OUT_LEN);
+			continue;
+		}
+
+		if (blocks > 0) {
+			load_key_words(&out[i * BLAKE3_OUT_LEN], words);
+		} else {
+			memcpy(words, IV, BLAKE3_KEY_LEN);
+			flags |= CHUNK_START;
+		}
+		memset(block, 0, BLAKE3_BLOCK_LEN);
+		memcpy(block, inputs[i] + blocks * BLAKE3_BLOCK_LEN, tail);
+		ops->compress_in_place(words, block, (uint8_t)tail,
+		    counter + (step ? i : 0), flags);
+		store_cv_words(cvs[i], words);
+	}
+}
+
+/*
+ * One level of parent nodes for all records, num_cvs CVs per record are
+ * condensed to (num_cvs + 1) / 2 in place. The parent nodes of all records
+ * share the hash_many() lanes. With two CVs left, this is the root and the
+ * digests go to outs.
+ */
+static void hash_records_parents(const blake3_impl_ops_t *ops,
+    size_t num_records, size_t num_cvs, uint8_t *cvs, size_t stride,
+    uint8_t *outs)
+{
+	const uint8_t *parents[MAX_SIMD_DEGREE];
+	uint8_t *dest[MAX_SIMD_DEGREE];
+	uint8_t out[MAX_SIMD_DEGREE * BLAKE3_OUT_LEN];
+	uint8_t flags = (num_cvs == 2) ? PARENT | ROOT : PARENT;
+	size_t degree = (size_t)ops->degree;
+	size_t r, k, i, n = 0;
+
+	for (r = 0; r < num_records; r++) {
+		for (k = 0; k < num_cvs / 2; k++) {
+			parents[n] = cvs + r * stride + 2 * k * BLAKE3_OUT_LEN;
+			dest[n] = (num_cvs == 2) ? outs + r * BLAKE3_OUT_LEN :
+			    cvs + r * stride + k * BLAKE3_OUT_LEN;
+			if (++n < degree)
+				continue;
+
+			/* lanes are full, a node is written after its reads */
+			ops->hash_many(parents, n, 1, IV, 0, B_FALSE, flags,
+			    0, 0, out);
+			for (i = 0; i < n; i++)
+				memcpy(dest[i], &out[i * BLAKE3_OUT_LEN],
+				    BLAKE3_OUT_LEN);
+			n = 0;
+		}
+	}
+
+	if (n > 0) {
+		ops->hash_many(parents, n, 1, IV, 0, B_FALSE, flags, 0, 0,
+		    out);
+		for (i = 0; i < n; i++)
+			memcpy(dest[i], &out[i * BLAKE3_OUT_LEN],
+			    BLAKE3_OUT_LEN);
+	}
+
+	/* an odd CV moves up unchanged */
+	if (num_cvs % 2 == 1) {
+		for (r = 0; r < num_records; r++)
+			memcpy(cvs + r * stride + (num_cvs / 2) *
+			    BLAKE3_OUT_LEN, cvs + r * stride + (num_cvs - 1) *
+			    BLAKE3_OUT_LEN, BLAKE3_OUT_LEN);
+	}
+}
+
+int
+Blake3_HashRecords(const void *base, size_t record_len, size_t count,
+    uint8_t *outs)
+{
+	const blake3_impl_ops_t *ops = blake3_impl_get_ops_len(
+	    (count > 0 && record_len > SIZE_MAX / count) ?
+	    SIZE_MAX : record_len * count);
+	const uint8_t *records = (const uint8_t *)base;
+	size_t degree = (size_t)ops->degree;
+	size_t num_chunks, stride, levels, r, n, i, j, k, l;
+	const uint8_t *inputs[MAX_SIMD_DEGREE];
+	uint8_t *dest[MAX_SIMD_DEGREE];
+	size_t shape[64];
+	uint8_t *cvs;
+
+	dprintf("%s\n", __func__);
+
+	/* a single chunk is no tree, the batch code packs these already */
+	if (record_len <= BLAKE3_CHUNK_LEN) {
+		size_t lens[MAX_SIMD_DEGREE];
+
+		for (r = 0; r < count; r += n) {
+			n = (count - r < degree) ? count - r : degree;
+			for (i = 0; i < n; i++) {
+				inputs[i] = records + (r + i) * record_len;
+				lens[i] = record_len;
+				dest[i] = outs + (r + i) * BLAKE3_OUT_LEN;
+			}
+			Blake3_HashBatch(inputs, lens, dest, n);
+		}
+		return (0);
+	}
+
+	/*
+	 * All records have the same tree, so the number of CVs on each level
+	 * is known in advance. Pairing neighbours level by level and moving
+	 * an odd CV up gives the same left-balanced tree as left_len().
+	 */
+	num_chunks = (record_len + BLAKE3_CHUNK_LEN - 1) / BLAKE3_CHUNK_LEN;
+	shape[0] = num_chunks;
+	for (levels = 1; shape[levels - 1] > 2; levels++)
+		shape[levels] = (shape[levels - 1] + 1) / 2;
+
+	stride = num_chunks * BLAKE3_OUT_LEN;
+	cvs = malloc(degree * stride);
+	if (cvs == NULL)
+		return (-ENOMEM);
+
+	for (r = 0; r < count; r += n) {
+		const uint8_t *group = records + r * record_len;
+		n = (count - r < degree) ? count - r : degree;
+
+		for (j = 0; j < num_chunks; j += k) {
+			size_t chunk_len = BLAKE3_CHUNK_LEN;
+
+			/* the last chunk may be shorter, it has its own call */
+			k = (n == degree) ? 1 : degree;
+			if (j + k >= num_chunks) {
+				k = num_chunks - j;
+				if (k > 1)
+					k--;
+				else
+					chunk_len = record_len - j *
+					    BLAKE3_CHUNK_LEN;
+			}
+
+			/* one record per lane, all with the same counter */
+			if (k == 1) {
+				for (i = 0; i < n; i++) {
+					inputs[i] = group + i * record_len +
+					    j * BLAKE3_CHUNK_LEN;
+					dest[i] = cvs + i * stride +
+					    j * BLAKE3_OUT_LEN;
+				}
+				hash_records_chunks(ops, inputs, n, chunk_len,
+				    j, B_FALSE, dest);
+				continue;
+			}
+
+			/* too few records, consecutive chunks per record */
+			for (l = 0; l < n; l++) {
+				for (i = 0; i < k; i++) {
+					inputs[i] = group + l * record_len +
+					    (j + i) * BLAKE3_CHUNK_LEN;
+					dest[i] = cvs + l * stride +
+					    (j + i) * BLAKE3_OUT_LEN;
+				}
+				hash_records_chunks(ops, inputs, k, chunk_len,
+				    j, B_TRUE, dest);
+			}
+		}
+
+		for (l = 0; l < levels; l++)
+			hash_records_parents(ops, n, shape[l], cvs, stride,
+			    outs + r * BLAKE3_OUT_LEN);
+	}
+
+	free(cvs);
+	return (0);
+}
+#endif
+
+void
+Blake3_Final(const BLAKE3_CTX *ctx, uint8_t *out)
+{
+	dprintf("%s\n", __func__);
+	Blake3_FinalSeek(ctx, 0, out, BLAKE3_OUT_LEN);
+}
+
+/*
+ * The output of the topmost node over the chunk state and the stack entries
+ * from floor on. The entries below floor are subtrees left of the context,
+ * see Blake3_HashSubtree(), they are 0 for a whole input.
+ */
+static output_t hasher_output(const BLAKE3_CTX *ctx, size_t floor)
+{
+	const blake3_impl_ops_t *ops = ctx->ops[BLAKE3_IMPL_SMALL];
+
+	/* If the subtree stack is empty, then the current chunk is the root. */
+	if (ctx->cv_stack_len == floor)
+		return (chunk_state_output(ops, &ctx->chunk));
+
 	/*
 	 * If there are any bytes in the chunk state, finalize that chunk and
 	 * do a roll-up merge between that chunk hash and every subtree in the
@@ -773,22 +1818,786 @@ Blake3_FinalSeek(const BLAKE3_CTX *ctx, uint64_t seek, uint8_t *out,
 	 */
 	output_t output;
 	size_t cvs_remaining;
+	/* the chunks of the stack entries below, and the end of the tree */
+	uint64_t below = ctx->chunk.chunk_counter;
+	uint64_t end = below;
 	if (chunk_state_len(&ctx->chunk) > 0) {
 		cvs_remaining = ctx->cv_stack_len;
-		output = chunk_state_output(&ctx->chunk);
+		output = chunk_state_output(ops, &ctx->chunk);
+		end += 1;
 	} else {
 		/* There are always at least 2 CVs in the stack in this case. */
 		cvs_remaining = ctx->cv_stack_len - 2;
-		output = parent_output(&ctx->cv_stack[cvs_remaining * 32],
+		output = parent_output(ops,
+		    &ctx->cv_stack[cvs_remaining * 32],
 		    ctx->key, ctx->chunk.flags);
+		/* the top entry may be unmerged, see hasher_merge_cv_stack() */
+		below -= (below & -below) >>
+		    (ctx->cv_stack_len - popcnt(below));
+		below -= below & -below;
+		outboard_node(ctx->outboard, below, end - below,
+		    output.block);
 	}
-	while (cvs_remaining > 0) {
+	while (cvs_remaining > floor) {
 		cvs_remaining -= 1;
 		uint8_t parent_block[BLAKE3_BLOCK_LEN];
 		memcpy(parent_block, &ctx->cv_stack[cvs_remaining * 32], 32);
 		output_chaining_value(&output, &parent_block[32]);
-		output = parent_output(parent_block, ctx->key,
+		output = parent_output(ops, parent_block, ctx->key,
+		    ctx->chunk.flags);
+		below -= below & -below;
+		outboard_node(ctx->outboard, below, end - below, parent_block);
+	}
+
+	return (output);
+}
+
+void
+Blake3_FinalSeek(const BLAKE3_CTX *ctx, uint64_t seek, uint8_t *out,
+    size_t out_len)
+{
+	output_t output;
+
+	dprintf("%s\n", __func__);
+	/*
+	 * Explicitly checking for zero avoids causing UB by passing a null
+	 * pointer to memcpy. This comes up in practice with things like:
+	 *   std::vector<uint8_t> v;
+	 *   blake3_hasher_finalize(&hasher, v.data(), v.size());
+	 */
+	if (out_len == 0) {
+		return;
+	}
+
+	/* a long root output uses the ops of its size */
+	output = hasher_output(ctx, 0);
+	output.ops = ctx->ops[blake3_impl_class(out_len)];
+	output_root_bytes(&output, seek, out, out_len);
+}
+
+/* the number of chunks of a subtree, rounded up to a power of 2 */
+static uint64_t subtree_width(uint64_t len)
+{
+	uint64_t num_chunks = outboard_chunks(len);
+	uint64_t width = round_down_to_power_of_2(num_chunks);
+
+	return ((width == num_chunks) ? width : 2 * width);
+}
+
+/* the undone compression of a subtree */
+static output_t subtree_output(const BLAKE3_CTX *ctx,
+    const blake3_subtree_t *st)
+{
+	uint32_t input_cv[8];
+
+	load_key_words(st->input_cv, input_cv);
+	return (make_output(ctx->ops[BLAKE3_IMPL_SMALL], input_cv, st->block,
+	    st->block_len, (st->flags & PARENT) ? 0 : st->chunk, st->flags));
+}
+
+static void subtree_store(blake3_subtree_t *st, uint64_t chunk, uint64_t len,
+    const output_t *output)
+{
+	st->chunk = chunk;
+	st->len = len;
+	store_cv_words(st->input_cv, output->input_cv);
+	memcpy(st->block, output->block, BLAKE3_BLOCK_LEN);
+	st->block_len = output->block_len;
+	st->flags = output->flags;
+}
+
+/*
+ * The subtree is hashed by a context, which has a stack entry for each
+ * complete subtree left of it. These entries are never merged, because the
+ * subtree ends before they are complete, and hasher_output() leaves them.
+ */
+int
+Blake3_HashSubtree(const BLAKE3_CTX *ctx, const void *input,
+    size_t input_len, uint64_t chunk, const blake3_executor_t *executor,
+    blake3_subtree_t *st)
+{
+	BLAKE3_CTX sub;
+
+	dprintf("%s\n", __func__);
+	if ((input_len == 0 && chunk != 0) ||
+	    (chunk & (subtree_width(input_len) - 1)) != 0)
+		return (-EINVAL);
+
+	Blake3_SubtreeInit(&sub, ctx, chunk);
+	Blake3_Update2(&sub, input, input_len, executor);
+
+	return (Blake3_SubtreeFinal(&sub, chunk, st));
+}
+
+void
+Blake3_SubtreeInit(BLAKE3_CTX *sub, const BLAKE3_CTX *ctx, uint64_t chunk)
+{
+	size_t floor = popcnt(chunk);
+
+	hasher_copy_base(sub, ctx);
+	chunk_state_reset(&sub->chunk, sub->key, chunk);
+	memset(sub->cv_stack, 0, floor * BLAKE3_OUT_LEN);
+	sub->cv_stack_len = (uint8_t)floor;
+}
+
+int
+Blake3_SubtreeFinal(const BLAKE3_CTX *sub, uint64_t chunk,
+    blake3_subtree_t *st)
+{
+	uint64_t len;
+	output_t output;
+
+	if (sub->chunk.chunk_counter < chunk)
+		return (-EINVAL);
+
+	len = (sub->chunk.chunk_counter - chunk) * BLAKE3_CHUNK_LEN +
+	    chunk_state_len(&sub->chunk);
+	if ((len == 0 && chunk != 0) ||
+	    (chunk & (subtree_width(len) - 1)) != 0)
+		return (-EINVAL);
+
+	output = hasher_output(sub, popcnt(chunk));
+	subtree_store(st, chunk, len, &output);
+
+	return (0);
+}
+
+/*
+ * The subtrees before the last one are pushed like the chaining values of
+ * Blake3_Update(), the last one is merged with the stack like the chunk
+ * state in Blake3_FinalSeek().
+ */
+int
+Blake3_CombineSubtrees(const BLAKE3_CTX *ctx, const blake3_subtree_t *st,
+    size_t n, uint8_t *out, size_t out_len)
+{
+	const blake3_impl_ops_t *ops = ctx->ops[BLAKE3_IMPL_SMALL];
+	uint8_t mode = KEYED_HASH | DERIVE_KEY_CONTEXT | DERIVE_KEY_MATERIAL;
+	uint8_t cv[BLAKE3_OUT_LEN];
+	uint64_t next = 0;
+	output_t output;
+	BLAKE3_CTX sum;
+	size_t i;
+
+	dprintf("%s\n", __func__);
+	if (n == 0)
+		return (-EINVAL);
+
+	for (i = 0; i < n; i++) {
+		uint64_t width = subtree_width(st[i].len);
+
+		if (st[i].chunk != next || (next & (width - 1)) != 0 ||
+		    (st[i].len == 0 && i > 0) ||
+		    (st[i].flags & mode) != ctx->chunk.flags ||
+		    st[i].block_len > BLAKE3_BLOCK_LEN)
+			return (-EINVAL);
+		if (i < n - 1 && st[i].len != width * BLAKE3_CHUNK_LEN)
+			return (-EINVAL);
+		next += width;
+	}
+
+	hasher_copy_base(&sum, ctx);
+	for (i = 0; i < n - 1; i++) {
+		output = subtree_output(ctx, &st[i]);
+		output_chaining_value(&output, cv);
+		hasher_push_cv(&sum, cv, st[i].chunk);
+	}
+	hasher_merge_cv_stack(&sum, st[n - 1].chunk);
+
+	output = subtree_output(ctx, &st[n - 1]);
+	while (sum.cv_stack_len > 0) {
+		uint8_t parent_block[BLAKE3_BLOCK_LEN];
+
+		sum.cv_stack_len -= 1;
+		memcpy(parent_block,
+		    &sum.cv_stack[sum.cv_stack_len * BLAKE3_OUT_LEN],
+		    BLAKE3_OUT_LEN);
+		output_chaining_value(&output, &parent_block[BLAKE3_OUT_LEN]);
+		output = parent_output(ops, parent_block, ctx->key,
 		    ctx->chunk.flags);
 	}
+
+	if (out_len > 0) {
+		output.ops = ctx->ops[blake3_impl_class(out_len)];
+		output_root_bytes(&output, 0, out, out_len);
+	}
+
+	return (0);
+}
+
+#ifndef _KERNEL
+/*
+ * The completed subtrees of a positional context, sorted by their first
+ * chunk. Every subtree keeps its last compression undone, like the ones of
+ * Blake3_HashSubtree(), as any subtree starting at chunk 0 may be the root.
+ */
+struct blake3_pos {
+	BLAKE3_CTX ctx;
+	pthread_mutex_t lock;
+	blake3_subtree_t *st;
+	size_t num;
+	size_t size;
+	uint64_t input_len;	/* UINT64_MAX until finalized */
+};
+
+/* the chunk after the subtree */
+static uint64_t pos_end(const blake3_subtree_t *st)
+{
+	return (st->chunk + outboard_chunks(st->len));
+}
+
+/*
+ * Left and right are siblings, if left is a complete power of 2 subtree at
+ * a multiple of twice its size, and right follows with the same size. Or
+ * right is shorter, and ends the input: it has a partial chunk, or it ends
+ * at the length given to Blake3_PosFinal().
+ */
+static boolean_t pos_siblings(const blake3_pos_t *pos,
+    const blake3_subtree_t *left, const blake3_subtree_t *right)
+{
+	uint64_t size = outboard_chunks(left->len);
+	uint64_t rsize = outboard_chunks(right->len);
+
+	if (left->len != size * BLAKE3_CHUNK_LEN || (size & (size - 1)) ||
+	    (left->chunk & (2 * size - 1)) || right->chunk != left->chunk +
+	    size || rsize > size)
+		return (B_FALSE);
+
+	if (right->len == size * BLAKE3_CHUNK_LEN ||
+	    right->len % BLAKE3_CHUNK_LEN != 0)
+		return (B_TRUE);
+
+	return (right->chunk * BLAKE3_CHUNK_LEN + right->len ==
+	    pos->input_len);
+}
+
+/* merge the subtrees i and i + 1 into their parent */
+static void pos_merge(blake3_pos_t *pos, size_t i)
+{
+	const BLAKE3_CTX *ctx = &pos->ctx;
+	uint8_t block[BLAKE3_BLOCK_LEN];
+	output_t output;
+
+	output = subtree_output(ctx, &pos->st[i]);
+	output_chaining_value(&output, block);
+	output = subtree_output(ctx, &pos->st[i + 1]);
+	output_chaining_value(&output, &block[BLAKE3_OUT_LEN]);
+	output = parent_output(ctx->ops[BLAKE3_IMPL_SMALL], block, ctx->key,
+	    ctx->chunk.flags);
+	subtree_store(&pos->st[i], pos->st[i].chunk,
+	    pos->st[i].len + pos->st[i + 1].len, &output);
+
+	pos->num -= 1;
+	memmove(&pos->st[i + 1], &pos->st[i + 2],
+	    (pos->num - i - 1) * sizeof (blake3_subtree_t));
+}
+
+/* merge subtree i with its siblings, as long as there are any */
+static void pos_merge_all(blake3_pos_t *pos, size_t i)
+{
+	for (;;) {
+		if (i > 0 && pos_siblings(pos, &pos->st[i - 1], &pos->st[i])) {
+			pos_merge(pos, i - 1);
+			i -= 1;
+		} else if (i + 1 < pos->num &&
+		    pos_siblings(pos, &pos->st[i], &pos->st[i + 1])) {
+			pos_merge(pos, i);
+		} else {
+			break;
+		}
+	}
+}
+
+/*
+ * Insert a subtree into the sorted array and merge it. Nothing follows a
+ * partial chunk, that is the end of the input, and nothing comes after
+ * Blake3_PosFinal().
+ */
+static int pos_insert(blake3_pos_t *pos, const blake3_subtree_t *st)
+{
+	size_t lo = 0, hi = pos->num;
+
+	if (pos->input_len != UINT64_MAX)
+		return (-EINVAL);
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (pos->st[mid].chunk < st->chunk)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if ((lo > 0 && pos_end(&pos->st[lo - 1]) > st->chunk) ||
+	    (lo < pos->num && pos->st[lo].chunk < pos_end(st)))
+		return (-EINVAL);
+	if ((lo > 0 && pos->st[lo - 1].len % BLAKE3_CHUNK_LEN != 0) ||
+	    (lo < pos->num && st->len % BLAKE3_CHUNK_LEN != 0))
+		return (-EINVAL);
+
+	if (pos->num == pos->size) {
+		size_t size = pos->size ? 2 * pos->size : 16;
+		blake3_subtree_t *p = realloc(pos->st,
+		    size * sizeof (blake3_subtree_t));
+		if (p == NULL)
+			return (-ENOMEM);
+		pos->st = p;
+		pos->size = size;
+	}
+
+	memmove(&pos->st[lo + 1], &pos->st[lo],
+	    (pos->num - lo) * sizeof (blake3_subtree_t));
+	pos->st[lo] = *st;
+	pos->num += 1;
+	pos_merge_all(pos, lo);
+
+	return (0);
+}
+
+blake3_pos_t *
+Blake3_PosCreate(const BLAKE3_CTX *ctx)
+{
+	blake3_pos_t *pos = malloc(sizeof (blake3_pos_t));
+
+	dprintf("%s\n", __func__);
+	if (pos == NULL)
+		return (NULL);
+
+	hasher_copy_base(&pos->ctx, ctx);
+	pthread_mutex_init(&pos->lock, NULL);
+	pos->st = NULL;
+	pos->num = 0;
+	pos->size = 0;
+	pos->input_len = UINT64_MAX;
+
+	return (pos);
+}
+
+/*
+ * The part is hashed as the largest aligned power of 2 subtrees it holds,
+ * without the lock. Only the insertion of the subtrees is serialized.
+ */
+int
+Blake3_UpdateAt(blake3_pos_t *pos, uint64_t offset, const void *input,
+    size_t input_len)
+{
+	const uint8_t *input_bytes = (const uint8_t *)input;
+	uint64_t chunk = offset / BLAKE3_CHUNK_LEN;
+	blake3_subtree_t st;
+	int err = 0;
+
+	dprintf("%s\n", __func__);
+	if (offset % BLAKE3_CHUNK_LEN != 0)
+		return (-EINVAL);
+
+	while (input_len > 0 && err == 0) {
+		uint64_t width = round_down_to_power_of_2(
+		    (input_len + BLAKE3_CHUNK_LEN - 1) / BLAKE3_CHUNK_LEN);
+		size_t len;
+
+		while ((chunk & (width - 1)) != 0)
+			width /= 2;
+		len = (input_len < width * BLAKE3_CHUNK_LEN) ?
+		    input_len : width * BLAKE3_CHUNK_LEN;
+
+		err = Blake3_HashSubtree(&pos->ctx, input_bytes, len, chunk,
+		    NULL, &st);
+		if (err != 0)
+			break;
+		pthread_mutex_lock(&pos->lock);
+		err = pos_insert(pos, &st);
+		pthread_mutex_unlock(&pos->lock);
+
+		chunk += width;
+		input_bytes += len;
+		input_len -= len;
+	}
+
+	return (err);
+}
+
+int
+Blake3_PosFinal(blake3_pos_t *pos, uint64_t input_len, uint8_t *out,
+    size_t out_len)
+{
+	blake3_subtree_t st;
+	output_t output;
+	int err = -EINVAL;
+
+	dprintf("%s\n", __func__);
+	pthread_mutex_lock(&pos->lock);
+	/* the empty input is one empty chunk */
+	if (input_len == 0 && pos->num == 0) {
+		Blake3_HashSubtree(&pos->ctx, NULL, 0, 0, NULL, &st);
+		pos->st = malloc(sizeof (blake3_subtree_t));
+		if (pos->st != NULL) {
+			pos->st[0] = st;
+			pos->num = pos->size = 1;
+		}
+	}
+
+	/* now the right edge can be merged */
+	pos->input_len = input_len;
+	if (pos->num > 0)
+		pos_merge_all(pos, pos->num - 1);
+
+	if (pos->num == 1 && pos->st[0].chunk == 0 &&
+	    pos->st[0].len == input_len) {
+		output = subtree_output(&pos->ctx, &pos->st[0]);
+		if (out_len > 0) {
+			output.ops = pos->ctx.ops[blake3_impl_class(out_len)];
+			output_root_bytes(&output, 0, out, out_len);
+		}
+		err = 0;
+	}
+	pthread_mutex_unlock(&pos->lock);
+	return (err);
+}
+
+void
+Blake3_PosDestroy(blake3_pos_t *pos)
+{
+	pthread_mutex_destroy(&pos->lock);
+	free(pos->st);
+	free(pos);
+}
+#endif
+
+/*
+ * State of Blake3_VerifyRange(). The chunks [first, last] hold the range,
+ * a subtree without these and without the last chunk of the input is
+ * represented by the chaining value of its parent node in the outboard.
+ */
+typedef struct {
+	const BLAKE3_CTX *ctx;
+	const blake3_range_reader_t *rd;
+	uint64_t input_len;
+	uint64_t offset;
+	uint64_t end;
+	uint64_t first;
+	uint64_t last;
+	uint64_t last_chunk;
+	uint8_t *out;
+	uint8_t *scratch;
+	size_t scratch_len;
+	uint8_t buf[BLAKE3_CHUNK_LEN];
+} range_verify_t;
+
+static boolean_t range_needed(const range_verify_t *v, uint64_t chunk,
+    uint64_t num_chunks)
+{
+	if (chunk <= v->last && chunk + num_chunks > v->first)
+		return (B_TRUE);
+
+	return (chunk + num_chunks > v->last_chunk);
+}
+
+/* copy the part of the input at start, which lies within the range */
+static void range_copy(range_verify_t *v, uint64_t start, const uint8_t *buf,
+    size_t len)
+{
+	uint64_t from = (start > v->offset) ? start : v->offset;
+	uint64_t to = (start + len < v->end) ? start + len : v->end;
+
+	if (from < to)
+		memcpy(v->out + (from - v->offset), buf + (from - start),
+		    to - from);
+}
+
+static void range_output(const output_t *output, uint8_t cv[BLAKE3_OUT_LEN],
+    boolean_t root)
+{
+	if (root)
+		output_root_bytes(output, 0, cv, BLAKE3_OUT_LEN);
+	else
+		output_chaining_value(output, cv);
+}
+
+/*
+ * Recompute the chaining value of the subtree over the chunks [chunk, chunk
+ * + num_chunks). Complete subtrees within the range are read in place and
+ * hashed with the full width of the implementation.
+ */
+static int range_subtree(range_verify_t *v, uint64_t chunk,
+    uint64_t num_chunks, uint8_t cv[BLAKE3_OUT_LEN], boolean_t root)
+{
+	const BLAKE3_CTX *ctx = v->ctx;
+	const blake3_impl_ops_t *ops = ctx->ops[BLAKE3_IMPL_SMALL];
+	uint64_t start = chunk * BLAKE3_CHUNK_LEN;
+	uint64_t len = v->input_len - start;
+	boolean_t complete = num_chunks <= len / BLAKE3_CHUNK_LEN;
+	uint8_t node[BLAKE3_BLOCK_LEN];
+	uint64_t left, offset;
+	output_t output;
+	int err;
+
+	if (complete)
+		len = num_chunks * BLAKE3_CHUNK_LEN;
+
+	if (!root && complete && (num_chunks & (num_chunks - 1)) == 0 &&
+	    start >= v->offset && start + len <= v->end) {
+		uint8_t *dest = v->out + (start - v->offset);
+
+		if (v->rd->read_input(v->rd->priv, start, dest, len) != 0)
+			return (-EIO);
+		compress_subtree_iter(ctx->ops[blake3_impl_class(len)], dest,
+		    num_chunks, ctx->key, chunk, ctx->chunk.flags, cv,
+		    v->scratch, v->scratch_len, NULL);
+		return (0);
+	}
+
+	if (num_chunks == 1) {
+		blake3_chunk_state_t chunk_state;
+
+		if (len > 0 &&
+		    v->rd->read_input(v->rd->priv, start, v->buf, len) != 0)
+			return (-EIO);
+		chunk_state_init(&chunk_state, ctx->key, ctx->chunk.flags);
+		chunk_state.chunk_counter = chunk;
+		chunk_state_update(ops, &chunk_state, v->buf, len);
+		range_copy(v, start, v->buf, len);
+		output = chunk_state_output(ops, &chunk_state);
+		range_output(&output, cv, root);
+		return (0);
+	}
+
+	/* the left subtree is the largest power of 2 of complete chunks */
+	offset = outboard_offset(v->input_len, chunk, num_chunks);
+	if (offset == UINT64_MAX)
+		return (-EINVAL);
+	if (v->rd->read_outboard(v->rd->priv, offset, node, BLAKE3_BLOCK_LEN))
+		return (-EIO);
+
+	left = round_down_to_power_of_2(num_chunks - 1);
+	if (range_needed(v, chunk, left)) {
+		err = range_subtree(v, chunk, left, node, B_FALSE);
+		if (err != 0)
+			return (err);
+	}
+	if (range_needed(v, chunk + left, num_chunks - left)) {
+		err = range_subtree(v, chunk + left, num_chunks - left,
+		    &node[BLAKE3_OUT_LEN], B_FALSE);
+		if (err != 0)
+			return (err);
+	}
+
+	output = parent_output(ops, node, ctx->key, ctx->chunk.flags);
+	range_output(&output, cv, root);
+	return (0);
+}
+
+int
+Blake3_VerifyRange(const BLAKE3_CTX *ctx, const uint8_t hash[BLAKE3_OUT_LEN],
+    const blake3_range_reader_t *rd, uint64_t offset, size_t len,
+    uint8_t *out)
+{
+	uint8_t header[OUTBOARD_HEADER_LEN];
+	uint8_t cv[BLAKE3_OUT_LEN];
+	uint8_t stack_scratch[SUBTREE_STACK_LEN];
+	range_verify_t v;
+	int i, err;
+
+	dprintf("%s\n", __func__);
+	if (rd->read_outboard(rd->priv, 0, header, OUTBOARD_HEADER_LEN) != 0)
+		return (-EIO);
+
+	v.input_len = 0;
+	for (i = 0; i < OUTBOARD_HEADER_LEN; i++)
+		v.input_len |= (uint64_t)header[i] << (8 * i);
+	if (offset > v.input_len || len > v.input_len - offset)
+		return (-EINVAL);
+
+	v.ctx = ctx;
+	v.rd = rd;
+	v.offset = offset;
+	v.end = offset + len;
+	v.out = out;
+	v.last_chunk = outboard_chunks(v.input_len) - 1;
+	if (len > 0) {
+		v.first = offset / BLAKE3_CHUNK_LEN;
+		v.last = (v.end - 1) / BLAKE3_CHUNK_LEN;
+	} else {
+		v.first = v.last = v.last_chunk;
+	}
+
+	/* complete subtrees within the range are hashed in one pass */
+	v.scratch = subtree_scratch_get(len / BLAKE3_CHUNK_LEN, stack_scratch,
+	    &v.scratch_len);
+
+	err = range_subtree(&v, 0, v.last_chunk + 1, cv, B_TRUE);
+	if (err == 0 && memcmp(cv, hash, BLAKE3_OUT_LEN) != 0)
+		err = -EBADMSG;
+	subtree_scratch_put(v.scratch, stack_scratch);
+
+	return (err);
+}
+
+#ifndef _KERNEL
+/*
+ * The retained tree stores one level of chaining values above the other.
+ * Pairing neighbours and moving an odd CV up unchanged gives the same tree
+ * as in Blake3_HashRecords(), so the ancestors of the chunks [c0, c1] on
+ * level k are the entries [c0 >> k, c1 >> k]. The top level has two CVs,
+ * they are the root node. An input of one chunk has just the root chunk.
+ */
+struct blake3_tree {
+	const blake3_impl_ops_t *ops[BLAKE3_IMPL_CLASSES];
+	uint32_t key[8];
+	uint8_t flags;
+	size_t input_len;
+	size_t num_chunks;
+	size_t num_levels;
+	size_t level_len[BLAKE3_MAX_DEPTH + 1];
+	uint8_t *levels[BLAKE3_MAX_DEPTH + 1];
+	output_t root;
+	uint8_t cvs[];
+};
+
+/* hash the chunk i of the input */
+static output_t tree_chunk_output(const blake3_tree_t *tree,
+    const uint8_t *input, size_t i)
+{
+	const blake3_impl_ops_t *ops = tree->ops[BLAKE3_IMPL_SMALL];
+	size_t start = i * BLAKE3_CHUNK_LEN;
+	blake3_chunk_state_t chunk_state;
+
+	chunk_state_init(&chunk_state, tree->key, tree->flags);
+	chunk_state.chunk_counter = i;
+	chunk_state_update(ops, &chunk_state, input + start,
+	    tree->input_len - start);
+	return (chunk_state_output(ops, &chunk_state));
+}
+
+/* rehash the chunks [c0, c1] and their ancestors */
+static void tree_rehash(blake3_tree_t *tree, const uint8_t *input,
+    size_t c0, size_t c1)
+{
+	const blake3_impl_ops_t *ops = tree->ops[blake3_impl_class(
+	    (c1 - c0 + 1) * BLAKE3_CHUNK_LEN)];
+	const uint8_t *inputs[MAX_SIMD_DEGREE];
+	size_t degree = (size_t)ops->degree;
+	size_t last = tree->num_chunks - 1;
+	size_t i, j, n, k, end;
+	output_t output;
+
+	if (tree->num_chunks == 1) {
+		tree->root = tree_chunk_output(tree, input, 0);
+		return;
+	}
+
+	/* the complete chunks, the last one may be short */
+	end = (c1 < last) ? c1 + 1 : last;
+	for (i = c0; i < end; i += n) {
+		n = (end - i < degree) ? end - i : degree;
+		for (k = 0; k < n; k++)
+			inputs[k] = input + (i + k) * BLAKE3_CHUNK_LEN;
+		ops->hash_many(inputs, n, BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN,
+		    tree->key, i, B_TRUE, tree->flags, CHUNK_START, CHUNK_END,
+		    &tree->levels[0][i * BLAKE3_OUT_LEN]);
+	}
+	if (c1 == last) {
+		output = tree_chunk_output(tree, input, last);
+		output_chaining_value(&output,
+		    &tree->levels[0][last * BLAKE3_OUT_LEN]);
+	}
+
+	/* the parents of each level with one hash_many() call per degree */
+	for (k = 1; k < tree->num_levels; k++) {
+		const uint8_t *below = tree->levels[k - 1];
+		size_t pairs = tree->level_len[k - 1] / 2;
+
+		c0 >>= 1;
+		c1 >>= 1;
+		end = (c1 < pairs) ? c1 + 1 : pairs;
+		for (i = c0; i < end; i += n) {
+			n = (end - i < degree) ? end - i : degree;
+			for (j = 0; j < n; j++)
+				inputs[j] = below + 2 * (i + j) *
+				    BLAKE3_OUT_LEN;
+			ops->hash_many(inputs, n, 1, tree->key, 0, B_FALSE,
+			    tree->flags | PARENT, 0, 0,
+			    &tree->levels[k][i * BLAKE3_OUT_LEN]);
+		}
+
+		/* an odd CV moves up unchanged */
+		if (c1 >= pairs)
+			memcpy(&tree->levels[k][pairs * BLAKE3_OUT_LEN],
+			    &below[2 * pairs * BLAKE3_OUT_LEN],
+			    BLAKE3_OUT_LEN);
+	}
+
+	tree->root = parent_output(tree->ops[BLAKE3_IMPL_SMALL],
+	    tree->levels[tree->num_levels - 1], tree->key, tree->flags);
+}
+
+blake3_tree_t *
+Blake3_TreeCreate(const BLAKE3_CTX *ctx, const void *input, size_t input_len)
+{
+	size_t shape[BLAKE3_MAX_DEPTH + 1];
+	size_t num_levels, total, k;
+	blake3_tree_t *tree;
+
+	dprintf("%s\n", __func__);
+	shape[0] = (input_len > BLAKE3_CHUNK_LEN) ?
+	    (input_len + BLAKE3_CHUNK_LEN - 1) / BLAKE3_CHUNK_LEN : 1;
+	total = shape[0];
+	for (num_levels = 1; shape[num_levels - 1] > 2; num_levels++) {
+		shape[num_levels] = (shape[num_levels - 1] + 1) / 2;
+		total += shape[num_levels];
+	}
+
+	tree = malloc(sizeof (blake3_tree_t) + total * BLAKE3_OUT_LEN);
+	if (tree == NULL)
+		return (NULL);
+
+	memcpy(tree->ops, ctx->ops, sizeof (tree->ops));
+	memcpy(tree->key, ctx->key, BLAKE3_KEY_LEN);
+	tree->flags = ctx->chunk.flags;
+	tree->input_len = input_len;
+	tree->num_chunks = shape[0];
+	tree->num_levels = num_levels;
+	for (k = 0, total = 0; k < num_levels; k++) {
+		tree->level_len[k] = shape[k];
+		tree->levels[k] = &tree->cvs[total * BLAKE3_OUT_LEN];
+		total += shape[k];
+	}
+
+	tree_rehash(tree, input, 0, tree->num_chunks - 1);
+	return (tree);
+}
+
+int
+Blake3_TreeUpdateRange(blake3_tree_t *tree, const void *input, size_t offset,
+    size_t len)
+{
+	dprintf("%s\n", __func__);
+	if (offset > tree->input_len || len > tree->input_len - offset)
+		return (-EINVAL);
+
+	if (len == 0)
+		return (0);
+
+	tree_rehash(tree, input, offset / BLAKE3_CHUNK_LEN,
+	    (offset + len - 1) / BLAKE3_CHUNK_LEN);
+	return (0);
+}
+
+void
+Blake3_TreeFinalSeek(const blake3_tree_t *tree, uint64_t seek, uint8_t *out,
+    size_t out_len)
+{
+	output_t output = tree->root;
+
+	dprintf("%s\n", __func__);
+	if (out_len == 0)
+		return;
+
+	output.ops = tree->ops[blake3_impl_class(out_len)];
 	output_root_bytes(&output, seek, out, out_len);
 }
+
+void
+Blake3_TreeDestroy(blake3_tree_t *tree)
+{
+	free(tree);
+}
+#endif
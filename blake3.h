@@ -21,6 +21,7 @@
 extern "C" {
 #endif
 
+#define	BLAKE3_VERSION_STRING	"1.3.1"
 #define	BLAKE3_KEY_LEN		32
 #define	BLAKE3_OUT_LEN		32
 #define	BLAKE3_MAX_DEPTH	54
@@ -40,10 +41,31 @@ typedef struct {
 	uint8_t flags;
 } blake3_chunk_state_t;
 
+/* implementation ops, see blake3_impl.h */
+struct blake3_impl_ops;
+
+/* outboard tree, see Blake3_SetOutboard() */
+struct blake3_outboard;
+
+/* input size classes, each one may have its own implementation */
+#define	BLAKE3_IMPL_SMALL	0	/* below 4 KiB */
+#define	BLAKE3_IMPL_MEDIUM	1	/* below 64 KiB */
+#define	BLAKE3_IMPL_LARGE	2
+#define	BLAKE3_IMPL_CLASSES	3
+
+/*
+ * The fields every update touches come first: the chunk state with its cv,
+ * buffer and counter fills the first cache line, the key and the stack
+ * length follow.
+ */
 typedef struct {
-	uint32_t key[8];
 	blake3_chunk_state_t chunk;
+	uint32_t key[8];
 	uint8_t cv_stack_len;
+	uint8_t cv_stack_size;	/* entries, see Blake3_SetMaxLen() */
+	/* the implementations are selected once, when the context is set up */
+	const struct blake3_impl_ops *ops[BLAKE3_IMPL_CLASSES];
+	const struct blake3_outboard *outboard;	/* NULL if none */
 
 	/*
 	 * The stack size is MAX_DEPTH + 1 because we do lazy merging. For
@@ -58,11 +80,292 @@ typedef struct {
 /* init the context for hash operation */
 void Blake3_Init(BLAKE3_CTX *ctx);
 
+/*
+ * Compact contexts: the CV stack is the last member of BLAKE3_CTX, and an
+ * input of up to max_len bytes needs only a few of its entries. Such a
+ * context fits into Blake3_CtxSize(max_len) bytes, e.g. 536 instead of
+ * 1944 bytes for 1 MiB. It is started with Blake3_InitCompact(), also for
+ * every reuse, as the other init functions start a context of the full
+ * size. A compact context must not be copied with sizeof (BLAKE3_CTX).
+ *
+ * The limit is a hard one: it is max_len rounded up to a power of 2 chunks,
+ * updates beyond it fail with -EFBIG and leave the context as it was.
+ * Blake3_LoadState() keeps it.
+ */
+size_t Blake3_CtxSize(uint64_t max_len);
+
+/*
+ * Start ctx for inputs of up to max_len bytes, with the mode and key of
+ * tmpl, an initialized context of the full size.
+ */
+void Blake3_InitCompact(BLAKE3_CTX *ctx, const BLAKE3_CTX *tmpl,
+    uint64_t max_len);
+
+/* limit ctx to inputs of max_len bytes, return 0 or -EINVAL */
+int Blake3_SetMaxLen(BLAKE3_CTX *ctx, uint64_t max_len);
+
 /* init the context for a MAC and/or tree hash operation */
 void Blake3_InitKeyed(BLAKE3_CTX *ctx, const uint8_t key[BLAKE3_KEY_LEN]);
 
-/* process the input bytes */
-void Blake3_Update(BLAKE3_CTX *ctx, const void *input, size_t input_len);
+/* init the context for key derivation, context is a hardcoded string */
+void Blake3_InitDeriveKey(BLAKE3_CTX *ctx, const char *context);
+
+/* init the context for key derivation, context is given with its length */
+void Blake3_InitDeriveKeyRaw(BLAKE3_CTX *ctx, const void *context,
+    size_t context_len);
+
+/*
+ * Prepared context string for key derivation. The context string is
+ * hashed once, every derivation from it starts with the cached key.
+ */
+typedef struct {
+	uint32_t key[8];
+} blake3_derive_ctx_t;
+
+/* hash the context string into dctx */
+void Blake3_PrepareDeriveKey(blake3_derive_ctx_t *dctx, const char *context);
+
+/* hash the context string of context_len bytes into dctx */
+void Blake3_PrepareDeriveKeyRaw(blake3_derive_ctx_t *dctx,
+    const void *context, size_t context_len);
+
+/* init the context for key derivation with a prepared context string */
+void Blake3_InitDeriveKeyPrepared(BLAKE3_CTX *ctx,
+    const blake3_derive_ctx_t *dctx);
+
+/* derive out_len bytes of key from the key material */
+void Blake3_DeriveKey(const blake3_derive_ctx_t *dctx, const void *material,
+    size_t material_len, uint8_t *out, size_t out_len);
+
+/* process the input bytes, return 0 or -EFBIG beyond a compact limit */
+int Blake3_Update(BLAKE3_CTX *ctx, const void *input, size_t input_len);
+
+/*
+ * Executor for parallel hashing, supplied by the caller. fork() hands
+ * func(arg) to some thread of the host and returns a handle for join(),
+ * which must not return before func(arg) has finished. When fork()
+ * returns NULL, func(arg) is called directly. Subtrees smaller than
+ * min_len (0 = 128 KiB) are never forked.
+ */
+typedef struct blake3_executor {
+	void *(*fork)(void *priv, void (*func)(void *arg), void *arg);
+	void (*join)(void *priv, void *handle);
+	void *priv;
+	size_t min_len;
+} blake3_executor_t;
+
+/* process the input bytes, large subtrees are forked via executor */
+int Blake3_UpdateParallel(BLAKE3_CTX *ctx, const void *input,
+    size_t input_len, const blake3_executor_t *executor);
+
+/*
+ * Outboard tree in the Bao format: the input length as 8 byte little endian
+ * number, followed by all parent nodes of the tree in pre-order, 64 bytes
+ * each (the chaining values of both children). The chunks themselves are
+ * not part of it. With the outboard any range of the input can be verified
+ * against the root hash, without hashing the rest.
+ *
+ * write() gets the encoded bytes together with their offset, it is called
+ * from executor threads too, but never twice for the same offset at once.
+ * input_len fixes the shape of the tree, the input must have this length.
+ */
+typedef struct blake3_outboard {
+	void (*write)(void *priv, uint64_t offset, const void *buf, size_t len);
+	void *priv;
+	uint64_t input_len;
+} blake3_outboard_t;
+
+/* size of the outboard tree for input_len bytes */
+uint64_t Blake3_OutboardSize(uint64_t input_len);
+
+/*
+ * Write the outboard tree while hashing, the header is written right away.
+ * Blake3_Final() writes the nodes on the right edge of the tree.
+ */
+void Blake3_SetOutboard(BLAKE3_CTX *ctx, const blake3_outboard_t *ob);
+
+/*
+ * Random access to an input and its outboard tree. Both read() functions
+ * fill buf with len bytes at offset and return 0, or non-zero on errors.
+ */
+typedef struct blake3_range_reader {
+	int (*read_input)(void *priv, uint64_t offset, void *buf, size_t len);
+	int (*read_outboard)(void *priv, uint64_t offset, void *buf,
+	    size_t len);
+	void *priv;
+} blake3_range_reader_t;
+
+/*
+ * Read len bytes at offset of the input into out and verify them against
+ * the root hash. Only the chunks of the range, the last chunk (it confirms
+ * the input length of the outboard) and the parent nodes on their paths to
+ * the root are read and hashed. ctx is an initialized context, it gives the
+ * mode and the key. Returns 0, -EINVAL if the range is beyond the input,
+ * -EIO on read errors, or -EBADMSG if the hash doesn't match. Unless 0 is
+ * returned, the content of out is undefined.
+ */
+int Blake3_VerifyRange(const BLAKE3_CTX *ctx,
+    const uint8_t hash[BLAKE3_OUT_LEN], const blake3_range_reader_t *rd,
+    uint64_t offset, size_t len, uint8_t *out);
+
+#ifndef _KERNEL
+/*
+ * Retained tree: all chaining values of the chunks and parents of an input
+ * are kept, so a modification in place only rehashes the modified chunks
+ * and their ancestors. It takes about 64 bytes per chunk of the input.
+ */
+typedef struct blake3_tree blake3_tree_t;
+
+/* hash input_len bytes, ctx is an initialized context for mode and key */
+blake3_tree_t *Blake3_TreeCreate(const BLAKE3_CTX *ctx, const void *input,
+    size_t input_len);
+
+/*
+ * Rehash the tree after the bytes [offset, offset + len) of input have
+ * changed, input is the whole buffer. Returns 0 or -EINVAL.
+ */
+int Blake3_TreeUpdateRange(blake3_tree_t *tree, const void *input,
+    size_t offset, size_t len);
+
+/* output the root hash of the tree, from seek on */
+void Blake3_TreeFinalSeek(const blake3_tree_t *tree, uint64_t seek,
+    uint8_t *out, size_t out_len);
+
+/* free the tree */
+void Blake3_TreeDestroy(blake3_tree_t *tree);
+
+/* work-stealing thread pool for multi-threaded hashing */
+typedef struct blake3_pool blake3_pool_t;
+
+/* create pool with nthreads threads (0 = number of cpus, caller included) */
+extern blake3_pool_t *blake3_pool_create(unsigned int nthreads);
+
+/* stop the threads and free the pool */
+extern void blake3_pool_destroy(blake3_pool_t *pool);
+
+/* setup executor, which runs the forked subtrees on the pool */
+extern void blake3_pool_executor(blake3_pool_t *pool,
+    blake3_executor_t *executor);
+
+/* process the input bytes, large subtrees are hashed on the pool */
+int Blake3_UpdatePool(BLAKE3_CTX *ctx, const void *input, size_t input_len,
+    blake3_pool_t *pool);
+#endif
+
+#ifndef _KERNEL
+/*
+ * Process the next input bytes of n contexts in lockstep. Returns 0, or
+ * -EFBIG without any input processed, if one context would exceed its limit.
+ */
+int Blake3_UpdateMany(BLAKE3_CTX * const *ctxs, const uint8_t * const *inputs,
+    const size_t *lens, size_t n);
+#endif
+
+/* hash n independent messages, outs[i] gets BLAKE3_OUT_LEN bytes */
+void Blake3_HashBatch(const uint8_t * const *inputs, const size_t *lens,
+    uint8_t * const *outs, size_t n);
+
+#ifndef _KERNEL
+/* hash count records of record_len bytes, outs gets count digests */
+int Blake3_HashRecords(const void *base, size_t record_len, size_t count,
+    uint8_t *outs);
+#endif
+
+/*
+ * Subtree of the input, hashed apart from the rest, e.g. in another
+ * process. It keeps the last compression of the subtree undone, because
+ * only the coordinator knows whether this is the root. input_cv, block,
+ * block_len and flags are the input of that compression, input_cv is little
+ * endian.
+ */
+typedef struct {
+	uint64_t chunk;		/* index of the first chunk */
+	uint64_t len;		/* input bytes */
+	uint8_t input_cv[BLAKE3_OUT_LEN];
+	uint8_t block[BLAKE3_BLOCK_LEN];
+	uint8_t block_len;
+	uint8_t flags;
+} blake3_subtree_t;
+
+/*
+ * Hash the input_len bytes which start at chunk, ctx is an initialized
+ * context for mode and key. All subtrees but the last are a power of 2
+ * chunks long, every subtree starts at a multiple of its length rounded up
+ * to a power of 2 chunks. executor may be NULL. Returns 0 or -EINVAL.
+ */
+int Blake3_HashSubtree(const BLAKE3_CTX *ctx, const void *input,
+    size_t input_len, uint64_t chunk, const blake3_executor_t *executor,
+    blake3_subtree_t *st);
+
+/*
+ * The same in pieces: sub starts at chunk as a copy of ctx, it is fed with
+ * Blake3_Update() and ended with Blake3_SubtreeFinal(), which returns 0 or
+ * -EINVAL like Blake3_HashSubtree().
+ */
+void Blake3_SubtreeInit(BLAKE3_CTX *sub, const BLAKE3_CTX *ctx,
+    uint64_t chunk);
+int Blake3_SubtreeFinal(const BLAKE3_CTX *sub, uint64_t chunk,
+    blake3_subtree_t *st);
+
+/*
+ * Combine the n subtrees of an input, in the order of the input, and
+ * output out_len bytes of the root hash. Returns 0 or -EINVAL, if the
+ * subtrees don't make up an input.
+ */
+int Blake3_CombineSubtrees(const BLAKE3_CTX *ctx, const blake3_subtree_t *st,
+    size_t n, uint8_t *out, size_t out_len);
+
+#ifndef _KERNEL
+/*
+ * Positional hashing: the parts of an input come in any order, and from
+ * several threads at once. Completed subtrees are merged with their
+ * siblings as soon as both exist, the right edge when the length is known.
+ */
+typedef struct blake3_pos blake3_pos_t;
+
+/* create a positional context, ctx is an initialized context */
+blake3_pos_t *Blake3_PosCreate(const BLAKE3_CTX *ctx);
+
+/*
+ * Process the input_len bytes at offset, which is a multiple of the chunk
+ * length. Only the last part of the input may end within a chunk. Returns
+ * 0, -EINVAL for unaligned or overlapping parts, parts after the end of the
+ * input or after Blake3_PosFinal(), or -ENOMEM.
+ */
+int Blake3_UpdateAt(blake3_pos_t *pos, uint64_t offset, const void *input,
+    size_t input_len);
+
+/*
+ * Finalize the input of input_len bytes and output the result, returns
+ * 0 or -EINVAL if parts of the input are missing. The right edge of the
+ * tree is merged for this length, no parts may follow.
+ */
+int Blake3_PosFinal(blake3_pos_t *pos, uint64_t input_len, uint8_t *out,
+    size_t out_len);
+
+/* free the positional context */
+void Blake3_PosDestroy(blake3_pos_t *pos);
+#endif
+
+/* number of input bytes processed so far */
+uint64_t Blake3_Count(const BLAKE3_CTX *ctx);
+
+/*
+ * Saved state of a context: a versioned little endian encoding of the key,
+ * the flags, the chunk state and the live entries of the CV stack. It can
+ * be loaded on any host, an outboard has to be set again.
+ */
+#define	BLAKE3_STATE_MAX_LEN	\
+	(80 + BLAKE3_BLOCK_LEN + (BLAKE3_MAX_DEPTH + 1) * BLAKE3_OUT_LEN)
+
+/* save the state into buf, return its size or -ENOSPC */
+int Blake3_SaveState(const BLAKE3_CTX *ctx, uint8_t *buf, size_t len);
+
+/*
+ * Load a saved state of len bytes into the initialized ctx, return 0 or
+ * -EINVAL. A compact ctx keeps its limit and rejects a larger CV stack.
+ */
+int Blake3_LoadState(BLAKE3_CTX *ctx, const uint8_t *buf, size_t len);
 
 /* finalize the hash computation and output the result */
 void Blake3_Final(const BLAKE3_CTX *ctx, uint8_t *out);
@@ -89,9 +392,42 @@ extern void blake3_set_impl_id(uint32_t id);
 /* set implementation by name */
 extern int blake3_set_impl_name(const char *name);
 
-/* set startup implementation */
+/* return name of the implementation selected for a size class */
+extern const char *blake3_get_impl_class_name(int cls);
+
+/* set implementation of "fastest" for a size class, NULL means measured */
+extern int blake3_set_impl_class(int cls, const char *name);
+
+#ifndef _KERNEL
+/* set implementation by name for the calling thread, NULL resets it */
+extern int blake3_set_impl_name_thread(const char *name);
+#endif
+
+/* set startup implementation, benchmarks them when "fastest" is used */
 extern void blake3_setup_impl(void);
 
+/* result of the startup benchmark for one implementation */
+typedef struct {
+	const char *name;
+	uint64_t bandwidth[BLAKE3_IMPL_CLASSES];	/* bytes per second */
+	int fastest;		/* bit n: fastest for size class n */
+} blake3_impl_bench_t;
+
+/* copy up to n benchmark results into table, return their number */
+extern int blake3_get_impl_bench(blake3_impl_bench_t *table, int n);
+
+#ifndef _KERNEL
+/*
+ * Load benchmark results from a tuning cache file, made on this host. When
+ * called before blake3_setup_impl(), that one doesn't measure again. The
+ * library never touches such a file on its own.
+ */
+extern int blake3_tune_load(const char *path);
+
+/* save benchmark results to a tuning cache file */
+extern int blake3_tune_save(const char *path);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -12,38 +12,38 @@
 #include "blake3_impl.h"
 
 #define	rotr32(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
-static void g(uint32_t *state, size_t a, size_t b, size_t c, size_t d,
-    uint32_t x, uint32_t y)
-{
-	state[a] = state[a] + state[b] + x;
-	state[d] = rotr32(state[d] ^ state[a], 16);
-	state[c] = state[c] + state[d];
-	state[b] = rotr32(state[b] ^ state[c], 12);
-	state[a] = state[a] + state[b] + y;
-	state[d] = rotr32(state[d] ^ state[a], 8);
-	state[c] = state[c] + state[d];
-	state[b] = rotr32(state[b] ^ state[c], 7);
-}
 
-static void round_fn(uint32_t state[16], const uint32_t *msg, size_t round)
-{
-	/* Select the message schedule based on the round. */
-	const uint8_t *schedule = MSG_SCHEDULE[round];
-
-	/* Mix the columns. */
-	g(state, 0, 4, 8, 12, msg[schedule[0]], msg[schedule[1]]);
-	g(state, 1, 5, 9, 13, msg[schedule[2]], msg[schedule[3]]);
-	g(state, 2, 6, 10, 14, msg[schedule[4]], msg[schedule[5]]);
-	g(state, 3, 7, 11, 15, msg[schedule[6]], msg[schedule[7]]);
-
-	/* Mix the rows. */
-	g(state, 0, 5, 10, 15, msg[schedule[8]], msg[schedule[9]]);
-	g(state, 1, 6, 11, 12, msg[schedule[10]], msg[schedule[11]]);
-	g(state, 2, 7, 8, 13, msg[schedule[12]], msg[schedule[13]]);
-	g(state, 3, 4, 9, 14, msg[schedule[14]], msg[schedule[15]]);
-}
+#define	G(v, a, b, c, d, x, y) do {					\
+	v[a] = v[a] + v[b] + (x);					\
+	v[d] = rotr32(v[d] ^ v[a], 16);					\
+	v[c] = v[c] + v[d];						\
+	v[b] = rotr32(v[b] ^ v[c], 12);					\
+	v[a] = v[a] + v[b] + (y);					\
+	v[d] = rotr32(v[d] ^ v[a], 8);					\
+	v[c] = v[c] + v[d];						\
+	v[b] = rotr32(v[b] ^ v[c], 7);					\
+} while (0)
+
+/*
+ * One round, the message words are given in the order of MSG_SCHEDULE, as
+ * constants. So every round is specialized at compile time and all indexes
+ * into state and message are fixed, which keeps them in registers.
+ */
+#define	ROUND(v, m, s0, s1, s2, s3, s4, s5, s6, s7,			\
+    s8, s9, s10, s11, s12, s13, s14, s15) do {				\
+	/* Mix the columns. */						\
+	G(v, 0, 4, 8, 12, m[s0], m[s1]);				\
+	G(v, 1, 5, 9, 13, m[s2], m[s3]);				\
+	G(v, 2, 6, 10, 14, m[s4], m[s5]);				\
+	G(v, 3, 7, 11, 15, m[s6], m[s7]);				\
+	/* Mix the rows. */						\
+	G(v, 0, 5, 10, 15, m[s8], m[s9]);				\
+	G(v, 1, 6, 11, 12, m[s10], m[s11]);				\
+	G(v, 2, 7, 8, 13, m[s12], m[s13]);				\
+	G(v, 3, 4, 9, 14, m[s14], m[s15]);				\
+} while (0)
 
-static void compress_pre(uint32_t state[16], const uint32_t cv[8],
+static inline void compress_pre(uint32_t state[16], const uint32_t cv[8],
     const uint8_t block[BLAKE3_BLOCK_LEN], uint8_t block_len,
     uint64_t counter, uint8_t flags)
 {
@@ -83,13 +83,20 @@ static void compress_pre(uint32_t state[16], const uint32_t cv[8],
 	state[14] = (uint32_t)block_len;
 	state[15] = (uint32_t)flags;
 
-	round_fn(state, &block_words[0], 0);
-	round_fn(state, &block_words[0], 1);
-	round_fn(state, &block_words[0], 2);
-	round_fn(state, &block_words[0], 3);
-	round_fn(state, &block_words[0], 4);
-	round_fn(state, &block_words[0], 5);
-	round_fn(state, &block_words[0], 6);
+	ROUND(state, block_words, 0, 1, 2, 3, 4, 5, 6, 7,
+	    8, 9, 10, 11, 12, 13, 14, 15);
+	ROUND(state, block_words, 2, 6, 3, 10, 7, 0, 4, 13,
+	    1, 11, 12, 5, 9, 14, 15, 8);
+	ROUND(state, block_words, 3, 4, 10, 12, 13, 2, 7, 14,
+	    6, 5, 9, 0, 11, 15, 8, 1);
+	ROUND(state, block_words, 10, 7, 12, 9, 14, 3, 13, 15,
+	    4, 0, 11, 2, 5, 8, 1, 6);
+	ROUND(state, block_words, 12, 13, 9, 11, 15, 10, 14, 8,
+	    7, 2, 5, 3, 0, 1, 6, 4);
+	ROUND(state, block_words, 9, 14, 11, 5, 8, 12, 15, 1,
+	    13, 3, 0, 10, 2, 6, 4, 7);
+	ROUND(state, block_words, 11, 15, 5, 0, 1, 9, 8, 6,
+	    14, 10, 2, 12, 3, 4, 7, 13);
 }
 
 void blake3_compress_in_place_generic(uint32_t cv[8],
@@ -155,11 +162,148 @@ void blake3_compress_xof_generic(const uint32_t cv[8],
 	store32(&out[15 * 4], state[15] ^ cv[7]);
 }
 
+static void blake3_compress_xof_many_generic(const uint32_t cv[8],
+    const uint8_t block[BLAKE3_BLOCK_LEN], uint8_t block_len,
+    uint64_t counter, uint8_t flags, uint8_t *out, size_t outblocks)
+{
+	blake3_xof_many_loop(blake3_compress_xof_generic, cv, block,
+	    block_len, counter, flags, out, outblocks);
+}
+
+/*
+ * hash_many() for GENERIC_LANES inputs at once, one input per lane. With gcc
+ * and clang the lanes are vector_size types, which the compiler maps onto
+ * the SIMD unit of the target, or splits into scalar code where there is
+ * none. Kernel builds keep to the scalar loop below: the generic code runs
+ * outside of kfpu_begin() and kfpu_end(), so it must not touch the SIMD
+ * registers.
+ */
+#ifndef	BLAKE3_GENERIC_LANES
+#define	BLAKE3_GENERIC_LANES	4
+#endif
+
+/* the degree sizes the arrays of the subtree engine */
+#if BLAKE3_GENERIC_LANES > MAX_SIMD_DEGREE
+#error "BLAKE3_GENERIC_LANES is larger than MAX_SIMD_DEGREE"
+#endif
+
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(_KERNEL)
+#define	GENERIC_LANES	BLAKE3_GENERIC_LANES
+typedef uint32_t lanes_t __attribute__((vector_size(4 * GENERIC_LANES)));
+
+/* macros, wide vectors as function arguments would change the ABI */
+#define	lanes_load(v, w)	memcpy(&(v), (w), sizeof (lanes_t))
+#define	lanes_store(v, w)	memcpy((w), &(v), sizeof (lanes_t))
+#endif
+
+#if defined(GENERIC_LANES)
+#define	LANES_ROTR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+#define	LANES_G(v, a, b, c, d, x, y) do {				\
+	v[a] = v[a] + v[b] + x;						\
+	v[d] = LANES_ROTR(v[d] ^ v[a], 16);				\
+	v[c] = v[c] + v[d];						\
+	v[b] = LANES_ROTR(v[b] ^ v[c], 12);				\
+	v[a] = v[a] + v[b] + y;						\
+	v[d] = LANES_ROTR(v[d] ^ v[a], 8);				\
+	v[c] = v[c] + v[d];						\
+	v[b] = LANES_ROTR(v[b] ^ v[c], 7);				\
+} while (0)
+
+#define	LANES_ROUND(v, m, r) do {					\
+	const uint8_t *s = MSG_SCHEDULE[r];				\
+	LANES_G(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);			\
+	LANES_G(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);			\
+	LANES_G(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);			\
+	LANES_G(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);			\
+	LANES_G(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);			\
+	LANES_G(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);			\
+	LANES_G(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);			\
+	LANES_G(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);			\
+} while (0)
+
+static void hash_lanes_generic(const uint8_t * const *inputs, size_t blocks,
+    const uint32_t key[8], uint64_t counter, boolean_t increment_counter,
+    uint8_t flags, uint8_t flags_start, uint8_t flags_end, uint8_t *out)
+{
+	uint32_t words[16][GENERIC_LANES];
+	lanes_t h[8], v[16], m[16], ctr_low, ctr_high;
+	uint8_t block_flags = flags | flags_start;
+	size_t i, lane, pos, end = blocks * BLAKE3_BLOCK_LEN;
+
+	for (lane = 0; lane < GENERIC_LANES; lane++) {
+		uint64_t c = counter + (increment_counter ? lane : 0);
+		words[0][lane] = counter_low(c);
+		words[1][lane] = counter_high(c);
+	}
+	lanes_load(ctr_low, words[0]);
+	lanes_load(ctr_high, words[1]);
+
+	for (i = 0; i < 8; i++)
+		h[i] = (lanes_t){0} + key[i];
+
+	for (pos = 0; pos < end; pos += BLAKE3_BLOCK_LEN) {
+		if (pos + BLAKE3_BLOCK_LEN == end)
+			block_flags |= flags_end;
+
+		/* transpose, every lane gets the words of its input */
+		for (i = 0; i < 16; i++) {
+			for (lane = 0; lane < GENERIC_LANES; lane++)
+				words[i][lane] =
+				    load32(inputs[lane] + pos + 4 * i);
+			lanes_load(m[i], words[i]);
+		}
+
+		for (i = 0; i < 8; i++)
+			v[i] = h[i];
+		for (i = 0; i < 4; i++)
+			v[8 + i] = (lanes_t){0} + IV[i];
+		v[12] = ctr_low;
+		v[13] = ctr_high;
+		v[14] = (lanes_t){0} + (uint32_t)BLAKE3_BLOCK_LEN;
+		v[15] = (lanes_t){0} + (uint32_t)block_flags;
+
+		LANES_ROUND(v, m, 0);
+		LANES_ROUND(v, m, 1);
+		LANES_ROUND(v, m, 2);
+		LANES_ROUND(v, m, 3);
+		LANES_ROUND(v, m, 4);
+		LANES_ROUND(v, m, 5);
+		LANES_ROUND(v, m, 6);
+
+		for (i = 0; i < 8; i++)
+			h[i] = v[i] ^ v[i + 8];
+		block_flags = flags;
+	}
+
+	for (i = 0; i < 8; i++)
+		lanes_store(h[i], words[i]);
+	for (lane = 0; lane < GENERIC_LANES; lane++)
+		for (i = 0; i < 8; i++)
+			store32(out + lane * BLAKE3_OUT_LEN + 4 * i,
+			    words[i][lane]);
+}
+#endif
+
 static void blake3_hash_many_generic(const uint8_t * const *inputs,
     size_t num_inputs, size_t blocks, const uint32_t key[8], uint64_t counter,
     boolean_t increment_counter, uint8_t flags, uint8_t flags_start,
     uint8_t flags_end, uint8_t *out)
 {
+#if defined(GENERIC_LANES)
+	while (num_inputs >= GENERIC_LANES) {
+		hash_lanes_generic(inputs, blocks, key, counter,
+		    increment_counter, flags, flags_start, flags_end, out);
+		if (increment_counter) {
+			counter += GENERIC_LANES;
+		}
+		inputs += GENERIC_LANES;
+		num_inputs -= GENERIC_LANES;
+		out = &out[GENERIC_LANES * BLAKE3_OUT_LEN];
+	}
+#endif
+
+	/* the rest one by one */
 	while (num_inputs > 0) {
 		hash_one_generic(inputs[0], blocks, key, counter, flags,
 		    flags_start, flags_end, out);
@@ -180,8 +324,13 @@ static boolean_t blake3_is_generic_supported(void)
 const blake3_impl_ops_t blake3_generic_impl = {
 	.compress_in_place = blake3_compress_in_place_generic,
 	.compress_xof = blake3_compress_xof_generic,
+	.compress_xof_many = blake3_compress_xof_many_generic,
 	.hash_many = blake3_hash_many_generic,
 	.is_supported = blake3_is_generic_supported,
+#if defined(GENERIC_LANES) && GENERIC_LANES > 4
+	.degree = GENERIC_LANES,
+#else
 	.degree = 4,
+#endif
 	.name = "generic"
 };
@@ -6,6 +6,13 @@
  * Latest version: https://github.com/mcmilk/BLAKE3-tests
  */
 
+#ifndef _KERNEL
+#define	_POSIX_C_SOURCE	200809L
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
 #include "blake3_impl.h"
 
 static const blake3_impl_ops_t *const blake3_impls[] = {
@@ -18,12 +25,55 @@ static const blake3_impl_ops_t *const blake3_impls[] = {
 	&blake3_sse2_impl,
 	&blake3_sse41_impl,
 	&blake3_avx2_impl,
+	&blake3_avx512vl_impl,
 	&blake3_avx512_impl,
 #endif
 };
 
-/* this pointer holds current ops for implementation */
-static const blake3_impl_ops_t *blake3_selected_impl = &blake3_generic_impl;
+/*
+ * Registry of the supported implementations. It is built once from a
+ * snapshot of the cpu features, every is_supported() is called only there.
+ * Afterwards it is never changed, so it can be read without any locking.
+ */
+static const blake3_impl_ops_t *
+blake3_supported_impls[ARRAY_SIZE(blake3_impls)];
+static int blake3_supported_count = 0;
+
+#define	REGISTRY_EMPTY	0
+#define	REGISTRY_BUSY	1
+#define	REGISTRY_READY	2
+static int blake3_registry_state = REGISTRY_EMPTY;
+
+/*
+ * A selection is a dispatch table with one implementation per input size
+ * class. Selecting a single implementation uses it for all classes, only
+ * "fastest" may use different ones.
+ */
+typedef struct {
+	const blake3_impl_ops_t *ops[BLAKE3_IMPL_CLASSES];
+} blake3_dispatch_t;
+
+static const blake3_dispatch_t blake3_generic_dispatch = {
+	{ &blake3_generic_impl, &blake3_generic_impl, &blake3_generic_impl }
+};
+
+/* one table per registry entry */
+static blake3_dispatch_t blake3_single_dispatch[ARRAY_SIZE(blake3_impls)];
+
+/* table of "fastest", its entries may change while it is published */
+static blake3_dispatch_t blake3_fastest_dispatch;
+
+/*
+ * This pointer holds the current dispatch table. It is published with
+ * atomics, so a lookup is a single load and concurrent selections are safe.
+ */
+static const blake3_dispatch_t *blake3_selected_impl =
+	&blake3_generic_dispatch;
+
+#ifndef _KERNEL
+/* selection of the calling thread, overrides the global one */
+static __thread const blake3_dispatch_t *blake3_thread_impl = NULL;
+#endif
 
 /* special implementation selections */
 #define	IMPL_FASTEST	(UINT32_MAX)
@@ -34,141 +84,628 @@ static uint32_t icp_blake3_impl = IMPL_FASTEST;
 
 #define	BLAKE3_IMPL_NAME_MAX	16
 
-/* id of fastest implementation */
-static uint32_t blake3_fastest_id = 0;
+/* id of fastest implementation per size class, and the classes user set */
+static uint32_t blake3_fastest_id[BLAKE3_IMPL_CLASSES];
+static uint32_t blake3_class_user = 0;
 
-/* currently used id */
-static uint32_t blake3_current_id = 0;
+#ifdef BLAKE3_IMPL_CYCLE
+/* last id used by the cycle selection */
+static uint32_t blake3_cycle_id = 0;
+#endif
 
 /* id of module parameter (-1 == unused) */
 static int blake3_param_id = -1;
 
-/* return number of supported implementations */
-int
-blake3_get_impl_count(void)
+/*
+ * Startup benchmark, like the one of fletcher4 in ZFS. Every supported
+ * implementation hashes one typical input per size class for about
+ * BLAKE3_BENCH_NS, the best bandwidth becomes the fastest of that class.
+ */
+#define	BLAKE3_BENCH_LEN	(64 * 1024)
+#define	BLAKE3_BENCH_NS		(1000 * 1000)
+
+static const size_t blake3_bench_len[BLAKE3_IMPL_CLASSES] = {
+	1024, 16 * 1024, BLAKE3_BENCH_LEN
+};
+
+/* bandwidth in bytes per second, indexed like the registry */
+static uint64_t
+blake3_bench_bw[ARRAY_SIZE(blake3_impls)][BLAKE3_IMPL_CLASSES];
+static uint8_t blake3_bench_buf[BLAKE3_BENCH_LEN];
+static int blake3_bench_state = REGISTRY_EMPTY;
+
+static void blake3_bench_impls(void);
+
+#ifndef _KERNEL
+/*
+ * The benchmark results may be saved to a small text file, so short
+ * running processes don't measure again, see blake3_tune_load(). The file
+ * is only used with the same cpu model, microcode and build of the library.
+ * The Makefile sets BLAKE3_BUILD_ID to a checksum of the sources, other
+ * builds are told apart by the library version and the compiler. It has to
+ * be reproducible, so no __DATE__.
+ */
+#define	BLAKE3_TUNE_VERSION	1
+#define	BLAKE3_TUNE_LINE	256
+
+#ifndef BLAKE3_BUILD_ID
+#if defined(__VERSION__)
+#define	BLAKE3_BUILD_ID		BLAKE3_VERSION_STRING " cc " __VERSION__
+#else
+#define	BLAKE3_BUILD_ID		BLAKE3_VERSION_STRING " cc unknown"
+#endif
+#endif
+#endif
+
+#ifdef _KERNEL
+#define	blake3_gethrtime()	((uint64_t)gethrtime())
+#else
+static uint64_t
+blake3_gethrtime(void)
 {
-	static int impls = 0;
-	int i;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec);
+}
+#endif
+
+/* build the registry once, concurrent callers wait for the first one */
+static void
+blake3_registry_init(void)
+{
+	int state = REGISTRY_EMPTY;
+	int i, c, count = 0;
 
-	if (impls)
-		return (impls);
+	if (__atomic_load_n(&blake3_registry_state, __ATOMIC_ACQUIRE) ==
+	    REGISTRY_READY)
+		return;
+
+	if (!__atomic_compare_exchange_n(&blake3_registry_state, &state,
+	    REGISTRY_BUSY, B_FALSE, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+		while (__atomic_load_n(&blake3_registry_state,
+		    __ATOMIC_ACQUIRE) != REGISTRY_READY)
+			;
+		return;
+	}
 
 	for (i = 0; i < (int)ARRAY_SIZE(blake3_impls); i++) {
 		if (!blake3_impls[i]->is_supported()) continue;
-		impls++;
+		for (c = 0; c < BLAKE3_IMPL_CLASSES; c++)
+			blake3_single_dispatch[count].ops[c] = blake3_impls[i];
+		blake3_supported_impls[count++] = blake3_impls[i];
+	}
+	blake3_supported_count = count;
+	blake3_fastest_dispatch = blake3_single_dispatch[0];
+
+	__atomic_store_n(&blake3_registry_state, REGISTRY_READY,
+	    __ATOMIC_RELEASE);
+}
+
+/* registry id of the entry with that name, or -1 */
+static int
+blake3_registry_find(const char *name)
+{
+	int i;
+
+	blake3_registry_init();
+	for (i = 0; i < blake3_supported_count; i++) {
+		if (strcmp(name, blake3_supported_impls[i]->name) == 0)
+			return (i);
 	}
 
-	return (impls);
+	return (-1);
+}
+
+static void
+blake3_publish_impl(const blake3_dispatch_t *dispatch)
+{
+	__atomic_store_n(&blake3_selected_impl, dispatch, __ATOMIC_RELEASE);
+}
+
+/*
+ * return selected dispatch table
+ *
+ * Debug builds with -DBLAKE3_IMPL_CYCLE support the "cycle" selection,
+ * where each call returns the next implementation.
+ */
+static const blake3_dispatch_t *
+blake3_impl_get_dispatch(void)
+{
+#ifdef BLAKE3_IMPL_CYCLE
+	/* each call to ops will cycle */
+	if (__atomic_load_n(&icp_blake3_impl, __ATOMIC_RELAXED) ==
+	    IMPL_CYCLE)
+		blake3_set_impl_id(IMPL_CYCLE);
+#endif
+
+#ifndef _KERNEL
+	if (blake3_thread_impl != NULL)
+		return (blake3_thread_impl);
+#endif
+
+	return (__atomic_load_n(&blake3_selected_impl, __ATOMIC_ACQUIRE));
+}
+
+/* return number of supported implementations */
+int
+blake3_get_impl_count(void)
+{
+	blake3_registry_init();
+	return (blake3_supported_count);
 }
 
 /* return id of selected implementation */
 int
 blake3_get_impl_id(void)
 {
-	return (blake3_current_id);
+	const blake3_impl_ops_t *ops = blake3_impl_get_ops();
+	int i;
+
+	blake3_registry_init();
+	for (i = 0; i < blake3_supported_count; i++) {
+		if (blake3_supported_impls[i] == ops)
+			return (i);
+	}
+
+	return (0);
 }
 
 /* return name of selected implementation */
 const char *
 blake3_get_impl_name(void)
 {
-	return (blake3_selected_impl->name);
+	return (blake3_impl_get_ops()->name);
+}
+
+/* return name of the implementation selected for a size class */
+const char *
+blake3_get_impl_class_name(int cls)
+{
+	if (cls < 0 || cls >= BLAKE3_IMPL_CLASSES)
+		return (NULL);
+
+	return (__atomic_load_n(&blake3_impl_get_dispatch()->ops[cls],
+	    __ATOMIC_RELAXED)->name);
+}
+
+/* make id the fastest of a size class, unless the user has set it */
+static void
+blake3_set_class_fastest(int cls, uint32_t id)
+{
+	blake3_registry_init();
+	if (id >= (uint32_t)blake3_supported_count)
+		return;
+
+	__atomic_store_n(&blake3_fastest_id[cls], id, __ATOMIC_RELAXED);
+	if (!(__atomic_load_n(&blake3_class_user, __ATOMIC_RELAXED) &
+	    (1U << cls)))
+		__atomic_store_n(&blake3_fastest_dispatch.ops[cls],
+		    blake3_supported_impls[id], __ATOMIC_RELAXED);
 }
 
 /* setup id as fastest implementation */
 void
 blake3_set_impl_fastest(uint32_t id)
 {
-	blake3_fastest_id = id;
+	int cls;
+
+	for (cls = 0; cls < BLAKE3_IMPL_CLASSES; cls++)
+		blake3_set_class_fastest(cls, id);
 }
 
 /* set implementation by id */
 void
 blake3_set_impl_id(uint32_t id)
 {
-	int i, cid;
+	blake3_registry_init();
 
 	/* select fastest */
-	if (id == IMPL_FASTEST)
-		id = blake3_fastest_id;
+	if (id == IMPL_FASTEST) {
+		blake3_publish_impl(&blake3_fastest_dispatch);
+		return;
+	}
 
+#ifdef BLAKE3_IMPL_CYCLE
 	/* select next or first */
 	if (id == IMPL_CYCLE)
-		id = (++blake3_current_id) % blake3_get_impl_count();
+		id = __atomic_add_fetch(&blake3_cycle_id, 1,
+		    __ATOMIC_RELAXED) % blake3_get_impl_count();
+#endif
 
 	/* 0..N for the real impl */
-	for (i = 0, cid = 0; i < (int)ARRAY_SIZE(blake3_impls); i++) {
-		if (!blake3_impls[i]->is_supported()) continue;
-		if (cid == (int)id) {
-			blake3_current_id = cid;
-			blake3_selected_impl = blake3_impls[i];
-			return;
-		}
-		cid++;
-	}
+	if (id < (uint32_t)blake3_supported_count)
+		blake3_publish_impl(&blake3_single_dispatch[id]);
 }
 
 /* set implementation by name */
 int
 blake3_set_impl_name(const char *name)
 {
-	int i, cid;
+	int id;
 
 	if (strcmp(name, "fastest") == 0) {
-		icp_blake3_impl = IMPL_FASTEST;
+		__atomic_store_n(&icp_blake3_impl, IMPL_FASTEST,
+		    __ATOMIC_RELAXED);
+		blake3_bench_impls();
 		blake3_set_impl_id(IMPL_FASTEST);
 		return (0);
+#ifdef BLAKE3_IMPL_CYCLE
 	} else if (strcmp(name, "cycle") == 0) {
-		icp_blake3_impl = IMPL_CYCLE;
+		__atomic_store_n(&icp_blake3_impl, IMPL_CYCLE,
+		    __ATOMIC_RELAXED);
 		blake3_set_impl_id(IMPL_CYCLE);
 		return (0);
+#endif
 	}
 
-	for (i = 0, cid = 0; i < (int)ARRAY_SIZE(blake3_impls); i++) {
-		if (!blake3_impls[i]->is_supported()) continue;
-		if (strcmp(name, blake3_impls[i]->name) == 0) {
-			if (icp_blake3_impl == IMPL_PARAM) {
-				blake3_param_id = cid;
-				return (0);
+	id = blake3_registry_find(name);
+	if (id < 0)
+		return (-EINVAL);
+
+	if (__atomic_load_n(&icp_blake3_impl, __ATOMIC_RELAXED) ==
+	    IMPL_PARAM) {
+		blake3_param_id = id;
+		return (0);
+	}
+
+	blake3_set_impl_id(id);
+	return (0);
+}
+
+/* set implementation of "fastest" for a size class, NULL means measured */
+int
+blake3_set_impl_class(int cls, const char *name)
+{
+	int id;
+
+	if (cls < 0 || cls >= BLAKE3_IMPL_CLASSES)
+		return (-EINVAL);
+
+	if (name == NULL) {
+		__atomic_and_fetch(&blake3_class_user, ~(1U << cls),
+		    __ATOMIC_RELAXED);
+		blake3_set_class_fastest(cls, __atomic_load_n(
+		    &blake3_fastest_id[cls], __ATOMIC_RELAXED));
+		return (0);
+	}
+
+	id = blake3_registry_find(name);
+	if (id < 0)
+		return (-EINVAL);
+
+	__atomic_or_fetch(&blake3_class_user, 1U << cls, __ATOMIC_RELAXED);
+	__atomic_store_n(&blake3_fastest_dispatch.ops[cls],
+	    blake3_supported_impls[id], __ATOMIC_RELAXED);
+	return (0);
+}
+
+#ifndef _KERNEL
+/* set implementation by name for the calling thread, NULL resets it */
+int
+blake3_set_impl_name_thread(const char *name)
+{
+	const blake3_dispatch_t *dispatch = NULL;
+	int id;
+
+	if (name != NULL) {
+		id = blake3_registry_find(name);
+		if (id < 0)
+			return (-EINVAL);
+		dispatch = &blake3_single_dispatch[id];
+	}
+
+	blake3_thread_impl = dispatch;
+	return (0);
+}
+#endif
+
+/* make the best of each size class the fastest */
+static void
+blake3_bench_select(void)
+{
+	uint64_t best;
+	int i, c, id;
+
+	for (c = 0; c < BLAKE3_IMPL_CLASSES; c++) {
+		best = 0;
+		id = 0;
+		for (i = 0; i < blake3_supported_count; i++) {
+			if (blake3_bench_bw[i][c] > best) {
+				best = blake3_bench_bw[i][c];
+				id = i;
 			}
-			blake3_selected_impl = blake3_impls[i];
-			blake3_current_id = cid;
-			return (0);
 		}
-		cid++;
+		blake3_set_class_fastest(c, id);
+	}
+}
+
+#ifndef _KERNEL
+/* copy value of the first "name : value" line of /proc/cpuinfo */
+static void
+blake3_cpuinfo(const char *name, char *value, size_t len)
+{
+	char line[BLAKE3_TUNE_LINE];
+	size_t n = strlen(name);
+	char *p;
+	FILE *f;
+
+	(void) snprintf(value, len, "unknown");
+	f = fopen("/proc/cpuinfo", "r");
+	if (f == NULL)
+		return;
+
+	while (fgets(line, sizeof (line), f) != NULL) {
+		if (strncmp(line, name, n) != 0 ||
+		    (p = strchr(line, ':')) == NULL)
+			continue;
+		for (p++; *p == ' ' || *p == '\t'; p++)
+			;
+		p[strcspn(p, "\n")] = '\0';
+		(void) snprintf(value, len, "%s", p);
+		break;
+	}
+	fclose(f);
+}
+
+/* header lines of the cache file, which must match exactly */
+static void
+blake3_tune_header(char *buf, size_t len)
+{
+	char model[BLAKE3_TUNE_LINE / 2], microcode[32];
+
+	blake3_cpuinfo("model name", model, sizeof (model));
+	blake3_cpuinfo("microcode", microcode, sizeof (microcode));
+	(void) snprintf(buf, len, "blake3-tune %d\ncpu %s\nmicrocode %s\n"
+	    "build %s\n", BLAKE3_TUNE_VERSION, model, microcode,
+	    BLAKE3_BUILD_ID);
+}
+
+/* read the cache into the benchmark table */
+static int
+blake3_tune_read(const char *path)
+{
+	uint64_t bw[ARRAY_SIZE(blake3_impls)][BLAKE3_IMPL_CLASSES];
+	char header[4 * BLAKE3_TUNE_LINE], line[BLAKE3_TUNE_LINE];
+	char name[BLAKE3_IMPL_NAME_MAX];
+	unsigned long long b[BLAKE3_IMPL_CLASSES];
+	size_t pos = 0, n;
+	int i, c, err = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		return (-errno);
+
+	/* the header has four lines, each one has to match as a whole */
+	blake3_tune_header(header, sizeof (header));
+	for (i = 0; i < 4 && err == 0; i++) {
+		n = strcspn(header + pos, "\n") + 1;
+		if (fgets(line, sizeof (line), f) == NULL ||
+		    strlen(line) != n || strncmp(line, header + pos, n) != 0)
+			err = -EINVAL;
+		pos += n;
+	}
+
+	for (i = 0; i < blake3_supported_count && err == 0; i++) {
+		if (fgets(line, sizeof (line), f) == NULL ||
+		    sscanf(line, "impl %15s %llu %llu %llu", name, &b[0],
+		    &b[1], &b[2]) != 1 + BLAKE3_IMPL_CLASSES ||
+		    strcmp(name, blake3_supported_impls[i]->name) != 0) {
+			err = -EINVAL;
+			break;
+		}
+		for (c = 0; c < BLAKE3_IMPL_CLASSES; c++)
+			bw[i][c] = b[c];
 	}
+	if (err == 0 && fgets(line, sizeof (line), f) != NULL)
+		err = -EINVAL;
+	fclose(f);
+
+	if (err == 0)
+		memcpy(blake3_bench_bw, bw, sizeof (bw));
+	return (err);
+}
+
+/* write the benchmark table, a temporary file is renamed over path */
+static int
+blake3_tune_write(const char *path)
+{
+	char header[4 * BLAKE3_TUNE_LINE], tmp[4096];
+	int i, err = 0;
+	FILE *f;
+
+	if (snprintf(tmp, sizeof (tmp), "%s.%ld", path,
+	    (long)getpid()) >= (int)sizeof (tmp))
+		return (-ENAMETOOLONG);
 
-	return (-EINVAL);
+	f = fopen(tmp, "w");
+	if (f == NULL)
+		return (-errno);
+
+	blake3_tune_header(header, sizeof (header));
+	fputs(header, f);
+	for (i = 0; i < blake3_supported_count; i++)
+		fprintf(f, "impl %s %llu %llu %llu\n",
+		    blake3_supported_impls[i]->name,
+		    (unsigned long long)blake3_bench_bw[i][0],
+		    (unsigned long long)blake3_bench_bw[i][1],
+		    (unsigned long long)blake3_bench_bw[i][2]);
+
+	if (fclose(f) != 0 || rename(tmp, path) != 0) {
+		err = -errno;
+		(void) remove(tmp);
+	}
+	return (err);
 }
 
-/* setup implementation */
+/* load benchmark results from the cache file at path */
+int
+blake3_tune_load(const char *path)
+{
+	int state = REGISTRY_EMPTY;
+	int err;
+
+	blake3_registry_init();
+	if (!__atomic_compare_exchange_n(&blake3_bench_state, &state,
+	    REGISTRY_BUSY, B_FALSE, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE) &&
+	    (state != REGISTRY_READY ||
+	    !__atomic_compare_exchange_n(&blake3_bench_state, &state,
+	    REGISTRY_BUSY, B_FALSE, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)))
+		return (-EBUSY);
+
+	err = blake3_tune_read(path);
+	if (err == 0)
+		blake3_bench_select();
+
+	/* a failed load keeps the measured results, if any */
+	__atomic_store_n(&blake3_bench_state, (err == 0 ||
+	    state == REGISTRY_READY) ? REGISTRY_READY : REGISTRY_EMPTY,
+	    __ATOMIC_RELEASE);
+	return (err);
+}
+
+/* save benchmark results to the cache file at path */
+int
+blake3_tune_save(const char *path)
+{
+	if (__atomic_load_n(&blake3_bench_state, __ATOMIC_ACQUIRE) !=
+	    REGISTRY_READY)
+		return (-ENOENT);
+
+	return (blake3_tune_write(path));
+}
+#endif
+
+/* bytes per second of ops, hashing len bytes of buf over and over */
+static uint64_t
+blake3_bench_impl(const blake3_impl_ops_t *ops, const uint8_t *buf,
+    size_t len)
+{
+	uint8_t digest[BLAKE3_OUT_LEN];
+	uint64_t start, run_ns, runs = 0;
+	BLAKE3_CTX ctx;
+	int c;
+
+	do {
+		Blake3_Init(&ctx);
+		for (c = 0; c < BLAKE3_IMPL_CLASSES; c++)
+			ctx.ops[c] = ops;
+		Blake3_Update(&ctx, buf, len);
+		Blake3_Final(&ctx, digest);
+
+		/* the first run only warms up */
+		if (runs++ == 0)
+			start = blake3_gethrtime();
+		run_ns = blake3_gethrtime() - start;
+	} while (run_ns < BLAKE3_BENCH_NS);
+
+	return ((runs - 1) * len * 1000000000ULL / run_ns);
+}
+
+/*
+ * Benchmark all supported implementations once and make the best one of
+ * each size class the fastest there. Concurrent callers don't wait, they
+ * keep the current selection.
+ */
+static void
+blake3_bench_impls(void)
+{
+	int state = REGISTRY_EMPTY;
+	int i, c;
+
+	if (!__atomic_compare_exchange_n(&blake3_bench_state, &state,
+	    REGISTRY_BUSY, B_FALSE, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	blake3_registry_init();
+
+	for (i = 0; i < BLAKE3_BENCH_LEN; i++)
+		blake3_bench_buf[i] = (uint8_t)(i % 251);
+
+	for (c = 0; c < BLAKE3_IMPL_CLASSES; c++)
+		for (i = 0; i < blake3_supported_count; i++)
+			blake3_bench_bw[i][c] =
+			    blake3_bench_impl(blake3_supported_impls[i],
+			    blake3_bench_buf, blake3_bench_len[c]);
+	blake3_bench_select();
+
+	__atomic_store_n(&blake3_bench_state, REGISTRY_READY,
+	    __ATOMIC_RELEASE);
+}
+
+/* copy up to n results of the startup benchmark, return their number */
+int
+blake3_get_impl_bench(blake3_impl_bench_t *table, int n)
+{
+	int i, c;
+
+	if (__atomic_load_n(&blake3_bench_state, __ATOMIC_ACQUIRE) !=
+	    REGISTRY_READY)
+		return (0);
+
+	for (i = 0; i < n && i < blake3_supported_count; i++) {
+		table[i].name = blake3_supported_impls[i]->name;
+		table[i].fastest = 0;
+		for (c = 0; c < BLAKE3_IMPL_CLASSES; c++) {
+			table[i].bandwidth[c] = blake3_bench_bw[i][c];
+			if (i == (int)__atomic_load_n(&blake3_fastest_id[c],
+			    __ATOMIC_RELAXED))
+				table[i].fastest |= 1 << c;
+		}
+	}
+
+	return (i);
+}
+
+/* setup implementation, "fastest" is measured the first time */
 void
 blake3_setup_impl(void)
 {
-	switch (icp_blake3_impl) {
+	blake3_registry_init();
+
+	switch (__atomic_load_n(&icp_blake3_impl, __ATOMIC_RELAXED)) {
 	case IMPL_PARAM:
 		blake3_set_impl_id(blake3_param_id);
-		icp_blake3_impl = IMPL_USER;
+		__atomic_store_n(&icp_blake3_impl, IMPL_USER,
+		    __ATOMIC_RELAXED);
 		break;
 	case IMPL_FASTEST:
+		blake3_bench_impls();
 		blake3_set_impl_id(IMPL_FASTEST);
 		break;
+#ifdef BLAKE3_IMPL_CYCLE
 	case IMPL_CYCLE:
 		blake3_set_impl_id(IMPL_CYCLE);
 		break;
+#endif
 	default:
-		blake3_set_impl_id(blake3_current_id);
 		break;
 	}
 }
 
-/* return selected implementation */
+/* return selected implementation, which is the one for large inputs */
 const blake3_impl_ops_t *
 blake3_impl_get_ops(void)
 {
-	/* each call to ops will cycle */
-	if (icp_blake3_impl == IMPL_CYCLE)
-		blake3_set_impl_id(IMPL_CYCLE);
+	return (blake3_impl_get_ops_len(SIZE_MAX));
+}
+
+/* return implementation selected for an input of len bytes */
+const blake3_impl_ops_t *
+blake3_impl_get_ops_len(size_t len)
+{
+	return (__atomic_load_n(&blake3_impl_get_dispatch()->ops[
+	    blake3_impl_class(len)], __ATOMIC_RELAXED));
+}
+
+/* copy the implementations of all size classes, contexts bind them */
+void
+blake3_impl_get_class_ops(const blake3_impl_ops_t **ops)
+{
+	const blake3_dispatch_t *dispatch = blake3_impl_get_dispatch();
+	int c;
 
-	return (blake3_selected_impl);
+	for (c = 0; c < BLAKE3_IMPL_CLASSES; c++)
+		ops[c] = __atomic_load_n(&dispatch->ops[c], __ATOMIC_RELAXED);
 }
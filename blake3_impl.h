@@ -66,6 +66,10 @@ typedef void (*blake3_compress_xof_f)(const uint32_t cv[8],
     const uint8_t block[BLAKE3_BLOCK_LEN], uint8_t block_len,
     uint64_t counter, uint8_t flags, uint8_t out[64]);
 
+typedef void (*blake3_compress_xof_many_f)(const uint32_t cv[8],
+    const uint8_t block[BLAKE3_BLOCK_LEN], uint8_t block_len,
+    uint64_t counter, uint8_t flags, uint8_t *out, size_t outblocks);
+
 typedef void (*blake3_hash_many_f)(const uint8_t * const *inputs,
     size_t num_inputs, size_t blocks, const uint32_t key[8],
     uint64_t counter, boolean_t increment_counter, uint8_t flags,
@@ -76,6 +80,7 @@ typedef boolean_t (*blake3_is_supported_f)(void);
 typedef struct blake3_impl_ops {
 	blake3_compress_in_place_f compress_in_place;
 	blake3_compress_xof_f compress_xof;
+	blake3_compress_xof_many_f compress_xof_many;
 	blake3_hash_many_f hash_many;
 	blake3_is_supported_f is_supported;
 	int degree;
@@ -89,6 +94,26 @@ extern const blake3_impl_ops_t blake3_generic_impl;
  */
 extern const blake3_impl_ops_t *blake3_impl_get_ops(void);
 
+/*
+ * Returns ops selected for an input of len bytes
+ */
+extern const blake3_impl_ops_t *blake3_impl_get_ops_len(size_t len);
+
+/*
+ * Copies the ops of all size classes
+ */
+extern void blake3_impl_get_class_ops(const blake3_impl_ops_t **ops);
+
+static inline int
+blake3_impl_class(size_t len)
+{
+	if (len < 4 * 1024)
+		return (BLAKE3_IMPL_SMALL);
+	if (len < 64 * 1024)
+		return (BLAKE3_IMPL_MEDIUM);
+	return (BLAKE3_IMPL_LARGE);
+}
+
 #if defined(__aarch64__) || defined(__PPC64__) || defined(__sparc__)
 extern const blake3_impl_ops_t blake3_sse2_impl;
 extern const blake3_impl_ops_t blake3_sse41_impl;
@@ -99,6 +124,7 @@ extern const blake3_impl_ops_t blake3_sse41_impl;
 extern const blake3_impl_ops_t blake3_sse2_impl;
 extern const blake3_impl_ops_t blake3_sse41_impl;
 extern const blake3_impl_ops_t blake3_avx2_impl;
+extern const blake3_impl_ops_t blake3_avx512vl_impl;
 extern const blake3_impl_ops_t blake3_avx512_impl;
 #define	MAX_SIMD_DEGREE 16
 #endif
@@ -155,6 +181,9 @@ static inline unsigned int highest_one(uint64_t x) {
 
 /* Count the number of 1 bits. */
 static inline unsigned int popcnt(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+	return ((unsigned int)__builtin_popcountll(x));
+#else
 	unsigned int count = 0;
 
 	while (x != 0) {
@@ -163,6 +192,7 @@ static inline unsigned int popcnt(uint64_t x) {
 	}
 
 	return (count);
+#endif
 }
 
 /*
@@ -181,10 +211,25 @@ static inline uint32_t counter_high(uint64_t counter) {
 	return ((uint32_t)(counter >> 32));
 }
 
+/*
+ * BLAKE3 is little endian, so on little endian hosts a word is one native,
+ * possibly unaligned load. memcpy() keeps that valid C on any alignment.
+ */
+#if defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__) && \
+	__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define	BLAKE3_NATIVE_LE
+#endif
+
 static inline uint32_t load32(const void *src) {
+#if defined(BLAKE3_NATIVE_LE)
+	uint32_t w;
+	memcpy(&w, src, sizeof (w));
+	return (w);
+#else
 	const uint8_t *p = (const uint8_t *)src;
 	return ((uint32_t)(p[0]) << 0) | ((uint32_t)(p[1]) << 8) |
 	    ((uint32_t)(p[2]) << 16) | ((uint32_t)(p[3]) << 24);
+#endif
 }
 
 static inline void load_key_words(const uint8_t key[BLAKE3_KEY_LEN],
@@ -200,14 +245,19 @@ static inline void load_key_words(const uint8_t key[BLAKE3_KEY_LEN],
 }
 
 static inline void store32(void *dst, uint32_t w) {
+#if defined(BLAKE3_NATIVE_LE)
+	memcpy(dst, &w, sizeof (w));
+#else
 	uint8_t *p = (uint8_t *)dst;
 	p[0] = (uint8_t)(w >> 0);
 	p[1] = (uint8_t)(w >> 8);
 	p[2] = (uint8_t)(w >> 16);
 	p[3] = (uint8_t)(w >> 24);
+#endif
 }
 
-static inline void store_cv_words(uint8_t bytes_out[32], uint32_t cv_words[8]) {
+static inline void store_cv_words(uint8_t bytes_out[32],
+    const uint32_t cv_words[8]) {
 	store32(&bytes_out[0 * 4], cv_words[0]);
 	store32(&bytes_out[1 * 4], cv_words[1]);
 	store32(&bytes_out[2 * 4], cv_words[2]);
@@ -218,6 +268,22 @@ static inline void store_cv_words(uint8_t bytes_out[32], uint32_t cv_words[8]) {
 	store32(&bytes_out[7 * 4], cv_words[7]);
 }
 
+/*
+ * compress_xof_many() for implementations without a multi-block kernel,
+ * the output blocks have consecutive counters
+ */
+static inline void blake3_xof_many_loop(blake3_compress_xof_f compress_xof,
+    const uint32_t cv[8], const uint8_t block[BLAKE3_BLOCK_LEN],
+    uint8_t block_len, uint64_t counter, uint8_t flags, uint8_t *out,
+    size_t outblocks) {
+	while (outblocks > 0) {
+		compress_xof(cv, block, block_len, counter, flags, out);
+		counter += 1;
+		out += BLAKE3_BLOCK_LEN;
+		outblocks -= 1;
+	}
+}
+
 #ifdef	__cplusplus
 }
 #endif
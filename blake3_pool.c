@@ -0,0 +1,305 @@
+/**
+ * This work is released into the public domain with CC0 1.0.
+ *
+ * Copyright (c) 2021-2023 Tino Reichardt
+ *
+ * Latest version: https://github.com/mcmilk/BLAKE3-tests
+ */
+
+#ifndef _KERNEL
+
+#define	_POSIX_C_SOURCE	200809L
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "blake3_impl.h"
+
+/*
+ * Small work-stealing thread pool, which serves as executor for the
+ * fork/join style splitting of large subtrees in front of the iterative
+ * engine compress_subtree_iter() in blake3.c. Every worker
+ * owns a deque: forked tasks are pushed and popped at the tail by the owner
+ * (LIFO, cache friendly) and stolen from the head by idle workers (FIFO, the
+ * biggest pending subtrees). Threads which are not part of the pool share
+ * one extra deque.
+ *
+ * A joining thread never blocks while its task is pending, it keeps running
+ * other tasks until the task it waits for has completed.
+ */
+
+/* unit of work, func(arg) runs on some pool thread */
+typedef struct {
+	void (*func)(void *arg);
+	void *arg;
+	int done;
+} blake3_task_t;
+
+/* the recursion depth limits the number of pending tasks per thread */
+#define	POOL_DEQUE_SIZE	64
+
+typedef struct {
+	pthread_mutex_t lock;
+	blake3_task_t *tasks[POOL_DEQUE_SIZE];
+	unsigned int head;
+	unsigned int tail;
+} pool_deque_t;
+
+struct blake3_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t *threads;
+	pool_deque_t *deques;
+	unsigned int nthreads;
+	unsigned int ndeques;
+	int queued;
+	int shutdown;
+};
+
+/* pool and deque of the current thread */
+static __thread blake3_pool_t *pool_self;
+static __thread unsigned int pool_self_id;
+
+static unsigned int pool_deque_id(blake3_pool_t *pool)
+{
+	if (pool_self == pool)
+		return (pool_self_id);
+
+	/* threads from outside share the last deque */
+	return (pool->ndeques - 1);
+}
+
+static boolean_t deque_push(pool_deque_t *dq, blake3_task_t *task)
+{
+	boolean_t ret = B_FALSE;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail - dq->head < POOL_DEQUE_SIZE) {
+		dq->tasks[dq->tail % POOL_DEQUE_SIZE] = task;
+		dq->tail++;
+		ret = B_TRUE;
+	}
+	pthread_mutex_unlock(&dq->lock);
+
+	return (ret);
+}
+
+static blake3_task_t *deque_pop(pool_deque_t *dq)
+{
+	blake3_task_t *task = NULL;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail != dq->head) {
+		dq->tail--;
+		task = dq->tasks[dq->tail % POOL_DEQUE_SIZE];
+	}
+	pthread_mutex_unlock(&dq->lock);
+
+	return (task);
+}
+
+static blake3_task_t *deque_steal(pool_deque_t *dq)
+{
+	blake3_task_t *task = NULL;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail != dq->head) {
+		task = dq->tasks[dq->head % POOL_DEQUE_SIZE];
+		dq->head++;
+	}
+	pthread_mutex_unlock(&dq->lock);
+
+	return (task);
+}
+
+/* own deque first, then try to steal from all the others */
+static blake3_task_t *pool_find_task(blake3_pool_t *pool, unsigned int id)
+{
+	blake3_task_t *task;
+	unsigned int i;
+
+	task = deque_pop(&pool->deques[id]);
+	for (i = 1; task == NULL && i < pool->ndeques; i++)
+		task = deque_steal(&pool->deques[(id + i) % pool->ndeques]);
+
+	if (task != NULL)
+		__atomic_sub_fetch(&pool->queued, 1, __ATOMIC_RELAXED);
+
+	return (task);
+}
+
+static void pool_run_task(blake3_task_t *task)
+{
+	task->func(task->arg);
+	__atomic_store_n(&task->done, 1, __ATOMIC_RELEASE);
+}
+
+typedef struct {
+	blake3_pool_t *pool;
+	unsigned int id;
+} pool_worker_arg_t;
+
+static void *pool_worker(void *arg)
+{
+	pool_worker_arg_t *wa = arg;
+	blake3_pool_t *pool = wa->pool;
+	unsigned int id = wa->id;
+	blake3_task_t *task;
+	int stop;
+
+	free(wa);
+	pool_self = pool;
+	pool_self_id = id;
+
+	for (;;) {
+		task = pool_find_task(pool, id);
+		if (task != NULL) {
+			pool_run_task(task);
+			continue;
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		while (__atomic_load_n(&pool->queued, __ATOMIC_RELAXED) <= 0 &&
+		    !pool->shutdown)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		stop = pool->shutdown;
+		pthread_mutex_unlock(&pool->lock);
+		if (stop)
+			break;
+	}
+
+	return (NULL);
+}
+
+/* create a pool, nthreads counts the calling thread, 0 means all cpus */
+blake3_pool_t *
+blake3_pool_create(unsigned int nthreads)
+{
+	blake3_pool_t *pool;
+	unsigned int i;
+
+	if (nthreads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = (cpus > 0) ? (unsigned int)cpus : 1;
+	}
+
+	pool = calloc(1, sizeof (blake3_pool_t));
+	if (pool == NULL)
+		return (NULL);
+
+	/* the caller helps out while joining, so spawn one thread less */
+	pool->ndeques = nthreads;
+	pool->deques = calloc(pool->ndeques, sizeof (pool_deque_t));
+	pool->threads = calloc(nthreads, sizeof (pthread_t));
+	if (pool->deques == NULL || pool->threads == NULL) {
+		free(pool->deques);
+		free(pool->threads);
+		free(pool);
+		return (NULL);
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	for (i = 0; i < pool->ndeques; i++)
+		pthread_mutex_init(&pool->deques[i].lock, NULL);
+
+	for (i = 0; i < nthreads - 1; i++) {
+		pool_worker_arg_t *wa = malloc(sizeof (pool_worker_arg_t));
+		if (wa == NULL)
+			break;
+		wa->pool = pool;
+		wa->id = i;
+		if (pthread_create(&pool->threads[i], NULL, pool_worker, wa)) {
+			free(wa);
+			break;
+		}
+		pool->nthreads++;
+	}
+
+	return (pool);
+}
+
+/* stop all workers and release the pool */
+void
+blake3_pool_destroy(blake3_pool_t *pool)
+{
+	unsigned int i;
+
+	if (pool == NULL)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	for (i = 0; i < pool->ndeques; i++)
+		pthread_mutex_destroy(&pool->deques[i].lock);
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->deques);
+	free(pool->threads);
+	free(pool);
+}
+
+/* queue func(arg) for execution, it may run on any thread of the pool */
+static void *pool_fork(void *priv, void (*func)(void *arg), void *arg)
+{
+	blake3_pool_t *pool = priv;
+	unsigned int id = pool_deque_id(pool);
+	blake3_task_t *task;
+
+	task = malloc(sizeof (blake3_task_t));
+	if (task == NULL)
+		return (NULL);
+
+	task->func = func;
+	task->arg = arg;
+	task->done = 0;
+	if (!deque_push(&pool->deques[id], task)) {
+		/* deque is full, the caller will run it */
+		free(task);
+		return (NULL);
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	__atomic_add_fetch(&pool->queued, 1, __ATOMIC_RELAXED);
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	return (task);
+}
+
+/* wait for task and help with pending work in the meantime */
+static void pool_join(void *priv, void *handle)
+{
+	blake3_pool_t *pool = priv;
+	blake3_task_t *task = handle;
+	unsigned int id = pool_deque_id(pool);
+	blake3_task_t *other;
+
+	while (!__atomic_load_n(&task->done, __ATOMIC_ACQUIRE)) {
+		other = pool_find_task(pool, id);
+		if (other != NULL)
+			pool_run_task(other);
+		else
+			sched_yield();
+	}
+	free(task);
+}
+
+/* setup executor, which runs the forked subtrees on the pool */
+void
+blake3_pool_executor(blake3_pool_t *pool, blake3_executor_t *executor)
+{
+	executor->fork = pool_fork;
+	executor->join = pool_join;
+	executor->priv = pool;
+	executor->min_len = 0;
+}
+
+#endif /* _KERNEL */
@@ -12,6 +12,7 @@
 #include <sys/time.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
 
 #include <stdarg.h>
 #include <stdlib.h>
@@ -41,6 +42,9 @@ typedef struct {
 
 	/* salted hash value */
 	const char *shash;
+
+	/* derived key value */
+	const char *dkey;
 } blake3_test_t;
 
 /* BLAKE3 is variable here */
@@ -51,6 +55,12 @@ typedef struct {
  */
 static const char *salt = "whats the Elvish word for friend";
 
+/*
+ * context string for the key derivation
+ */
+static const char *context =
+	"BLAKE3 2019-12-27 16:29:52 test vectors context";
+
 static blake3_test_t TestArray[] = {
 	{
 	    0,
@@ -62,6 +72,10 @@ static blake3_test_t TestArray[] = {
 	    "8171a2f22a4b94822c701f107153dba24918c4bae4d2945c20ece13387627d3b73"
 	    "cbf97b797d5e59948c7ef788f54372df45e45e4293c7dc18c1d41144a9758be589"
 	    "60856be1eabbe22c2653190de560ca3b2ac4aa692a9210694254c371e851bc8f",
+	    "2cc39783c223154fea8dfb7c1b1660f2ac2dcbd1c1de8277b0b0dd39b7e50d7d90"
+	    "5630c8be290dfcf3e6842f13bddd573c098c3f17361f1f206b8cad9d088aa4a3f7"
+	    "46752c6b0ce6a83b0da81d59649257cdf8eb3e9f7d4998e41021fac119deefb896"
+	    "224ac99f860011f73609e6e0e4540f93b273e56547dfd3aa1a035ba6689d89a0",
 	},
 	{
 	    1,
@@ -73,6 +87,10 @@ static blake3_test_t TestArray[] = {
 	    "68c0490609413006fbd428eb3fd14e7756d90f73a4725fad147f7bf70fd61c4e0c"
 	    "f7074885e92b0e3f125978b4154986d4fb202a3f331a3fb6cf349a3a70e49990f9"
 	    "8fe4289761c8602c4e6ab1138d31d3b62218078b2f3ba9a88e1d08d0dd4cea11",
+	    "b3e2e340a117a499c6cf2398a19ee0d29cca2bb7404c73063382693bf66cb06c58"
+	    "27b91bf889b6b97c5477f535361caefca0b5d8c4746441c5761711193315895067"
+	    "0f9aa8a05d791daae10ac683cbef8faf897c84e6114a59d2173c3f417023a35d69"
+	    "83f2c7dfa57e7fc559ad751dbfb9ffab39c2ef8c4aafebc9ae973a64f0c76551",
 	},
 	{
 	    2,
@@ -84,6 +102,10 @@ static blake3_test_t TestArray[] = {
 	    "fbf7efd13e989a6c246f96d3a96b9d279f2c4e63fb0bdff633957acf50ee1a5f65"
 	    "8be144bab0f6f16500dee4aa5967fc2c586d85a04caddec90fffb7633f46a60786"
 	    "024353b9e5cebe277fcd9514217fee2267dcda8f7b31697b7c54fab6a939bf8f",
+	    "1f166565a7df0098ee65922d7fea425fb18b9943f19d6161e2d17939356168e6da"
+	    "a59cae19892b2d54f6fc9f475d26031fd1c22ae0a3e8ef7bdb23f452a15e002762"
+	    "9d2e867b1bb1e6ab21c71297377750826c404dfccc2406bd57a83775f89e0b075e"
+	    "59a7732326715ef912078e213944f490ad68037557518b79c0086de6d6f6cdd2",
 	},
 	{
 	    3,
@@ -95,6 +117,10 @@ static blake3_test_t TestArray[] = {
 	    "142d0fab08e1b161efdbb28d18afc64d8f72160c958e53a950cdecf91c1a1bbab1"
 	    "a9c0f01def762a77e2e8545d4dec241e98a89b6db2e9a5b070fc110caae2622690"
 	    "bd7b76c02ab60750a3ea75426a6bb8803c370ffe465f07fb57def95df772c39f",
+	    "440aba35cb006b61fc17c0529255de438efc06a8c9ebf3f2ddac3b5a86705797f2"
+	    "7e2e914574f4d87ec04c379e12789eccbfbc15892626042707802dbe4e97c3ff59"
+	    "dca80c1e54246b6d055154f7348a39b7d098b2b4824ebe90e104e763b2a4475121"
+	    "32cede16243484a55a4e40a85790038bb0dcf762e8c053cabae41bbe22a5bff7",
 	},
 	{
 	    4,
@@ -106,6 +132,10 @@ static blake3_test_t TestArray[] = {
 	    "6c0acff3f0d1fa97ab38d813fd46506089118147d83393019b068a55d646251ecf"
 	    "81105f798d76a10ae413f3d925787d6216a7eb444e510fd56916f1d753a5544ecf"
 	    "0072134a146b2615b42f50c179f56b8fae0788008e3e27c67482349e249cb86a",
+	    "f46085c8190d69022369ce1a18880e9b369c135eb93f3c63550d3e7630e91060fb"
+	    "d7d8f4258bec9da4e05044f88b91944f7cab317a2f0c18279629a3867fad0662c9"
+	    "ad4d42c6f27e5b124da17c8c4f3a94a025ba5d1b623686c6099d202a7317a82e3d"
+	    "95dae46a87de0555d727a5df55de44dab799a20dffe239594d6e99ed17950910",
 	},
 	{
 	    5,
@@ -117,6 +147,10 @@ static blake3_test_t TestArray[] = {
 	    "b199d1f2f3e53bffb17f0a2209fe8b4f7d4c7bae59c2bc7d01f1ff94c67588cc6b"
 	    "38fa6024886f2c078bfe09b5d9e6584cd6c521c3bb52f4de7687b37117a2dbbec0"
 	    "d59e92fa9a8cc3240d4432f91757aabcae03e87431dac003e7d73574bfdd8218",
+	    "1f24eda69dbcb752847ec3ebb5dd42836d86e58500c7c98d906ecd82ed9ae47f6f"
+	    "48a3f67e4e43329c9a89b1ca526b9b35cbf7d25c1e353baffb590fd79be58ddb6c"
+	    "711f1a6b60e98620b851c688670412fcb0435657ba6b638d21f0f2a04f2f6b0bd8"
+	    "834837b10e438d5f4c7c2c71299cf7586ea9144ed09253d51f8f54dd6bff719d",
 	},
 	{
 	    6,
@@ -128,6 +162,10 @@ static blake3_test_t TestArray[] = {
 	    "ffb3aa05f2631f0fa9ac19b6e97eb7e6669e5ec254799350c8b8d189e880780084"
 	    "2a5383c4d907c932f34490aaf00064de8cdb157357bde37c1504d2960034930887"
 	    "603abc5ccb9f5247f79224baff6120a3c622a46d7b1bcaee02c5025460941256",
+	    "be96b30b37919fe4379dfbe752ae77b4f7e2ab92f7ff27435f76f2f065f6a5f435"
+	    "ae01a1d14bd5a6b3b69d8cbd35f0b01ef2173ff6f9b640ca0bd4748efa398bf9a9"
+	    "c0acd6a66d9332fdc9b47ffe28ba7ab6090c26747b85f4fab22f936b71eb3f6461"
+	    "3d8bd9dfabe9bb68da19de78321b481e5297df9e40ec8a3d662f3e1479c65de0",
 	},
 	{
 	    7,
@@ -139,6 +177,10 @@ static blake3_test_t TestArray[] = {
 	    "5035ba0f48a9c73dabb2be0533d02e8fd5d0d5639a18b2803ba6bf527e1d145d5f"
 	    "d6406c437b79bcaad6c7bdf1cf4bd56a893c3eb9510335a7a798548c6753f74617"
 	    "bede88bef924ba4b334f8852476d90b26c5dc4c3668a2519266a562c6c8034a6",
+	    "dc3b6485f9d94935329442916b0d059685ba815a1fa2a14107217453a7fc9f0e66"
+	    "266db2ea7c96843f9d8208e600a73f7f45b2f55b9e6d6a7ccf05daae63a3fdd10b"
+	    "25ac0bd2e224ce8291f88c05976d575df998477db86fb2cfbbf91725d62cb57acf"
+	    "eb3c2d973b89b503c2b60dde85a7802b69dc1ac2007d5623cbea8cbfb6b181f5",
 	},
 	{
 	    8,
@@ -150,6 +192,10 @@ static blake3_test_t TestArray[] = {
 	    "eb5e68ce6dea1eb0229e144f578b3aa7e9f4f85febd135df8525e6fe40c6f0340d"
 	    "13dd09b255ccd5112a94238f2be3c0b5b7ecde06580426a93e0708555a265305ab"
 	    "f86d874e34b4995b788e37a823491f25127a502fe0704baa6bfdf04e76c13276",
+	    "2b166978cef14d9d438046c720519d8b1cad707e199746f1562d0c87fbd32940f0"
+	    "e2545a96693a66654225ebbaac76d093bfa9cd8f525a53acb92a861a98c42e7d1c"
+	    "4ae82e68ab691d510012edd2a728f98cd4794ef757e94d6546961b4f280a51aac3"
+	    "39cc95b64a92b83cc3f26d8af8dfb4c091c240acdb4d47728d23e7148720ef04",
 	},
 	{
 	    63,
@@ -161,6 +207,10 @@ static blake3_test_t TestArray[] = {
 	    "5a63d74a840aecd514f654f080e51ac50fd617d22610d91780fe6b07a26b0847ab"
 	    "b38291058c97474ef6ddd190d30fc318185c09ca1589d2024f0a6f16d45f116783"
 	    "77483fa5c005b2a107cb9943e5da634e7046855eaa888663de55d6471371d55d",
+	    "b6451e30b953c206e34644c6803724e9d2725e0893039cfc49584f991f451af3b8"
+	    "9e8ff572d3da4f4022199b9563b9d70ebb616efff0763e9abec71b550f1371e233"
+	    "319c4c4e74da936ba8e5bbb29a598e007a0bbfa929c99738ca2cc098d59134d11f"
+	    "f300c39f82e2fce9f7f0fa266459503f64ab9913befc65fddc474f6dc1c67669",
 	},
 	{
 	    64,
@@ -172,6 +222,10 @@ static blake3_test_t TestArray[] = {
 	    "44c26010afc3f762615bbac552a1ca909e67c83e2fd5478cf46b9e811efccc93f7"
 	    "7a21b17a152ebaca1695733fdb086e23cd0eb48c41c034d52523fc21236e5d8c92"
 	    "55306e48d52ba40b4dac24256460d56573d1312319afcf3ed39d72d0bfc69acb",
+	    "a5c4a7053fa86b64746d4bb688d06ad1f02a18fce9afd3e818fefaa7126bf73e9b"
+	    "9493a9befebe0bf0c9509fb3105cfa0e262cde141aa8e3f2c2f77890bb64a4cca9"
+	    "6922a21ead111f6338ad5244f2c15c44cb595443ac2ac294231e31be4a4307d0a9"
+	    "1e874d36fc9852aeb1265c09b6e0cda7c37ef686fbbcab97e8ff66718be048bb",
 	},
 	{
 	    65,
@@ -183,6 +237,10 @@ static blake3_test_t TestArray[] = {
 	    "e795f46a596b02d3d4bfb43abad1e5d19211152722ec1f20fef2cd413e3c22f2fc"
 	    "5da3d73041275be6ede3517b3b9f0fc67ade5956a672b8b75d96cb43294b904149"
 	    "7de92637ed3f2439225e683910cb3ae923374449ca788fb0f9bea92731bc26ad",
+	    "51fd05c3c1cfbc8ed67d139ad76f5cf8236cd2acd26627a30c104dfd9d3ff8a82b"
+	    "02e8bd36d8498a75ad8c8e9b15eb386970283d6dd42c8ae7911cc592887fdbe26a"
+	    "0a5f0bf821cd92986c60b2502c9be3f98a9c133a7e8045ea867e0828c7252e7393"
+	    "21f7c2d65daee4468eb4429efae469a42763f1f94977435d10dccae3e3dce88d",
 	},
 	{
 	    127,
@@ -194,6 +252,10 @@ static blake3_test_t TestArray[] = {
 	    "7a317aaccc1458f78d6f65f3427ec97d9c0adb0d6dacd4471374b621b7b5f35cd5"
 	    "4663c64dbe0b9e2d95632f84c611313ea5bd90b71ce97b3cf645776f3adc11e27d"
 	    "135cbadb9875c2bf8d3ae6b02f8a0206aba0c35bfe42574011931c9a255ce6dc",
+	    "c91c090ceee3a3ac81902da31838012625bbcd73fcb92e7d7e56f78deba4f0c3fe"
+	    "eb3974306966ccb3e3c69c337ef8a45660ad02526306fd685c88542ad00f759af6"
+	    "dd1adc2e50c2b8aac9f0c5221ff481565cf6455b772515a69463223202e5c37174"
+	    "3e35210bbbbabd89651684107fd9fe493c937be16e39cfa7084a36207c99bea3",
 	},
 	{
 	    128,
@@ -205,6 +267,10 @@ static blake3_test_t TestArray[] = {
 	    "6bbe0001f10bda47e6077b735016fca8119da11348d93ca302bbd125bde0db2b50"
 	    "edbe728a620bb9d3e6f706286aedea973425c0b9eedf8a38873544cf91badf49ad"
 	    "92a635a93f71ddfcee1eae536c25d1b270956be16588ef1cfef2f1d15f650bd5",
+	    "81720f34452f58a0120a58b6b4608384b5c51d11f39ce97161a0c0e442ca022550"
+	    "e7cd651e312f0b4c6afb3c348ae5dd17d2b29fab3b894d9a0034c7b04fd9190cbd"
+	    "90043ff65d1657bbc05bfdecf2897dd894c7a1b54656d59a50b51190a9da44db42"
+	    "6266ad6ce7c173a8c0bbe091b75e734b4dadb59b2861cd2518b4e7591e4b83c9",
 	},
 	{
 	    129,
@@ -216,6 +282,10 @@ static blake3_test_t TestArray[] = {
 	    "9db018541eec241b748f87725665b7b1ace3e0065b29c3bcb232c90e37897fa5aa"
 	    "ee7e1e8a2ecfcd9b51463e42238cfdd7fee1aecb3267fa7f2128079176132a412c"
 	    "d8aaf0791276f6b98ff67359bd8652ef3a203976d5ff1cd41885573487bcd683",
+	    "938d2d4435be30eafdbb2b7031f7857c98b04881227391dc40db3c7b21f41fc18d"
+	    "72d0f9c1de5760e1941aebf3100b51d64644cb459eb5d20258e233892805eb98b0"
+	    "7570ef2a1787cd48e117c8d6a63a68fd8fc8e59e79dbe63129e88352865721c8d5"
+	    "f0cf183f85e0609860472b0d6087cefdd186d984b21542c1c780684ed6832d8d",
 	},
 	{
 	    1023,
@@ -227,6 +297,10 @@ static blake3_test_t TestArray[] = {
 	    "0316d2e6d8b8c25b0a5b2180f94fb1a158ef508c3cde45e2966bd796a696d3e13e"
 	    "fd86259d756387d9becf5c8bf1ce2192b87025152907b6d8cc33d17826d8b7b9bc"
 	    "97e38c3c85108ef09f013e01c229c20a83d9e8efac5b37470da28575fd755a10",
+	    "74a16c1c3d44368a86e1ca6df64be6a2f64cce8f09220787450722d85725dea59c"
+	    "413264404661e9e4d955409dfe4ad3aa487871bcd454ed12abfe2c2b1eb7757588"
+	    "cf6cb18d2eccad49e018c0d0fec323bec82bf1644c6325717d13ea712e6840d3e6"
+	    "e730d35553f59eff5377a9c350bcc1556694b924b858f329c44ee64b884ef00d",
 	},
 	{
 	    1024,
@@ -238,6 +312,10 @@ static blake3_test_t TestArray[] = {
 	    "8bc838c72852d4f49c864acb7adafe2478e824afe51c8919d06168414c265f298a"
 	    "8094b1ad813a9b8614acabac321f24ce61c5a5346eb519520d38ecc43e89b50002"
 	    "36df0597243e4d2493fd626730e2ba17ac4d8824d09d1a4a8f57b8227778e2de",
+	    "7356cd7720d5b66b6d0697eb3177d9f8d73a4a5c5e968896eb6a6896843027066c"
+	    "23b601d3ddfb391e90d5c8eccdef4ae2a264bce9e612ba15e2bc9d654af1481b2e"
+	    "75dbabe615974f1070bba84d56853265a34330b4766f8e75edd1f4a1650476c108"
+	    "02f22b64bd3919d246ba20a17558bc51c199efdec67e80a227251808d8ce5bad",
 	},
 	{
 	    1025,
@@ -249,6 +327,10 @@ static blake3_test_t TestArray[] = {
 	    "2396b77fdc0d2634a552970843722066c3c15902ae5097e00ff53f1e116f1cd535"
 	    "2720113a837ab2452cafbde4d54085d9cf5d21ca613071551b25d52e69d6c81123"
 	    "872b6f19cd3bc1333edf0c52b94de23ba772cf82636cff4542540a7738d5b930",
+	    "effaa245f065fbf82ac186839a249707c3bddf6d3fdda22d1b95a3c970379bcb5d"
+	    "31013a167509e9066273ab6e2123bc835b408b067d88f96addb550d96b6852dad3"
+	    "8e320b9d940f86db74d398c770f462118b35d2724efa13da97194491d96dd37c3c"
+	    "09cbef665953f2ee85ec83d88b88d11547a6f911c8217cca46defa2751e7f3ad",
 	},
 	{
 	    2048,
@@ -260,6 +342,10 @@ static blake3_test_t TestArray[] = {
 	    "73b961cd574288194b23ece278c330fbb8585485e74967f31352a8183aa782b2b2"
 	    "2f26cdcadb61eed1a5bc144b8198fbb0c13abbf8e3192c145d0a5c21633b0ef860"
 	    "54f42809df823389ee40811a5910dcbd1018af31c3b43aa55201ed4edaac74fe",
+	    "7b2945cb4fef70885cc5d78a87bf6f6207dd901ff239201351ffac04e1088a23e2"
+	    "c11a1ebffcea4d80447867b61badb1383d842d4e79645d48dd82ccba290769caa7"
+	    "af8eaa1bd78a2a5e6e94fbdab78d9c7b74e894879f6a515257ccf6f95056f4e253"
+	    "90f24f6b35ffbb74b766202569b1d797f2d4bd9d17524c720107f985f4ddc583",
 	},
 	{
 	    2049,
@@ -271,6 +357,10 @@ static blake3_test_t TestArray[] = {
 	    "a88abfefdfa1e00b418971f2b39c64ca621e8eb37fceac57fd0c8fc8e117d43b81"
 	    "447be22d5d8186f8f5919ba6bcc6846bd7d50726c06d245672c2ad4f61702c6464"
 	    "99ee1173daa061ffe15bf45a631e2946d616a4c345822f1151284712f76b2b0e",
+	    "2ea477c5515cc3dd606512ee72bb3e0e758cfae7232826f35fb98ca1bcbdf27316"
+	    "d8e9e79081a80b046b60f6a263616f33ca464bd78d79fa18200d06c7fc9bffd808"
+	    "cc4755277a7d5e09da0f29ed150f6537ea9bed946227ff184cc66a72a5f8c1e4bd"
+	    "8b04e81cf40fe6dc4427ad5678311a61f4ffc39d195589bdbc670f63ae70f4b6",
 	},
 	{
 	    3072,
@@ -282,6 +372,10 @@ static blake3_test_t TestArray[] = {
 	    "f302d0529e4174cc507c463671217975e81dab02b8fdeb0d7ccc7568dd22574c78"
 	    "3a76be215441b32e91b9a904be8ea81f7a0afd14bad8ee7c8efc305ace5d3dd61b"
 	    "996febe8da4f56ca0919359a7533216e2999fc87ff7d8f176fbecb3d6f34278b",
+	    "050df97f8c2ead654d9bb3ab8c9178edcd902a32f8495949feadcc1e0480c46b36"
+	    "04131bbd6e3ba573b6dd682fa0a63e5b165d39fc43a625d00207607a2bfeb65ff1"
+	    "d29292152e26b298868e3b87be95d6458f6f2ce6118437b632415abe6ad522874b"
+	    "cd79e4030a5e7bad2efa90a7a7c67e93f0a18fb28369d0a9329ab5c24134ccb0",
 	},
 	{
 	    3073,
@@ -293,6 +387,10 @@ static blake3_test_t TestArray[] = {
 	    "d6da3fe985054d3478865be9a092250839a697bbda74e279e8a9e69f0025e4cfdd"
 	    "d6cfb434b1cd9543aaf97c635d1b451a4386041e4bb100f5e45407cbbc24fa53ea"
 	    "2de3536ccb329e4eb9466ec37093a42cf62b82903c696a93a50b702c80f3c3c5",
+	    "72613c9ec9ff7e40f8f5c173784c532ad852e827dba2bf85b2ab4b76f707908157"
+	    "6288e552647a9d86481c2cae75c2dd4e7c5195fb9ada1ef50e9c5098c249d74392"
+	    "9191441301c69e1f48505a4305ec1778450ee48b8e69dc23a25960fe33070ea549"
+	    "119599760a8a2d28aeca06b8c5e9ba58bc19e11fe57b6ee98aa44b2a8e6b14a5",
 	},
 	{
 	    4096,
@@ -304,6 +402,10 @@ static blake3_test_t TestArray[] = {
 	    "b64a36edb564e01e4b4aaf3b060092a6b838bea44afebd2deb8298fa562b7b597c"
 	    "757b9df4c911c3ca462e2ac89e9a787357aaf74c3b56d5c07bc93ce899568a3eb1"
 	    "7d9250c20f6c5f6c1e792ec9a2dcb715398d5a6ec6d5c54f586a00403a1af1de",
+	    "1e0d7f3db8c414c97c6307cbda6cd27ac3b030949da8e23be1a1a924ad2f25b9d7"
+	    "8038f7b198596c6cc4a9ccf93223c08722d684f240ff6569075ed81591fd93f9ff"
+	    "f1110b3a75bc67e426012e5588959cc5a4c192173a03c00731cf84544f65a2fb93"
+	    "78989f72e9694a6a394a8a30997c2e67f95a504e631cd2c5f55246024761b245",
 	},
 	{
 	    4097,
@@ -315,6 +417,10 @@ static blake3_test_t TestArray[] = {
 	    "6db4976cfdd266ae0abf667d9481831ff12e0caa268e7d3e57260c0824115a54ce"
 	    "595ccc897786d9dcbf495599cfd90157186a46ec800a6763f1c59e36197e9939e9"
 	    "00809f7077c102f888caaf864b253bc41eea812656d46742e4ea42769f89b83f",
+	    "aca51029626b55fda7117b42a7c211f8c6e9ba4fe5b7a8ca922f34299500ead8a8"
+	    "97f66a400fed9198fd61dd2d58d382458e64e100128075fc54b860934e8de2e841"
+	    "70734b06e1d212a117100820dbc48292d148afa50567b8b84b1ec336ae10d40c8c"
+	    "975a624996e12de31abbe135d9d159375739c333798a80c64ae895e51e22f3ad",
 	},
 	{
 	    5120,
@@ -326,6 +432,10 @@ static blake3_test_t TestArray[] = {
 	    "4dc9209cd80ce7c1f7c9a744658e7e288465717ae6e56d5463d4f80cdb2ef56495"
 	    "f6a4f5487f69749af0c34c2cdfa857f3056bf8d807336a14d7b89bf62bef2fb54f"
 	    "9af6a546f818dc1e98b9e07f8a5834da50fa28fb5874af91bf06020d1bf0120e",
+	    "7a7acac8a02adcf3038d74cdd1d34527de8a0fcc0ee3399d1262397ce5817f6055"
+	    "d0cefd84d9d57fe792d65a278fd20384ac6c30fdb340092f1a74a92ace99c482b2"
+	    "8f0fc0ef3b923e56ade20c6dba47e49227166251337d80a037e987ad3a7f728b5a"
+	    "b6dfafd6e2ab1bd583a95d9c895ba9c2422c24ea0f62961f0dca45cad47bfa0d",
 	},
 	{
 	    5121,
@@ -337,6 +447,10 @@ static blake3_test_t TestArray[] = {
 	    "07e63f13667a8d1490e5e04f13eb617aea16a8c8a5aaed1ef6fbde1b0515e3c810"
 	    "50b361af6ead126032998290b563e3caddeaebfab592e155f2e161fb7cba939092"
 	    "133f23f9e65245e58ec23457b78a2e8a125588aad6e07d7f11a85b88d375b72d",
+	    "b07f01e518e702f7ccb44a267e9e112d403a7b3f4883a47ffbed4b48339b3c341a"
+	    "0add0ac032ab5aaea1e4e5b004707ec5681ae0fcbe3796974c0b1cf31a194740c1"
+	    "4519273eedaabec832e8a784b6e7cfc2c5952677e6c3f2c3914454082d7eb1ce17"
+	    "66ac7d75a4d3001fc89544dd46b5147382240d689bbbaefc359fb6ae30263165",
 	},
 	{
 	    6144,
@@ -348,6 +462,10 @@ static blake3_test_t TestArray[] = {
 	    "5754060091dc5caf3efabe0603c60f45e415bb3407db67e6beb3d11cf8e4f79075"
 	    "61f05dace0c15807f4b5f389c841eb114d81a82c02a00b57206b1d11fa6e803486"
 	    "b048a5ce87105a686dee041207e095323dfe172df73deb8c9532066d88f9da7e",
+	    "2a95beae63ddce523762355cf4b9c1d8f131465780a391286a5d01abb5683a1597"
+	    "099e3c6488aab6c48f3c15dbe1942d21dbcdc12115d19a8b8465fb54e9053323a9"
+	    "178e4275647f1a9927f6439e52b7031a0b465c861a3fc531527f7758b2b888cf2f"
+	    "20582e9e2c593709c0a44f9c6e0f8b963994882ea4168827823eef1f64169fef",
 	},
 	{
 	    6145,
@@ -359,6 +477,10 @@ static blake3_test_t TestArray[] = {
 	    "c184ca2f59780e27a576c1d1fb9772e99fd17881d02ac7dfd39675aca918453283"
 	    "ed8c3169085ef4a466b91c1649cc341dfdee60e32231fc34c9c4e0b9a2ba87ca8f"
 	    "372589c744c15fd6f985eec15e98136f25beeb4b13c4e43dc84abcc79cd4646c",
+	    "379bcc61d0051dd489f686c13de00d5b14c505245103dc040d9e4dd1facab8e511"
+	    "4493d029bdbd295aaa744a59e31f35c7f52dba9c3642f773dd0b4262a9980a2aef"
+	    "811697e1305d37ba9d8b6d850ef07fe41108993180cf779aeece363704c7648345"
+	    "8603bbeeb693cffbbe5588d1f3535dcad888893e53d977424bb707201569a8d2",
 	},
 	{
 	    7168,
@@ -370,6 +492,10 @@ static blake3_test_t TestArray[] = {
 	    "f01d5277d69bb681c70fa8d36094f73ec06e452c80d2ff2257ed82e7ba34840098"
 	    "9a65ee8daa7094ae0933e3d2210ac6395c4af24f91c2b590ef87d7788d7066ea3e"
 	    "aebca4c08a4f14b9a27644f99084c3543711b64a070b94f2c9d1d8a90d035d52",
+	    "11c37a112765370c94a51415d0d651190c288566e295d505defdad895dae223730"
+	    "d5a5175a38841693020669c7638f40b9bc1f9f39cf98bda7a5b54ae24218a800a2"
+	    "116b34665aa95d846d97ea988bfcb53dd9c055d588fa21ba78996776ea6c40bc42"
+	    "8b53c62b5f3ccf200f647a5aae8067f0ea1976391fcc72af1945100e2a6dcb88",
 	},
 	{
 	    7169,
@@ -381,6 +507,10 @@ static blake3_test_t TestArray[] = {
 	    "9e28d72fcbfc020814ce3f5d4fc867f01c8f5b6caf305b3ea8a8ba2da3ab69fabc"
 	    "b438f19ff11f5378ad4484d75c478de425fb8e6ee809b54eec9bdb184315dc8566"
 	    "17c09f5340451bf42fd3270a7b0b6566169f242e533777604c118a6358250f54",
+	    "554b0a5efea9ef183f2f9b931b7497995d9eb26f5c5c6dad2b97d62fc5ac31d99b"
+	    "20652c016d88ba2a611bbd761668d5eda3e568e940faae24b0d9991c3bd25a65f7"
+	    "70b89fdcadabcb3d1a9c1cb63e69721cacf1ae69fefdcef1e3ef41bc5312ccc172"
+	    "22199e47a26552c6adc460cf47a72319cb5039369d0060eaea59d6c65130f1dd",
 	},
 	{
 	    8192,
@@ -392,6 +522,10 @@ static blake3_test_t TestArray[] = {
 	    "34464159dcbc12a0ba0c6d6eb41bac0ed6585cabfe0aca36a375e6c5480c22afdc"
 	    "40785c170f5a6b8a1107dbee282318d00d915ac9ed1143ad40765ec120042ee121"
 	    "cd2baa36250c618adaf9e27260fda2f94dea8fb6f08c04f8f10c78292aa46102",
+	    "ad01d7ae4ad059b0d33baa3c01319dcf8088094d0359e5fd45d6aeaa8b2d0c3d4c"
+	    "9e58958553513b67f84f8eac653aeeb02ae1d5672dcecf91cd9985a0e67f450191"
+	    "0ecba25555395427ccc7241d70dc21c190e2aadee875e5aae6bf1912837e53411d"
+	    "abf7a56cbf8e4fb780432b0d7fe6cec45024a0788cf5874616407757e9e6bef7",
 	},
 	{
 	    8193,
@@ -403,6 +537,10 @@ static blake3_test_t TestArray[] = {
 	    "3228648fd983aef045c2fa8290934b0866b615f585149587dda229903996532883"
 	    "5a2b18f1d63b7e300fc76ff260b571839fe44876a4eae66cbac8c67694411ed7e0"
 	    "9df51068a22c6e67d6d3dd2cca8ff12e3275384006c80f4db68023f24eebba57",
+	    "af1e0346e389b17c23200270a64aa4e1ead98c61695d917de7d5b00491c9b0f12f"
+	    "20a01d6d622edf3de026a4db4e4526225debb93c1237934d71c7340bb5916158cb"
+	    "dafe9ac3225476b6ab57a12357db3abbad7a26c6e66290e44034fb08a20a8d0ec2"
+	    "64f309994d2810c49cfba6989d7abb095897459f5425adb48aba07c5fb3c83c0",
 	},
 	{
 	    16384,
@@ -414,6 +552,10 @@ static blake3_test_t TestArray[] = {
 	    "e601b101e4cf63a404dfe50f2e1865bb12edc8fca166579ce0c70dba5a5c0fc960"
 	    "ad6f3772183416a00bd29d4c6e651ea7620bb100c9449858bf14e1ddc9ecd35725"
 	    "581ca5b9160de04060045993d972571c3e8f71e9d0496bfa744656861b169d65",
+	    "160e18b5878cd0df1c3af85eb25a0db5344d43a6fbd7a8ef4ed98d0714c3f7e160"
+	    "dc0b1f09caa35f2f417b9ef309dfe5ebd67f4c9507995a531374d099cf8ae31754"
+	    "2e885ec6f589378864d3ea98716b3bbb65ef4ab5e0ab5bb298a501f19a41ec19af"
+	    "84a5e6b428ecd813b1a47ed91c9657c3fba11c406bc316768b58f6802c9e9b57",
 	},
 	{
 	    31744,
@@ -425,6 +567,10 @@ static blake3_test_t TestArray[] = {
 	    "7258db2d9cd32a7a3ecfce46144114b15c2fcb68a618a976bd74515d47be08b628"
 	    "be420b5e830fade7c080e351a076fbc38641ad80c736c8a18fe3c66ce12f95c61c"
 	    "2462a9770d60d0f77115bbcd3782b593016a4e728d4c06cee4505cb0c08a42ec",
+	    "39772aef80e0ebe60596361e45b061e8f417429d529171b6764468c22928e28e97"
+	    "59adeb797a3fbf771b1bcea30150a020e317982bf0d6e7d14dd9f064bc11025c25"
+	    "f31e81bd78a921db0174f03dd481d30e93fd8e90f8b2fee209f849f2d2a52f3171"
+	    "9a490fb0ba7aea1e09814ee912eba111a9fde9d5c274185f7bae8ba85d300a2b",
 	},
 	{
 	    102400,
@@ -436,9 +582,13 @@ static blake3_test_t TestArray[] = {
 	    "dbdd3e1d81dcbca3ba241bb18760f207710b751846faaeb9dff8262710999a59b2"
 	    "aa1aca298a032d94eacfadf1aa192418eb54808db23b56e34213266aa08499a16b"
 	    "354f018fc4967d05f8b9d2ad87a7278337be9693fc638a3bfdbe314574ee6fc4",
+	    "4652cff7a3f385a6103b5c260fc1593e13c778dbe608efb092fe7ee69df6e9c6d8"
+	    "3a3e041bc3a48df2879f4a0a3ed40e7c961c73eff740f3117a0504c2dff4786d44"
+	    "fb17f1549eb0ba585e40ec29bf7732f0b7e286ff8acddc4cb1e23b87ff5d824a98"
+	    "6458dcc6a04ac83969b80637562953df51ed1a7e90a7926924d2763778be8560",
 	},
 	{
-	    0, 0, 0
+	    0, 0, 0, 0
 	}
 };
 
@@ -466,6 +616,7 @@ static size_t fmt_hexdump(char *dest, const char *src, size_t len) {
 
 void test_blake3_ref() {
 	uint8_t buffer[102400];
+	blake3_derive_ctx_t dctx;
 	int id, i, j;
 
 	for (i = 0, j = 0; i < (int)sizeof (buffer); i++, j++) {
@@ -474,6 +625,8 @@ void test_blake3_ref() {
 		buffer[i] = (uint8_t)j;
 	}
 
+	Blake3_PrepareDeriveKey(&dctx, context);
+
 	printf("Running algorithm correctness tests: ");
 	for (id = 0; id < blake3_get_impl_count(); id++) {
 		blake3_set_impl_id(id);
@@ -504,10 +657,1491 @@ void test_blake3_ref() {
 				printf("%5s: %s\n", "genric", cur->shash);
 				printf("%5s: %s\n", name, result);
 			}
+
+			/* key derivation */
+			Blake3_InitDeriveKey(&ctx, context);
+			Blake3_Update(&ctx, buffer, cur->input_len);
+			Blake3_FinalSeek(&ctx, 0, digest, TEST_DIGEST_LEN);
+			fmt_hexdump(result, (char *)digest, 131);
+			if (memcmp(result, cur->dkey, 131) != 0) {
+				printf("%5s: %s\n", "genric", cur->dkey);
+				printf("%5s: %s\n", name, result);
+			}
+
+			/* key derivation with prepared context */
+			Blake3_DeriveKey(&dctx, buffer, cur->input_len,
+			    digest, TEST_DIGEST_LEN);
+			fmt_hexdump(result, (char *)digest, 131);
+			if (memcmp(result, cur->dkey, 131) != 0) {
+				printf("%5s: %s\n", "genric", cur->dkey);
+				printf("%5s: %s\n", name, result);
+			}
+		}
+		printf("%s ", name);
+	}
+	printf("DONE!\n");
+}
+
+/* fill buffer with the pattern of the official test vectors */
+static uint8_t *test_buffer(size_t len)
+{
+	uint8_t *buf = malloc(len);
+	size_t i;
+
+	if (!buf)
+		exit(111);
+	for (i = 0; i < len; i++)
+		buf[i] = (uint8_t)(i % 251);
+
+	return (buf);
+}
+
+/* host executor for testing, which starts one thread per fork */
+typedef struct {
+	pthread_t thread;
+	void (*func)(void *arg);
+	void *arg;
+} test_job_t;
+
+static void *test_job_run(void *arg)
+{
+	test_job_t *job = arg;
+
+	job->func(job->arg);
+	return (NULL);
+}
+
+static void *test_fork(void *priv, void (*func)(void *arg), void *arg)
+{
+	test_job_t *job = malloc(sizeof (test_job_t));
+
+	(void) priv;
+	if (!job)
+		return (NULL);
+	job->func = func;
+	job->arg = arg;
+	if (pthread_create(&job->thread, NULL, test_job_run, job)) {
+		free(job);
+		return (NULL);
+	}
+
+	return (job);
+}
+
+static void test_join(void *priv, void *handle)
+{
+	test_job_t *job = handle;
+
+	(void) priv;
+	pthread_join(job->thread, NULL);
+	free(job);
+}
+
+/* multi-threaded hashing has to give the same digests */
+void test_blake3_pool() {
+	static const size_t lens[] = {
+	    0, 1, 1024, 1025, 65536, 131073, 1048576 + 7, 4194304, 5000000
+	};
+	uint8_t *buffer = test_buffer(5000000);
+	blake3_pool_t *pool = blake3_pool_create(4);
+	blake3_executor_t executor = {
+		.fork = test_fork,
+		.join = test_join,
+		.min_len = 256 * 1024
+	};
+	int id, i;
+
+	if (!pool)
+		exit(111);
+
+	printf("Running multi-threaded tests: ");
+	for (id = 0; id < blake3_get_impl_count(); id++) {
+		blake3_set_impl_id(id);
+		const char *name = blake3_get_impl_name();
+		for (i = 0; i < (int)ARRAY_SIZE(lens); i++) {
+			BLAKE3_CTX ctx;
+			uint8_t digest[BLAKE3_OUT_LEN];
+			uint8_t pdigest[BLAKE3_OUT_LEN];
+
+			Blake3_Init(&ctx);
+			Blake3_Update(&ctx, buffer, lens[i]);
+			Blake3_Final(&ctx, digest);
+
+			/* second update checks a non empty cv stack */
+			Blake3_Init(&ctx);
+			Blake3_UpdatePool(&ctx, buffer, lens[i] / 3, pool);
+			Blake3_UpdatePool(&ctx, buffer + lens[i] / 3,
+			    lens[i] - lens[i] / 3, pool);
+			Blake3_Final(&ctx, pdigest);
+			if (memcmp(digest, pdigest, BLAKE3_OUT_LEN) != 0)
+				printf("%s: FAILED for %zu bytes\n", name,
+				    lens[i]);
+
+			/* executor of the host */
+			Blake3_Init(&ctx);
+			Blake3_UpdateParallel(&ctx, buffer, lens[i], &executor);
+			Blake3_Final(&ctx, pdigest);
+			if (memcmp(digest, pdigest, BLAKE3_OUT_LEN) != 0)
+				printf("%s: FAILED for %zu bytes (executor)\n",
+				    name, lens[i]);
+		}
+		printf("%s ", name);
+	}
+	printf("DONE!\n");
+
+	blake3_pool_destroy(pool);
+	free(buffer);
+}
+
+/* batch hashing has to match the single message api */
+void test_blake3_batch() {
+	enum { N = 400 };
+	uint8_t *buffer = test_buffer(N * 1200);
+	const uint8_t *inputs[N];
+	uint8_t *outs[N];
+	size_t lens[N];
+	uint8_t digests[N][BLAKE3_OUT_LEN];
+	int id, i;
+
+	/* all kinds of ragged lengths, some above one chunk */
+	for (i = 0; i < N; i++) {
+		inputs[i] = buffer + i * 1200;
+		lens[i] = (i * 37) % 1100;
+		outs[i] = digests[i];
+	}
+	lens[1] = 64;
+	lens[2] = 1024;
+	lens[3] = 1025;
+
+	printf("Running batch hashing tests: ");
+	for (id = 0; id < blake3_get_impl_count(); id++) {
+		blake3_set_impl_id(id);
+		const char *name = blake3_get_impl_name();
+		Blake3_HashBatch(inputs, lens, outs, N);
+		for (i = 0; i < N; i++) {
+			BLAKE3_CTX ctx;
+			uint8_t digest[BLAKE3_OUT_LEN];
+
+			Blake3_Init(&ctx);
+			Blake3_Update(&ctx, inputs[i], lens[i]);
+			Blake3_Final(&ctx, digest);
+			if (memcmp(digest, digests[i], BLAKE3_OUT_LEN) != 0)
+				printf("%s: FAILED for %zu bytes\n", name,
+				    lens[i]);
+		}
+		printf("%s ", name);
+	}
+	printf("DONE!\n");
+
+	free(buffer);
+}
+
+/* contexts updated in lockstep have to match single updates */
+/* counts the lockstep chunk calls, which use the ops of the contexts */
+static const blake3_impl_ops_t *test_many_ops;
+static size_t test_many_calls;
+
+static void test_many_hash_many(const uint8_t * const *inputs,
+    size_t num_inputs, size_t blocks, const uint32_t key[8],
+    uint64_t counter, boolean_t increment_counter, uint8_t flags,
+    uint8_t flags_start, uint8_t flags_end, uint8_t *out)
+{
+	if (blocks == BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN &&
+	    !increment_counter)
+		test_many_calls++;
+	test_many_ops->hash_many(inputs, num_inputs, blocks, key, counter,
+	    increment_counter, flags, flags_start, flags_end, out);
+}
+
+void test_blake3_many() {
+	enum { N = 40, ROUNDS = 6 };
+	static const size_t pieces[] = { 3072, 2048, 700, 5000, 1024, 20000 };
+	uint8_t *buffer = test_buffer(ROUNDS * 20000);
+	BLAKE3_CTX *ctxs[N], *refs[N];
+	const uint8_t *inputs[N];
+	size_t lens[N];
+	int id, i, k, r;
+
+	for (i = 0; i < N; i++) {
+		ctxs[i] = malloc(sizeof (BLAKE3_CTX));
+		refs[i] = malloc(sizeof (BLAKE3_CTX));
+		if (!ctxs[i] || !refs[i])
+			exit(111);
+	}
+
+	printf("Running multi-context tests: ");
+	for (id = 0; id < blake3_get_impl_count(); id++) {
+		blake3_set_impl_id(id);
+		const char *name = blake3_get_impl_name();
+		blake3_impl_ops_t counting = *blake3_impl_get_ops();
+
+		test_many_ops = blake3_impl_get_ops();
+		counting.hash_many = test_many_hash_many;
+		test_many_calls = 0;
+		for (i = 0; i < N; i++) {
+			if (i % 3 == 0) {
+				Blake3_InitKeyed(ctxs[i], (const uint8_t *)salt);
+				Blake3_InitKeyed(refs[i], (const uint8_t *)salt);
+			} else {
+				Blake3_Init(ctxs[i]);
+				Blake3_Init(refs[i]);
+			}
+			for (k = 0; k < BLAKE3_IMPL_CLASSES; k++)
+				ctxs[i]->ops[k] = &counting;
+		}
+
+		/* some streams are in sync, others are not */
+		for (r = 0; r < ROUNDS; r++) {
+			for (i = 0; i < N; i++) {
+				lens[i] = pieces[(r + i / 8) % ARRAY_SIZE(pieces)];
+				inputs[i] = buffer + r * 20000;
+				Blake3_Update(refs[i], inputs[i], lens[i]);
+			}
+			if (Blake3_UpdateMany(ctxs, inputs, lens, N) != 0)
+				printf("%s: FAILED update\n", name);
+		}
+		if (test_many_calls == 0)
+			printf("%s: FAILED to use the context ops\n", name);
+
+		for (i = 0; i < N; i++) {
+			uint8_t digest[BLAKE3_OUT_LEN];
+			uint8_t rdigest[BLAKE3_OUT_LEN];
+
+			Blake3_Final(ctxs[i], digest);
+			Blake3_Final(refs[i], rdigest);
+			if (memcmp(digest, rdigest, BLAKE3_OUT_LEN) != 0)
+				printf("%s: FAILED for context %d\n", name, i);
+		}
+		printf("%s ", name);
+	}
+	printf("DONE!\n");
+
+	for (i = 0; i < N; i++) {
+		free(ctxs[i]);
+		free(refs[i]);
+	}
+	free(buffer);
+}
+
+/* record hashing has to match the single message api */
+void test_blake3_records() {
+	static const size_t lens[] = {
+	    1, 64, 100, 1024, 1025, 2048, 3000, 4096, 16384, 65541, 1048576
+	};
+	static const size_t counts[] = { 1, 3, 17, 40 };
+	uint8_t *buffer = test_buffer(40 * 1048576);
+	uint8_t *digests = malloc(40 * BLAKE3_OUT_LEN);
+	int id, i, c, r;
+
+	if (!digests)
+		exit(111);
+
+	printf("Running record hashing tests: ");
+	for (id = 0; id < blake3_get_impl_count(); id++) {
+		blake3_set_impl_id(id);
+		const char *name = blake3_get_impl_name();
+		for (i = 0; i < (int)ARRAY_SIZE(lens); i++) {
+			for (c = 0; c < (int)ARRAY_SIZE(counts); c++) {
+				if (Blake3_HashRecords(buffer, lens[i],
+				    counts[c], digests) != 0)
+					exit(111);
+				for (r = 0; r < (int)counts[c]; r++) {
+					BLAKE3_CTX ctx;
+					uint8_t digest[BLAKE3_OUT_LEN];
+
+					Blake3_Init(&ctx);
+					Blake3_Update(&ctx, buffer + r *
+					    lens[i], lens[i]);
+					Blake3_Final(&ctx, digest);
+					if (memcmp(digest, digests + r *
+					    BLAKE3_OUT_LEN, BLAKE3_OUT_LEN))
+						printf("%s: FAILED for %zu "
+						    "bytes\n", name, lens[i]);
+				}
+			}
+		}
+		printf("%s ", name);
+	}
+	printf("DONE!\n");
+
+	free(digests);
+	free(buffer);
+}
+
+/* counts the blocks, which reach compress_xof_many() of test_xof_ops */
+static const blake3_impl_ops_t *test_xof_ops;
+static size_t test_xof_blocks;
+
+static void test_xof_many(const uint32_t cv[8],
+    const uint8_t block[BLAKE3_BLOCK_LEN], uint8_t block_len,
+    uint64_t counter, uint8_t flags, uint8_t *out, size_t outblocks)
+{
+	test_xof_blocks += outblocks;
+	test_xof_ops->compress_xof_many(cv, block, block_len, counter, flags,
+	    out, outblocks);
+}
+
+void test_blake3_xof() {
+	static const size_t seeks[] = {
+	    0, 1, 64, 100, 640, 640 + 5, 1024 + 64
+	};
+	static const size_t lens[] = { 128, 129, 200, 1000, 1024, 4160 };
+	const size_t total = 8192;
+	uint8_t *input = test_buffer(3000);
+	uint8_t *expected = malloc(total);
+	uint8_t *out = malloc(total);
+	BLAKE3_CTX ctx;
+	size_t pos, len;
+	int id, i, j;
+
+	if (!expected || !out)
+		exit(111);
+
+	/* reference output, small pieces only use single block compression */
+	blake3_set_impl_id(0);
+	Blake3_Init(&ctx);
+	Blake3_Update(&ctx, input, 3000);
+	for (pos = 0; pos < total; pos += len) {
+		len = (total - pos < 37) ? total - pos : 37;
+		Blake3_FinalSeek(&ctx, pos, expected + pos, len);
+	}
+
+	printf("Running extendable output tests: ");
+	for (id = 0; id < blake3_get_impl_count(); id++) {
+		blake3_set_impl_id(id);
+		const char *name = blake3_get_impl_name();
+		blake3_impl_ops_t counting = *blake3_impl_get_ops();
+
+		/* every size class of the context counts its blocks */
+		test_xof_ops = blake3_impl_get_ops();
+		counting.compress_xof_many = test_xof_many;
+		Blake3_Init(&ctx);
+		Blake3_Update(&ctx, input, 3000);
+		for (i = 0; i < BLAKE3_IMPL_CLASSES; i++)
+			ctx.ops[i] = &counting;
+		for (i = 0; i < (int)ARRAY_SIZE(seeks); i++) {
+			for (j = 0; j < (int)ARRAY_SIZE(lens); j++) {
+				size_t head = (64 - seeks[i] % 64) % 64;
+				size_t blocks = (lens[j] - head) / 64;
+
+				if (blocks < 2)
+					blocks = 0;
+
+				test_xof_blocks = 0;
+				Blake3_FinalSeek(&ctx, seeks[i], out, lens[j]);
+				if (memcmp(out, expected + seeks[i], lens[j]))
+					printf("%s: FAILED for seek %zu, "
+					    "len %zu\n", name, seeks[i],
+					    lens[j]);
+
+				/* all whole blocks after an unaligned seek */
+				if (test_xof_blocks != blocks)
+					printf("%s: FAILED for %zu multi-block "
+					    "outputs at seek %zu, len %zu\n",
+					    name, test_xof_blocks, seeks[i],
+					    lens[j]);
+			}
+		}
+		printf("%s ", name);
+	}
+	printf("DONE!\n");
+
+	free(out);
+	free(expected);
+	free(input);
+}
+
+void test_blake3_large() {
+	static const size_t lens[] = {
+	    65537, 1048576, 1048576 + 1023, 3 * 1048576 + 1234, 16 * 1048576
+	};
+	static const size_t prefixes[] = { 0, 1000, 4096 };
+	uint8_t *buffer = test_buffer(16 * 1048576 + 4096);
+	int id, i, p;
+
+	printf("Running large input tests: ");
+	for (id = 0; id < blake3_get_impl_count(); id++) {
+		blake3_set_impl_id(id);
+		const char *name = blake3_get_impl_name();
+		for (i = 0; i < (int)ARRAY_SIZE(lens); i++) {
+			for (p = 0; p < (int)ARRAY_SIZE(prefixes); p++) {
+				BLAKE3_CTX ctx;
+				uint8_t digest[BLAKE3_OUT_LEN];
+				uint8_t expected[BLAKE3_OUT_LEN];
+				size_t len = prefixes[p] + lens[i], pos, n;
+
+				/* one call, after a prefix of the input */
+				Blake3_Init(&ctx);
+				Blake3_Update(&ctx, buffer, prefixes[p]);
+				Blake3_Update(&ctx, buffer + prefixes[p],
+				    lens[i]);
+				Blake3_Final(&ctx, digest);
+
+				/* slices of 64 KiB */
+				Blake3_Init(&ctx);
+				for (pos = 0; pos < len; pos += n) {
+					n = (len - pos < 65536) ?
+					    len - pos : 65536;
+					Blake3_Update(&ctx, buffer + pos, n);
+				}
+				Blake3_Final(&ctx, expected);
+
+				if (memcmp(digest, expected, BLAKE3_OUT_LEN))
+					printf("%s: FAILED for %zu bytes\n",
+					    name, len);
+			}
+		}
+		printf("%s ", name);
+	}
+	printf("DONE!\n");
+
+	free(buffer);
+}
+
+typedef struct {
+	const uint8_t *buffer;
+	const uint8_t *expected;
+	const char *name;
+	int failed;
+} test_registry_t;
+
+/* switch implementations globally while hashing */
+static void *test_registry_run(void *arg)
+{
+	test_registry_t *t = arg;
+	int i;
+
+	for (i = 0; i < 200; i++) {
+		BLAKE3_CTX ctx;
+		uint8_t digest[BLAKE3_OUT_LEN];
+
+		blake3_set_impl_id(i % blake3_get_impl_count());
+		Blake3_Init(&ctx);
+		Blake3_Update(&ctx, t->buffer, 8192);
+		Blake3_Final(&ctx, digest);
+		if (memcmp(digest, t->expected, BLAKE3_OUT_LEN))
+			t->failed = 1;
+	}
+
+	return (NULL);
+}
+
+/* a thread with its own implementation */
+static void *test_registry_thread(void *arg)
+{
+	test_registry_t *t = arg;
+
+	if (blake3_set_impl_name_thread(t->name) != 0 ||
+	    strcmp(blake3_get_impl_name(), t->name) != 0)
+		t->failed = 1;
+	if (blake3_set_impl_name_thread("no-such-impl") != -EINVAL)
+		t->failed = 1;
+	blake3_set_impl_name_thread(NULL);
+
+	return (NULL);
+}
+
+void test_blake3_registry() {
+	uint8_t *buffer = test_buffer(8192);
+	uint8_t expected[BLAKE3_OUT_LEN];
+	test_registry_t jobs[4];
+	pthread_t threads[4];
+	BLAKE3_CTX ctx;
+	int id, i;
+
+	Blake3_Init(&ctx);
+	Blake3_Update(&ctx, buffer, 8192);
+	Blake3_Final(&ctx, expected);
+
+	printf("Running registry tests: ");
+	for (i = 0; i < 4; i++) {
+		jobs[i].buffer = buffer;
+		jobs[i].expected = expected;
+		jobs[i].failed = 0;
+		if (pthread_create(&threads[i], NULL, test_registry_run,
+		    &jobs[i]))
+			exit(111);
+	}
+	for (i = 0; i < 4; i++) {
+		pthread_join(threads[i], NULL);
+		if (jobs[i].failed)
+			printf("FAILED for concurrent selection\n");
+	}
+
+	for (id = 0; id < blake3_get_impl_count(); id++) {
+		blake3_set_impl_id(id);
+		const char *name = blake3_get_impl_name();
+
+		/* override in another thread, this one keeps its selection */
+		jobs[0].name = name;
+		blake3_set_impl_id(0);
+		jobs[0].failed = 0;
+		if (pthread_create(&threads[0], NULL, test_registry_thread,
+		    &jobs[0]))
+			exit(111);
+		pthread_join(threads[0], NULL);
+		if (jobs[0].failed || blake3_get_impl_id() != 0)
+			printf("%s: FAILED for thread selection\n", name);
+		printf("%s ", name);
+	}
+	printf("DONE!\n");
+
+	free(buffer);
+}
+
+void test_blake3_bench() {
+	blake3_impl_bench_t table[8];
+	uint64_t best;
+	int n, i, c, fastest;
+
+	printf("Running startup benchmark tests: ");
+	blake3_setup_impl();
+	n = blake3_get_impl_bench(table, 8);
+	if (n != blake3_get_impl_count())
+		printf("FAILED for count %d\n", n);
+
+	for (c = 0; c < BLAKE3_IMPL_CLASSES; c++) {
+		best = 0;
+		fastest = -1;
+		for (i = 0; i < n; i++) {
+			if (table[i].bandwidth[c] == 0)
+				printf("%s: FAILED for bandwidth\n",
+				    table[i].name);
+			if (table[i].bandwidth[c] > best)
+				best = table[i].bandwidth[c];
+			if (table[i].fastest & (1 << c))
+				fastest = i;
+		}
+		if (fastest < 0 || table[fastest].bandwidth[c] != best ||
+		    strcmp(blake3_get_impl_class_name(c),
+		    table[fastest].name) != 0)
+			printf("FAILED for fastest selection of class %d\n",
+			    c);
+	}
+	if (strcmp(blake3_get_impl_name(),
+	    blake3_get_impl_class_name(BLAKE3_IMPL_LARGE)) != 0)
+		printf("FAILED for selected name\n");
+	for (i = 0; i < n; i++)
+		printf("%s ", table[i].name);
+	printf("DONE!\n");
+}
+
+/* size classes set by the user, a single selection overrides them */
+void test_blake3_classes() {
+	static const size_t sizes[] = { 100, 8192, 200000 };
+	uint8_t *buffer = test_buffer(200000);
+	uint8_t expected[3][BLAKE3_OUT_LEN], digest[BLAKE3_OUT_LEN];
+	int last = blake3_get_impl_count() - 1;
+	const char *small, *large;
+	BLAKE3_CTX ctx;
+	int i, id;
+
+	printf("Running size class tests: ");
+	blake3_set_impl_id(0);
+	for (i = 0; i < 3; i++) {
+		Blake3_Init(&ctx);
+		Blake3_Update(&ctx, buffer, sizes[i]);
+		Blake3_Final(&ctx, expected[i]);
+	}
+
+	blake3_set_impl_id(last);
+	large = blake3_get_impl_name();
+	blake3_set_impl_id(0);
+	small = blake3_get_impl_name();
+
+	blake3_set_impl_name("fastest");
+	if (blake3_set_impl_class(BLAKE3_IMPL_SMALL, large) != 0 ||
+	    blake3_set_impl_class(BLAKE3_IMPL_LARGE, small) != 0)
+		printf("FAILED for set class\n");
+	if (blake3_set_impl_class(BLAKE3_IMPL_CLASSES, small) != -EINVAL ||
+	    blake3_set_impl_class(BLAKE3_IMPL_SMALL, "no-such-impl") !=
+	    -EINVAL)
+		printf("FAILED for invalid class\n");
+	if (strcmp(blake3_get_impl_class_name(BLAKE3_IMPL_SMALL), large) ||
+	    strcmp(blake3_get_impl_class_name(BLAKE3_IMPL_LARGE), small))
+		printf("FAILED for class names\n");
+
+	/* one context crosses all classes */
+	for (i = 0; i < 3; i++) {
+		Blake3_Init(&ctx);
+		Blake3_Update(&ctx, buffer, sizes[i]);
+		Blake3_Final(&ctx, digest);
+		if (memcmp(digest, expected[i], BLAKE3_OUT_LEN))
+			printf("FAILED for size %zu\n", sizes[i]);
+	}
+
+	for (id = 0; id <= last; id++) {
+		blake3_set_impl_id(id);
+		printf("%s ", blake3_get_impl_name());
+		for (i = 0; i < BLAKE3_IMPL_CLASSES; i++)
+			if (strcmp(blake3_get_impl_class_name(i),
+			    blake3_get_impl_name()))
+				printf("FAILED for single selection\n");
+	}
+
+	blake3_set_impl_class(BLAKE3_IMPL_SMALL, NULL);
+	blake3_set_impl_class(BLAKE3_IMPL_LARGE, NULL);
+	blake3_set_impl_name("fastest");
+	printf("DONE!\n");
+
+	free(buffer);
+}
+
+/* save and load the tuning cache, a crafted one changes the selection */
+void test_blake3_tune() {
+	blake3_impl_bench_t table[8];
+	char path[64], crafted[80], line[256];
+	const char *small = blake3_get_impl_class_name(BLAKE3_IMPL_SMALL);
+	FILE *in, *out;
+	int i = 0;
+
+	printf("Running tuning cache tests: ");
+	snprintf(path, sizeof (path), "/tmp/blake3_test.%ld.tune",
+	    (long)getpid());
+	snprintf(crafted, sizeof (crafted), "%s.crafted", path);
+	blake3_get_impl_bench(table, 8);
+
+	if (blake3_tune_save(path) != 0 || blake3_tune_load(path) != 0 ||
+	    strcmp(blake3_get_impl_class_name(BLAKE3_IMPL_SMALL), small))
+		printf("FAILED for save and load\n");
+	if (blake3_tune_load("/nonexistent/blake3.tune") != -ENOENT)
+		printf("FAILED for missing cache\n");
+
+	/* the generic one is fastest for small inputs */
+	in = fopen(path, "r");
+	out = fopen(crafted, "w");
+	if (in == NULL || out == NULL)
+		exit(111);
+	while (fgets(line, sizeof (line), in) != NULL) {
+		if (strncmp(line, "impl ", 5) == 0) {
+			fprintf(out, "impl %s %d %d %d\n", table[i].name,
+			    i == 0 ? 1000 : 1, 1, 1);
+			printf("%s ", table[i++].name);
+		} else {
+			fputs(line, out);
+		}
+	}
+	fclose(in);
+	fclose(out);
+	if (blake3_tune_load(crafted) != 0 ||
+	    strcmp(blake3_get_impl_class_name(BLAKE3_IMPL_SMALL),
+	    table[0].name))
+		printf("FAILED for crafted cache\n");
+
+	/* another version is rejected, the selection stays */
+	out = fopen(crafted, "w");
+	if (out == NULL)
+		exit(111);
+	fprintf(out, "blake3-tune 0\n");
+	fclose(out);
+	if (blake3_tune_load(crafted) != -EINVAL ||
+	    strcmp(blake3_get_impl_class_name(BLAKE3_IMPL_SMALL),
+	    table[0].name))
+		printf("FAILED for other version\n");
+
+	if (blake3_tune_load(path) != 0 ||
+	    strcmp(blake3_get_impl_class_name(BLAKE3_IMPL_SMALL), small))
+		printf("FAILED for reload\n");
+	unlink(path);
+	unlink(crafted);
+	printf("DONE!\n");
+}
+
+/* outboard sink for testing, which writes into a buffer */
+static void test_outboard_write(void *priv, uint64_t offset, const void *buf,
+    size_t len)
+{
+	memcpy((uint8_t *)priv + offset, buf, len);
+}
+
+/* hash an input into an outboard, in one piece, in pieces or in parallel */
+static void test_outboard(uint8_t *outboard, const uint8_t *buffer,
+    size_t len, int mode, blake3_pool_t *pool)
+{
+	blake3_outboard_t ob = {
+		.write = test_outboard_write,
+		.priv = outboard,
+		.input_len = len
+	};
+	BLAKE3_CTX ctx;
+	uint8_t digest[BLAKE3_OUT_LEN];
+	size_t done, n;
+
+	memset(outboard, 0xff, Blake3_OutboardSize(len));
+	Blake3_Init(&ctx);
+	Blake3_SetOutboard(&ctx, &ob);
+	for (done = 0; done < len; done += n) {
+		n = len - done;
+		if (mode == 1 && n > 777)
+			n = 777;
+		if (mode == 2)
+			Blake3_UpdatePool(&ctx, buffer + done, n, pool);
+		else
+			Blake3_Update(&ctx, buffer + done, n);
+	}
+	Blake3_Final(&ctx, digest);
+}
+
+/* the outboard tree has to match the bao encoding, however it is hashed */
+void test_blake3_outboard() {
+	static const struct {
+		size_t len;
+		const char *hash;
+	} vectors[] = {
+	    { 1025, "3772503edd83a1661f2dae45ada092b5"
+		"a1623156736e23d25cbfec22c57047f0" },
+	    { 5000, "66d62a52c036bc419a30dff0ef53a709"
+		"df0926134123778d1524cd7c9a0a969c" },
+	    { 1048576 + 7, "594d9f0b7188db962d85db15a32361fc"
+		"c9afc7209a048272f781950e0893c8ab" },
+	};
+	static const size_t lens[] = {
+	    0, 1, 1024, 2048, 3072, 65536, 300001, 4194304
+	};
+	uint8_t *buffer = test_buffer(4194304);
+	uint8_t *outboard = malloc(Blake3_OutboardSize(4194304));
+	uint8_t *ref = malloc(Blake3_OutboardSize(4194304));
+	blake3_pool_t *pool = blake3_pool_create(4);
+	int id, i, mode;
+
+	if (!outboard || !ref || !pool)
+		exit(111);
+	if (Blake3_OutboardSize(0) != 8 || Blake3_OutboardSize(1024) != 8 ||
+	    Blake3_OutboardSize(1025) != 72 ||
+	    Blake3_OutboardSize(4194304) != 8 + 4095 * 64)
+		printf("FAILED for outboard size\n");
+
+	printf("Running outboard tests: ");
+	for (id = 0; id < blake3_get_impl_count(); id++) {
+		blake3_set_impl_id(id);
+		const char *name = blake3_get_impl_name();
+		for (i = 0; i < (int)ARRAY_SIZE(vectors); i++) {
+			BLAKE3_CTX ctx;
+			uint8_t digest[BLAKE3_OUT_LEN];
+			char result[2 * BLAKE3_OUT_LEN];
+			uint64_t size = Blake3_OutboardSize(vectors[i].len);
+
+			test_outboard(outboard, buffer, vectors[i].len, 0,
+			    NULL);
+			Blake3_Init(&ctx);
+			Blake3_Update(&ctx, outboard, size);
+			Blake3_Final(&ctx, digest);
+			fmt_hexdump(result, (char *)digest, BLAKE3_OUT_LEN);
+			if (memcmp(result, vectors[i].hash, sizeof (result)))
+				printf("%s: FAILED for %zu bytes\n", name,
+				    vectors[i].len);
+		}
+		for (i = 0; i < (int)ARRAY_SIZE(lens); i++) {
+			uint64_t size = Blake3_OutboardSize(lens[i]);
+
+			test_outboard(ref, buffer, lens[i], 0, NULL);
+			if (ref[0] != (uint8_t)lens[i] ||
+			    ref[1] != (uint8_t)(lens[i] >> 8) ||
+			    ref[2] != (uint8_t)(lens[i] >> 16))
+				printf("%s: FAILED header for %zu bytes\n",
+				    name, lens[i]);
+			for (mode = 1; mode <= 2; mode++) {
+				test_outboard(outboard, buffer, lens[i], mode,
+				    pool);
+				if (memcmp(outboard, ref, size) != 0)
+					printf("%s: FAILED for %zu bytes "
+					    "(mode %d)\n", name, lens[i],
+					    mode);
+			}
+		}
+		printf("%s ", name);
+	}
+	printf("DONE!\n");
+
+	blake3_pool_destroy(pool);
+	free(ref);
+	free(outboard);
+	free(buffer);
+}
+
+/* input and outboard of the range tests */
+typedef struct {
+	const uint8_t *input;
+	const uint8_t *outboard;
+} test_range_t;
+
+static int test_read_input(void *priv, uint64_t offset, void *buf,
+    size_t len)
+{
+	memcpy(buf, ((test_range_t *)priv)->input + offset, len);
+	return (0);
+}
+
+static int test_read_outboard(void *priv, uint64_t offset, void *buf,
+    size_t len)
+{
+	memcpy(buf, ((test_range_t *)priv)->outboard + offset, len);
+	return (0);
+}
+
+/* verified ranges have to match the input, and find modified bytes */
+void test_blake3_range() {
+	static const size_t lens[] = {
+	    0, 1, 1024, 1025, 3072, 5000, 65536, 300001, 1048576 + 7
+	};
+	static const struct {
+		uint64_t offset;	/* in 1/16 of the input length */
+		size_t len;
+	} ranges[] = {
+	    { 0, 0 }, { 0, 1 }, { 0, 4096 }, { 3, 1000 }, { 5, 70000 },
+	    { 8, 1 }, { 15, 0 }, { 0, 0x7fffffff }
+	};
+	size_t max = 1048576 + 7;
+	uint8_t *buffer = test_buffer(max);
+	uint8_t *input = malloc(max);
+	uint8_t *outboard = malloc(Blake3_OutboardSize(max));
+	uint8_t *out = malloc(max);
+	test_range_t priv = { input, outboard };
+	blake3_range_reader_t rd = {
+		.read_input = test_read_input,
+		.read_outboard = test_read_outboard,
+		.priv = &priv
+	};
+	int id, i, j;
+
+	if (!input || !outboard || !out)
+		exit(111);
+
+	printf("Running verified range tests: ");
+	for (id = 0; id < blake3_get_impl_count(); id++) {
+		blake3_set_impl_id(id);
+		const char *name = blake3_get_impl_name();
+		for (i = 0; i < (int)ARRAY_SIZE(lens); i++) {
+			size_t len = lens[i];
+			BLAKE3_CTX ctx;
+			uint8_t digest[BLAKE3_OUT_LEN];
+
+			memcpy(input, buffer, len);
+			test_outboard(outboard, input, len, 0, NULL);
+			Blake3_Init(&ctx);
+			Blake3_Update(&ctx, input, len);
+			Blake3_Final(&ctx, digest);
+
+			Blake3_Init(&ctx);
+			for (j = 0; j < (int)ARRAY_SIZE(ranges); j++) {
+				uint64_t offset = ranges[j].offset * len / 16;
+				size_t n = ranges[j].len;
+				int err;
+
+				if (n > len - offset)
+					n = len - offset;
+				err = Blake3_VerifyRange(&ctx, digest, &rd,
+				    offset, n, out);
+				if (err != 0 || memcmp(out, input + offset, n))
+					printf("%s: FAILED for %zu bytes at "
+					    "%llu+%zu\n", name, len,
+					    (unsigned long long)offset, n);
+
+				/* a modified byte within the range */
+				if (n == 0)
+					continue;
+				input[offset + n / 2] ^= 1;
+				if (Blake3_VerifyRange(&ctx, digest, &rd,
+				    offset, n, out) != -EBADMSG)
+					printf("%s: FAILED modified input "
+					    "%llu+%zu\n", name,
+					    (unsigned long long)offset, n);
+				input[offset + n / 2] ^= 1;
+			}
+
+			if (Blake3_VerifyRange(&ctx, digest, &rd, len, 1,
+			    out) != -EINVAL)
+				printf("%s: FAILED beyond %zu bytes\n", name,
+				    len);
+
+			/* modified bytes outside of the range don't matter */
+			if (len > 4 * BLAKE3_CHUNK_LEN) {
+				input[0] ^= 1;
+				if (Blake3_VerifyRange(&ctx, digest, &rd,
+				    2 * BLAKE3_CHUNK_LEN, 10, out) != 0)
+					printf("%s: FAILED outside of range\n",
+					    name);
+				input[0] ^= 1;
+			}
+
+			/*
+			 * A modified length, or a modified CV of the right
+			 * half of the first parent below the root, which the
+			 * path of the first chunk takes as it is.
+			 */
+			if (len > 2 * BLAKE3_CHUNK_LEN) {
+				size_t cv = 8 + BLAKE3_BLOCK_LEN +
+				    BLAKE3_OUT_LEN;
+
+				outboard[0] ^= 1;
+				if (Blake3_VerifyRange(&ctx, digest, &rd, 0, 1,
+				    out) != -EBADMSG)
+					printf("%s: FAILED modified length\n",
+					    name);
+				outboard[0] ^= 1;
+				outboard[cv] ^= 1;
+				if (Blake3_VerifyRange(&ctx, digest, &rd, 0, 1,
+				    out) != -EBADMSG)
+					printf("%s: FAILED modified node\n",
+					    name);
+				outboard[cv] ^= 1;
+			}
+		}
+		printf("%s ", name);
+	}
+	printf("DONE!\n");
+
+	free(out);
+	free(outboard);
+	free(input);
+	free(buffer);
+}
+
+/* the retained tree has to follow modifications in place */
+void test_blake3_tree() {
+	static const size_t lens[] = {
+	    0, 1, 1024, 1025, 2048, 3000, 65536, 300001, 1048576 + 7
+	};
+	size_t max = 1048576 + 7;
+	uint8_t *ref = test_buffer(max);
+	uint8_t *buffer = test_buffer(max);
+	int id, i, j;
+
+	printf("Running retained tree tests: ");
+	for (id = 0; id < blake3_get_impl_count(); id++) {
+		blake3_set_impl_id(id);
+		const char *name = blake3_get_impl_name();
+		/* every length unkeyed and keyed */
+		for (i = 0; i < 2 * (int)ARRAY_SIZE(lens); i++) {
+			size_t len = lens[i / 2];
+			BLAKE3_CTX ctx, init;
+			blake3_tree_t *tree;
+			uint8_t digest[TEST_DIGEST_LEN];
+			uint8_t tdigest[TEST_DIGEST_LEN];
+
+			if (i % 2)
+				Blake3_InitKeyed(&init, (const uint8_t *)salt);
+			else
+				Blake3_Init(&init);
+			memcpy(buffer, ref, len);
+			tree = Blake3_TreeCreate(&init, buffer, len);
+			if (!tree)
+				exit(111);
+
+			/* modify the first, some middle and the last bytes */
+			for (j = 0; j < 4 && len > 0; j++) {
+				size_t offset = (j < 3) ? j * len / 3 : len - 1;
+				size_t n = (len - offset < 5000) ?
+				    len - offset : 5000;
+
+				buffer[offset] ^= 0x55;
+				buffer[offset + n - 1] ^= 0xaa;
+				Blake3_TreeUpdateRange(tree, buffer, offset, n);
+
+				ctx = init;
+				Blake3_Update(&ctx, buffer, len);
+				Blake3_FinalSeek(&ctx, 0, digest,
+				    TEST_DIGEST_LEN);
+				Blake3_TreeFinalSeek(tree, 0, tdigest,
+				    TEST_DIGEST_LEN);
+				if (memcmp(digest, tdigest, TEST_DIGEST_LEN))
+					printf("%s: FAILED for %zu bytes at "
+					    "%zu+%zu\n", name, len, offset, n);
+			}
+			if (Blake3_TreeUpdateRange(tree, buffer, len, 1) !=
+			    -EINVAL)
+				printf("%s: FAILED beyond %zu bytes\n", name,
+				    len);
+			Blake3_TreeDestroy(tree);
+		}
+		printf("%s ", name);
+	}
+	printf("DONE!\n");
+
+	free(buffer);
+	free(ref);
+}
+
+/* hashing has to continue from a saved state */
+void test_blake3_state() {
+	static const size_t lens[] = {
+	    0, 1, 64, 1024, 1025, 4096, 100000, 1048576 + 7
+	};
+	size_t max = 1048576 + 7;
+	uint8_t *buffer = test_buffer(max);
+	uint8_t state[BLAKE3_STATE_MAX_LEN];
+	int id, i, size;
+
+	printf("Running saved state tests: ");
+	for (id = 0; id < blake3_get_impl_count(); id++) {
+		blake3_set_impl_id(id);
+		const char *name = blake3_get_impl_name();
+		for (i = 0; i < (int)ARRAY_SIZE(lens); i++) {
+			size_t len = lens[i], done, n;
+			BLAKE3_CTX ctx;
+			uint8_t digest[TEST_DIGEST_LEN];
+			uint8_t sdigest[TEST_DIGEST_LEN];
+
+			Blake3_InitKeyed(&ctx, (const uint8_t *)salt);
+			Blake3_Update(&ctx, buffer, max);
+			Blake3_FinalSeek(&ctx, 0, digest, TEST_DIGEST_LEN);
+
+			/* checkpoint after len bytes, then every 300001 */
+			Blake3_InitKeyed(&ctx, (const uint8_t *)salt);
+			for (done = 0, n = len; done < max; done += n,
+			    n = 300001) {
+				if (n > max - done)
+					n = max - done;
+				Blake3_Update(&ctx, buffer + done, n);
+				size = Blake3_SaveState(&ctx, state,
+				    sizeof (state));
+				/* nothing but the state is left */
+				memset(&ctx, 0xa5, sizeof (ctx));
+				Blake3_Init(&ctx);
+				if (size < 0 ||
+				    Blake3_LoadState(&ctx, state, size) != 0 ||
+				    Blake3_Count(&ctx) != done + n)
+					printf("%s: FAILED save at %zu\n",
+					    name, done + n);
+			}
+			Blake3_FinalSeek(&ctx, 0, sdigest, TEST_DIGEST_LEN);
+			if (memcmp(digest, sdigest, TEST_DIGEST_LEN) != 0)
+				printf("%s: FAILED for %zu bytes\n", name,
+				    len);
+		}
+		printf("%s ", name);
+	}
+	printf("DONE!\n");
+
+	/* the encoding is the same on all hosts */
+	{
+		static const uint8_t header[] = {
+		    'b', '3', 's', 1, 0, 1, 64, 1, 1, 0, 0, 0, 0, 0, 0, 0,
+		    0x67, 0xe6, 0x09, 0x6a
+		};
+		BLAKE3_CTX ctx;
+
+		Blake3_Init(&ctx);
+		Blake3_Update(&ctx, buffer, 1024 + 128);
+		size = Blake3_SaveState(&ctx, state, sizeof (state));
+		if (size != 80 + 64 + 32 ||
+		    memcmp(state, header, sizeof (header)) != 0)
+			printf("FAILED for the state encoding\n");
+		if (Blake3_SaveState(&ctx, state, size - 1) != -ENOSPC ||
+		    Blake3_LoadState(&ctx, state, size - 1) != -EINVAL)
+			printf("FAILED for a short state\n");
+		state[3] = 2;
+		if (Blake3_LoadState(&ctx, state, size) != -EINVAL)
+			printf("FAILED for the state version\n");
+		state[3] = 1;
+
+		/* corrupted states, which would break the next update */
+		state[8] = 3;
+		if (Blake3_LoadState(&ctx, state, size) != -EINVAL)
+			printf("FAILED for a stack of the wrong length\n");
+		state[8] = 0;
+		state[15] = 0x10;
+		if (Blake3_LoadState(&ctx, state, size) != -EINVAL)
+			printf("FAILED for a counter beyond the depth\n");
+		state[8] = 1;
+		state[15] = 0;
+		state[6] = 0;
+		memmove(&state[80], &state[80 + 64], 32);
+		if (Blake3_LoadState(&ctx, state, 80 + 32) != -EINVAL)
+			printf("FAILED for compressed blocks without a "
+			    "buffer\n");
+		state[5] = 0;
+		if (Blake3_LoadState(&ctx, state, 80 + 32) != 0)
+			printf("FAILED for an empty chunk\n");
+	}
+
+	free(buffer);
+}
+
+/* subtrees hashed apart have to combine to the hash of the input */
+void test_blake3_subtree() {
+	static const size_t lens[] = {
+	    0, 1, 1024, 1025, 3000, 4096, 65536 + 1, 1048576 + 7
+	};
+	static const size_t widths[] = { 1, 2, 4, 64, 256 };
+	size_t max = 1048576 + 7;
+	uint8_t *buffer = test_buffer(max);
+	blake3_subtree_t st[1100];
+	int id, i;
+
+	printf("Running subtree tests: ");
+	for (id = 0; id < blake3_get_impl_count(); id++) {
+		blake3_set_impl_id(id);
+		const char *name = blake3_get_impl_name();
+		/* every length in subtrees of every width */
+		for (i = 0; i < (int)(ARRAY_SIZE(lens) * ARRAY_SIZE(widths));
+		    i++) {
+			size_t len = lens[i / ARRAY_SIZE(widths)];
+			size_t width = widths[i % ARRAY_SIZE(widths)];
+			size_t sub = width * BLAKE3_CHUNK_LEN;
+			size_t n, done;
+			BLAKE3_CTX ctx;
+			uint8_t digest[TEST_DIGEST_LEN];
+			uint8_t sdigest[TEST_DIGEST_LEN];
+
+			if (i % 2)
+				Blake3_InitKeyed(&ctx, (const uint8_t *)salt);
+			else
+				Blake3_Init(&ctx);
+			for (n = 0, done = 0; n == 0 || done < len; n++) {
+				size_t part = (len - done < sub) ?
+				    len - done : sub;
+				uint64_t chunk = done / BLAKE3_CHUNK_LEN;
+				BLAKE3_CTX sctx;
+				size_t k;
+				int ret;
+
+				/* every other subtree in pieces of 1000 */
+				if (n % 2) {
+					Blake3_SubtreeInit(&sctx, &ctx, chunk);
+					for (k = 0; k < part; k += 1000)
+						Blake3_Update(&sctx,
+						    buffer + done + k,
+						    (part - k < 1000) ?
+						    part - k : 1000);
+					ret = Blake3_SubtreeFinal(&sctx,
+					    chunk, &st[n]);
+				} else {
+					ret = Blake3_HashSubtree(&ctx,
+					    buffer + done, part, chunk, NULL,
+					    &st[n]);
+				}
+				if (ret != 0)
+					printf("%s: FAILED subtree at %zu\n",
+					    name, done);
+				done += part;
+			}
+			if (Blake3_CombineSubtrees(&ctx, st, n, sdigest,
+			    TEST_DIGEST_LEN) != 0)
+				printf("%s: FAILED combine\n", name);
+
+			Blake3_Update(&ctx, buffer, len);
+			Blake3_FinalSeek(&ctx, 0, digest, TEST_DIGEST_LEN);
+			if (memcmp(digest, sdigest, TEST_DIGEST_LEN) != 0)
+				printf("%s: FAILED for %zu bytes in %zu "
+				    "chunks\n", name, len, width);
+
+			/* subtrees out of order */
+			if (n > 1 && Blake3_CombineSubtrees(&ctx, st + 1,
+			    n - 1, sdigest, BLAKE3_OUT_LEN) != -EINVAL)
+				printf("%s: FAILED for missing subtree\n",
+				    name);
+		}
+		printf("%s ", name);
+	}
+	printf("DONE!\n");
+
+	/* the start of a subtree is a multiple of its width */
+	{
+		BLAKE3_CTX ctx;
+
+		Blake3_Init(&ctx);
+		if (Blake3_HashSubtree(&ctx, buffer, 2048, 1, NULL, st) !=
+		    -EINVAL || Blake3_HashSubtree(&ctx, buffer, 3000, 2,
+		    NULL, st) != -EINVAL || Blake3_HashSubtree(&ctx, buffer,
+		    3000, 4, NULL, st) != 0)
+			printf("FAILED for the subtree alignment\n");
+	}
+
+	free(buffer);
+}
+
+/* parts of the positional tests, every thread takes every 4th part */
+typedef struct {
+	pthread_t thread;
+	blake3_pos_t *pos;
+	const uint8_t *buffer;
+	const size_t *order;
+	size_t num_parts;
+	size_t part_len;
+	size_t len;
+	int first;
+	int err;
+} test_pos_t;
+
+static void *test_pos_thread(void *arg)
+{
+	test_pos_t *t = arg;
+	size_t i;
+
+	for (i = t->first; i < t->num_parts; i += 4) {
+		size_t offset = t->order[i] * t->part_len;
+		size_t n = (t->len - offset < t->part_len) ?
+		    t->len - offset : t->part_len;
+
+		if (Blake3_UpdateAt(t->pos, offset, t->buffer + offset, n))
+			t->err = 1;
+	}
+
+	return (NULL);
+}
+
+/* parts in any order and from several threads give the same hash */
+void test_blake3_pos() {
+	static const size_t lens[] = {
+	    0, 1, 1024, 1025, 5000, 15360, 65536, 300001, 1048576 + 7
+	};
+	static const size_t part_lens[] = { 1024, 3072, 65536 };
+	size_t max = 1048576 + 7;
+	uint8_t *buffer = test_buffer(max);
+	size_t *order = malloc(max / 1024 * sizeof (size_t) + 8);
+	test_pos_t threads[4];
+	int id, i, t;
+
+	if (!order)
+		exit(111);
+
+	printf("Running positional tests: ");
+	for (id = 0; id < blake3_get_impl_count(); id++) {
+		blake3_set_impl_id(id);
+		const char *name = blake3_get_impl_name();
+		/* every length in parts of every size */
+		for (i = 0; i < (int)(ARRAY_SIZE(lens) *
+		    ARRAY_SIZE(part_lens)); i++) {
+			size_t len = lens[i / ARRAY_SIZE(part_lens)];
+			size_t part_len = part_lens[i % ARRAY_SIZE(part_lens)];
+			size_t num_parts = (len + part_len - 1) / part_len;
+			size_t j, k, tmp;
+			BLAKE3_CTX ctx;
+			blake3_pos_t *pos;
+			uint8_t digest[TEST_DIGEST_LEN];
+			uint8_t pdigest[TEST_DIGEST_LEN];
+
+			if (i % 2)
+				Blake3_InitKeyed(&ctx, (const uint8_t *)salt);
+			else
+				Blake3_Init(&ctx);
+			pos = Blake3_PosCreate(&ctx);
+			if (!pos)
+				exit(111);
+
+			/* a shuffled order of the parts */
+			for (j = 0; j < num_parts; j++)
+				order[j] = j;
+			for (j = num_parts; j > 1; j--) {
+				k = (size_t)rand() % j;
+				tmp = order[j - 1];
+				order[j - 1] = order[k];
+				order[k] = tmp;
+			}
+
+			for (t = 0; t < 4; t++) {
+				threads[t].pos = pos;
+				threads[t].buffer = buffer;
+				threads[t].order = order;
+				threads[t].num_parts = num_parts;
+				threads[t].part_len = part_len;
+				threads[t].len = len;
+				threads[t].first = t;
+				threads[t].err = 0;
+				pthread_create(&threads[t].thread, NULL,
+				    test_pos_thread, &threads[t]);
+			}
+			for (t = 0; t < 4; t++) {
+				pthread_join(threads[t].thread, NULL);
+				if (threads[t].err)
+					printf("%s: FAILED update\n", name);
+			}
+
+			/* a missing part, and a part already there */
+			if (len > part_len && Blake3_PosFinal(pos, len + 1,
+			    pdigest, TEST_DIGEST_LEN) != -EINVAL)
+				printf("%s: FAILED for a missing part\n",
+				    name);
+			if (len > 0 && Blake3_UpdateAt(pos, 0, buffer, 1) !=
+			    -EINVAL)
+				printf("%s: FAILED for an overlap\n", name);
+
+			if (Blake3_PosFinal(pos, len, pdigest,
+			    TEST_DIGEST_LEN) != 0)
+				printf("%s: FAILED final\n", name);
+			Blake3_Update(&ctx, buffer, len);
+			Blake3_FinalSeek(&ctx, 0, digest, TEST_DIGEST_LEN);
+			if (memcmp(digest, pdigest, TEST_DIGEST_LEN) != 0)
+				printf("%s: FAILED for %zu bytes in parts of "
+				    "%zu\n", name, len, part_len);
+			Blake3_PosDestroy(pos);
 		}
 		printf("%s ", name);
 	}
 	printf("DONE!\n");
+
+	/* nothing follows a partial chunk or Blake3_PosFinal() */
+	{
+		BLAKE3_CTX ctx;
+		blake3_pos_t *pos;
+		uint8_t digest[BLAKE3_OUT_LEN];
+		uint8_t pdigest[BLAKE3_OUT_LEN];
+
+		Blake3_Init(&ctx);
+		pos = Blake3_PosCreate(&ctx);
+		if (!pos)
+			exit(111);
+		if (Blake3_UpdateAt(pos, 2048, buffer + 2048, 1024) != 0 ||
+		    Blake3_UpdateAt(pos, 1024, buffer + 1024, 500) !=
+		    -EINVAL || Blake3_UpdateAt(pos, 1024, buffer + 1024,
+		    1024) != 0 || Blake3_UpdateAt(pos, 4096, buffer + 4096,
+		    1000) != 0 || Blake3_UpdateAt(pos, 5120, buffer + 5120,
+		    1024) != -EINVAL)
+			printf("FAILED for parts after a partial chunk\n");
+		if (Blake3_UpdateAt(pos, 0, buffer, 1024) != 0 ||
+		    Blake3_UpdateAt(pos, 3072, buffer + 3072, 1024) != 0 ||
+		    Blake3_PosFinal(pos, 5096, pdigest, BLAKE3_OUT_LEN) != 0)
+			printf("FAILED final after a partial chunk\n");
+		Blake3_Update(&ctx, buffer, 5096);
+		Blake3_Final(&ctx, digest);
+		if (memcmp(digest, pdigest, BLAKE3_OUT_LEN) != 0)
+			printf("FAILED hash after a partial chunk\n");
+		if (Blake3_UpdateAt(pos, 8192, buffer + 8192, 1024) != -EINVAL)
+			printf("FAILED for a part after the final\n");
+		Blake3_PosDestroy(pos);
+	}
+
+	free(order);
+	free(buffer);
+}
+
+/* compact contexts have to give the same hashes up to their limit */
+void test_blake3_compact() {
+	static const size_t lens[] = {
+	    0, 1, 1024, 1025, 2048, 4097, 65535, 65537, 1048576 - 1,
+	    1048576 + 7
+	};
+	static const size_t pieces[] = { 1024, 777, 65536, 1048576 + 7 };
+	size_t max = 1048576 + 7;
+	uint8_t *buffer = test_buffer(max);
+	int id, i;
+
+	if (Blake3_CtxSize(1048576) * 3 > sizeof (BLAKE3_CTX) ||
+	    Blake3_CtxSize(UINT64_MAX) < sizeof (BLAKE3_CTX) - 8)
+		printf("FAILED for the compact size\n");
+
+	/* three chunks leave two entries on the stack */
+	{
+		BLAKE3_CTX ctx;
+
+		Blake3_Init(&ctx);
+		Blake3_Update(&ctx, buffer, 3 * 1024 + 1);
+		if (Blake3_SetMaxLen(&ctx, 1024) != -EINVAL ||
+		    Blake3_SetMaxLen(&ctx, 4096) != 0)
+			printf("FAILED for a lower limit\n");
+	}
+
+	printf("Running compact context tests: ");
+	for (id = 0; id < blake3_get_impl_count(); id++) {
+		blake3_set_impl_id(id);
+		const char *name = blake3_get_impl_name();
+		/* every length in pieces of every size */
+		for (i = 0; i < (int)(ARRAY_SIZE(lens) * ARRAY_SIZE(pieces));
+		    i++) {
+			size_t len = lens[i / ARRAY_SIZE(pieces)];
+			size_t piece = pieces[i % ARRAY_SIZE(pieces)];
+			BLAKE3_CTX ctx, *compact;
+			uint8_t digest[BLAKE3_OUT_LEN];
+			uint8_t cdigest[BLAKE3_OUT_LEN];
+			size_t done, n;
+			int round;
+
+			/* exactly the size, so overflows show up in valgrind */
+			compact = malloc(Blake3_CtxSize(len));
+			if (!compact)
+				exit(111);
+			Blake3_Init(compact);
+			if (Blake3_SetMaxLen(compact, len) != 0)
+				printf("%s: FAILED limit\n", name);
+
+			/* then reused for a keyed hash */
+			for (round = 0; round < 2; round++) {
+				if (round)
+					Blake3_InitKeyed(&ctx,
+					    (const uint8_t *)salt);
+				else
+					Blake3_Init(&ctx);
+				if (round)
+					Blake3_InitCompact(compact, &ctx, len);
+				for (done = 0; done < len; done += n) {
+					n = (len - done < piece) ?
+					    len - done : piece;
+					if (Blake3_Update(compact,
+					    buffer + done, n) != 0)
+						printf("%s: FAILED update\n",
+						    name);
+				}
+				Blake3_Final(compact, cdigest);
+
+				Blake3_Update(&ctx, buffer, len);
+				Blake3_Final(&ctx, digest);
+				if (memcmp(digest, cdigest,
+				    BLAKE3_OUT_LEN) != 0)
+					printf("%s: FAILED for %zu bytes in "
+					    "pieces of %zu\n", name, len,
+					    piece);
+			}
+			free(compact);
+		}
+		printf("%s ", name);
+	}
+	printf("DONE!\n");
+
+	/* the limit holds for updates and states, also after a reuse */
+	{
+		BLAKE3_CTX ctx, tmpl, *compact = malloc(Blake3_CtxSize(4096));
+		BLAKE3_CTX *ctxs[2];
+		const uint8_t *inputs[2] = { buffer, buffer };
+		size_t lens2[2] = { 5000, 10 };
+		uint8_t state[BLAKE3_STATE_MAX_LEN];
+		uint8_t digest[BLAKE3_OUT_LEN];
+		uint8_t cdigest[BLAKE3_OUT_LEN];
+		int size;
+
+		if (!compact)
+			exit(111);
+		Blake3_InitKeyed(&tmpl, (const uint8_t *)salt);
+		Blake3_InitCompact(compact, &tmpl, 4096);
+		if (Blake3_Update(compact, buffer, 4096) != 0 ||
+		    Blake3_Update(compact, buffer, 1) != -EFBIG ||
+		    Blake3_Count(compact) != 4096)
+			printf("FAILED for the limit\n");
+		Blake3_InitCompact(compact, &tmpl, 4096);
+		if (Blake3_Update(compact, buffer, 4097) != -EFBIG ||
+		    Blake3_Count(compact) != 0)
+			printf("FAILED for the limit after a reuse\n");
+
+		Blake3_Init(&ctx);
+		ctxs[0] = compact;
+		ctxs[1] = &ctx;
+		if (Blake3_UpdateMany(ctxs, inputs, lens2, 2) != -EFBIG ||
+		    Blake3_Count(&ctx) != 0)
+			printf("FAILED for the limit of many\n");
+
+		/* 15 chunks leave four entries on the stack, three fit */
+		Blake3_InitKeyed(&ctx, (const uint8_t *)salt);
+		Blake3_Update(&ctx, buffer, 15 * 1024 + 1);
+		size = Blake3_SaveState(&ctx, state, sizeof (state));
+		if (Blake3_LoadState(compact, state, size) != -EINVAL ||
+		    Blake3_Count(compact) != 0)
+			printf("FAILED for a state beyond the limit\n");
+		Blake3_InitKeyed(&ctx, (const uint8_t *)salt);
+		Blake3_Update(&ctx, buffer, 3 * 1024 + 1);
+		size = Blake3_SaveState(&ctx, state, sizeof (state));
+		if (Blake3_LoadState(compact, state, size) != 0 ||
+		    Blake3_Update(compact, buffer + 3 * 1024 + 1, 1023) != 0 ||
+		    Blake3_Update(compact, buffer, 1) != -EFBIG)
+			printf("FAILED for a state within the limit\n");
+		Blake3_Update(&ctx, buffer + 3 * 1024 + 1, 1023);
+		Blake3_Final(&ctx, digest);
+		Blake3_Final(compact, cdigest);
+		if (memcmp(digest, cdigest, BLAKE3_OUT_LEN) != 0)
+			printf("FAILED hash of a loaded state\n");
+		free(compact);
+	}
+
+	free(buffer);
 }
 
 const char *progname = "blake3-test";
@@ -516,6 +2150,10 @@ int opt_benchmark = 0;
 int opt_functional = 0;
 int opt_verbose = 0;
 int opt_iterations = 1;
+int opt_threads = 0;
+
+/* thread pool for benchmarking, when -t is given */
+static blake3_pool_t *bench_pool = NULL;
 
 static void version(void)
 {
@@ -538,6 +2176,7 @@ static void usage(void)
 	       "\n"
 	       "\n Additional Options:"
 	       "\n  -i N  Set number of iterations for testing (default: 1)."
+	       "\n  -t N  Use N threads for benchmarking (default: 1)."
 	       "\n"
 	       "\n Report bugs to: https://github.com/mcmilk/BLAKE3-tests/issues"
 	       "\n", progname);
@@ -585,6 +2224,14 @@ typedef struct {
 	const blake3_impl_ops_t *impl;
 } chksum_stat_t;
 
+static void bench_update(BLAKE3_CTX *ctx, const void *buf, size_t size)
+{
+	if (bench_pool)
+		Blake3_UpdatePool(ctx, buf, size, bench_pool);
+	else
+		Blake3_Update(ctx, buf, size);
+}
+
 static void chksum_run(int round, uint64_t * result)
 {
 	uint64_t start;
@@ -636,7 +2283,7 @@ static void chksum_run(int round, uint64_t * result)
 	run_count = 0;
 	do {
 		for (l = 0; l < loops; l++, run_count++)
-			Blake3_Update(&ctx, buf, size);
+			bench_update(&ctx, buf, size);
 
 		run_time_ns = my_gethrtime() - start;
 	} while (run_time_ns < MSEC2NSEC(1));
@@ -648,7 +2295,7 @@ static void chksum_run(int round, uint64_t * result)
 	run_count = 0;
 	do {
 		for (l = 0; l < loops; l++, run_count++)
-			Blake3_Update(&ctx, buf, size);
+			bench_update(&ctx, buf, size);
 
 		run_time_ns = my_gethrtime() - start;
 	} while (run_time_ns < MSEC2NSEC(2));
@@ -686,7 +2333,7 @@ int main(int argc, char *argv[])
 	int i, opt;
 
 	/* same order as in help option -h */
-	while ((opt = getopt(argc, argv, "bfvVi:h?")) != -1) {
+	while ((opt = getopt(argc, argv, "bfvVi:t:h?")) != -1) {
 		switch (opt) {
 		case 'b':	/* benchmark */
 			opt_benchmark = 1;
@@ -708,6 +2355,10 @@ int main(int argc, char *argv[])
 			opt_iterations = atoi(optarg);
 			break;
 
+		case 't':	/* threads */
+			opt_threads = atoi(optarg);
+			break;
+
 		case 'h':
 		case '?':
 		default:
@@ -726,9 +2377,32 @@ int main(int argc, char *argv[])
 			blake3_set_impl_id(i);
 			test_blake3_ref();
 		}
+		test_blake3_pool();
+		test_blake3_batch();
+		test_blake3_many();
+		test_blake3_records();
+		test_blake3_xof();
+		test_blake3_large();
+		test_blake3_registry();
+		test_blake3_bench();
+		test_blake3_classes();
+		test_blake3_tune();
+		test_blake3_outboard();
+		test_blake3_range();
+		test_blake3_tree();
+		test_blake3_state();
+		test_blake3_subtree();
+		test_blake3_pos();
+		test_blake3_compact();
         }
 
 	if (opt_benchmark) {
+		if (opt_threads > 1) {
+			bench_pool = blake3_pool_create(opt_threads);
+			if (!bench_pool)
+				exit(111);
+		}
+
 		/* header */
 		printf("%-23s", "implementation");
 		printf("%8s", "1k");
@@ -745,6 +2419,8 @@ int main(int argc, char *argv[])
 			const char *name = blake3_get_impl_name();
 			chksum_benchit(&cs, name);
 		}
+
+		blake3_pool_destroy(bench_pool);
 	}
 
 	return 0;
@@ -16,6 +16,15 @@ kfpu_allowed(void) {
 	return (1);
 }
 
+/*
+ * The compress_xof_many() kernels of blake3_xof_many.h are C with vector
+ * extensions, they are built for userspace only. Kernel builds keep to the
+ * asm compress_xof and loop over the output blocks.
+ */
+#if defined(__x86_64) && !defined(_KERNEL)
+#define	BLAKE3_XOF_VEC
+#endif
+
 #if defined(__x86_64) || defined(__powerpc__) || defined(__aarch64__) || defined(__sparc__)
 
 extern void _blake3_compress_in_place_sse2(uint32_t cv[8],
@@ -47,6 +56,27 @@ static void blake3_compress_xof_sse2(const uint32_t cv[8],
 	kfpu_end();
 }
 
+#if defined(BLAKE3_XOF_VEC)
+#define	XOF_LANES	4
+#define	XOF_SUFFIX	sse2
+#define	XOF_TARGET	"sse2"
+#include "blake3_xof_many.h"
+#endif
+
+static void blake3_compress_xof_many_sse2(const uint32_t cv[8],
+    const uint8_t block[BLAKE3_BLOCK_LEN], uint8_t block_len,
+    uint64_t counter, uint8_t flags, uint8_t *out, size_t outblocks) {
+#if defined(BLAKE3_XOF_VEC)
+	kfpu_begin();
+	_blake3_compress_xof_many_sse2(cv, block, block_len, counter, flags,
+	    out, outblocks);
+	kfpu_end();
+#else
+	blake3_xof_many_loop(blake3_compress_xof_sse2, cv, block, block_len,
+	    counter, flags, out, outblocks);
+#endif
+}
+
 static void blake3_hash_many_sse2(const uint8_t * const *inputs,
     size_t num_inputs, size_t blocks, const uint32_t key[8],
     uint64_t counter, boolean_t increment_counter, uint8_t flags,
@@ -69,6 +99,7 @@ static boolean_t blake3_is_sse2_supported(void)
 const blake3_impl_ops_t blake3_sse2_impl = {
 	.compress_in_place = blake3_compress_in_place_sse2,
 	.compress_xof = blake3_compress_xof_sse2,
+	.compress_xof_many = blake3_compress_xof_many_sse2,
 	.hash_many = blake3_hash_many_sse2,
 	.is_supported = blake3_is_sse2_supported,
 	.degree = 4,
@@ -107,6 +138,27 @@ static void blake3_compress_xof_sse41(const uint32_t cv[8],
 	kfpu_end();
 }
 
+#if defined(BLAKE3_XOF_VEC)
+#define	XOF_LANES	4
+#define	XOF_SUFFIX	sse41
+#define	XOF_TARGET	"sse4.1"
+#include "blake3_xof_many.h"
+#endif
+
+static void blake3_compress_xof_many_sse41(const uint32_t cv[8],
+    const uint8_t block[BLAKE3_BLOCK_LEN], uint8_t block_len,
+    uint64_t counter, uint8_t flags, uint8_t *out, size_t outblocks) {
+#if defined(BLAKE3_XOF_VEC)
+	kfpu_begin();
+	_blake3_compress_xof_many_sse41(cv, block, block_len, counter, flags,
+	    out, outblocks);
+	kfpu_end();
+#else
+	blake3_xof_many_loop(blake3_compress_xof_sse41, cv, block, block_len,
+	    counter, flags, out, outblocks);
+#endif
+}
+
 static void blake3_hash_many_sse41(const uint8_t * const *inputs,
     size_t num_inputs, size_t blocks, const uint32_t key[8],
     uint64_t counter, boolean_t increment_counter, uint8_t flags,
@@ -129,6 +181,7 @@ static boolean_t blake3_is_sse41_supported(void)
 const blake3_impl_ops_t blake3_sse41_impl = {
 	.compress_in_place = blake3_compress_in_place_sse41,
 	.compress_xof = blake3_compress_xof_sse41,
+	.compress_xof_many = blake3_compress_xof_many_sse41,
 	.hash_many = blake3_hash_many_sse41,
 	.is_supported = blake3_is_sse41_supported,
 	.degree = 4,
@@ -137,11 +190,39 @@ const blake3_impl_ops_t blake3_sse41_impl = {
 #endif
 
 #if defined(__x86_64)
+extern void _blake3_compress_in_place_avx2(uint32_t cv[8],
+    const uint8_t block[BLAKE3_BLOCK_LEN], uint8_t block_len,
+    uint64_t counter, uint8_t flags);
+
+extern void _blake3_compress_xof_avx2(const uint32_t cv[8],
+    const uint8_t block[BLAKE3_BLOCK_LEN], uint8_t block_len,
+    uint64_t counter, uint8_t flags, uint8_t out[64]);
+
+extern void _blake3_compress_xof2_avx2(const uint32_t cv[8],
+    const uint8_t block[BLAKE3_BLOCK_LEN], uint8_t block_len,
+    uint64_t counter, uint8_t flags, uint8_t out[128]);
+
 extern void _blake3_hash_many_avx2(const uint8_t * const *inputs,
     size_t num_inputs, size_t blocks, const uint32_t key[8],
     uint64_t counter, boolean_t increment_counter, uint8_t flags,
     uint8_t flags_start, uint8_t flags_end, uint8_t *out);
 
+static void blake3_compress_in_place_avx2(uint32_t cv[8],
+    const uint8_t block[BLAKE3_BLOCK_LEN], uint8_t block_len,
+    uint64_t counter, uint8_t flags) {
+	kfpu_begin();
+	_blake3_compress_in_place_avx2(cv, block, block_len, counter, flags);
+	kfpu_end();
+}
+
+static void blake3_compress_xof_avx2(const uint32_t cv[8],
+    const uint8_t block[BLAKE3_BLOCK_LEN], uint8_t block_len,
+    uint64_t counter, uint8_t flags, uint8_t out[64]) {
+	kfpu_begin();
+	_blake3_compress_xof_avx2(cv, block, block_len, counter, flags, out);
+	kfpu_end();
+}
+
 static void blake3_hash_many_avx2(const uint8_t * const *inputs,
     size_t num_inputs, size_t blocks, const uint32_t key[8],
     uint64_t counter, boolean_t increment_counter, uint8_t flags,
@@ -152,6 +233,44 @@ static void blake3_hash_many_avx2(const uint8_t * const *inputs,
 	kfpu_end();
 }
 
+#if defined(BLAKE3_XOF_VEC)
+#define	XOF_LANES	8
+#define	XOF_SUFFIX	avx2
+#define	XOF_TARGET	"avx2"
+#include "blake3_xof_many.h"
+#endif
+
+/* groups of 8 blocks, then pairs in the ymm lanes, then a single block */
+static void blake3_compress_xof_many_avx2(const uint32_t cv[8],
+    const uint8_t block[BLAKE3_BLOCK_LEN], uint8_t block_len,
+    uint64_t counter, uint8_t flags, uint8_t *out, size_t outblocks) {
+#if defined(BLAKE3_XOF_VEC)
+	size_t n = outblocks & ~(size_t)7;
+#endif
+
+	kfpu_begin();
+#if defined(BLAKE3_XOF_VEC)
+	if (n > 0) {
+		_blake3_compress_xof_many_avx2(cv, block, block_len, counter,
+		    flags, out, n);
+		counter += n;
+		out += n * BLAKE3_BLOCK_LEN;
+		outblocks -= n;
+	}
+#endif
+	while (outblocks >= 2) {
+		_blake3_compress_xof2_avx2(cv, block, block_len, counter,
+		    flags, out);
+		counter += 2;
+		out += 2 * BLAKE3_BLOCK_LEN;
+		outblocks -= 2;
+	}
+	if (outblocks > 0)
+		_blake3_compress_xof_avx2(cv, block, block_len, counter,
+		    flags, out);
+	kfpu_end();
+}
+
 static boolean_t blake3_is_avx2_supported(void)
 {
 #if defined(__x86_64)
@@ -162,8 +281,9 @@ static boolean_t blake3_is_avx2_supported(void)
 }
 
 const blake3_impl_ops_t blake3_avx2_impl = {
-	.compress_in_place = blake3_compress_in_place_sse41,
-	.compress_xof = blake3_compress_xof_sse41,
+	.compress_in_place = blake3_compress_in_place_avx2,
+	.compress_xof = blake3_compress_xof_avx2,
+	.compress_xof_many = blake3_compress_xof_many_avx2,
 	.hash_many = blake3_hash_many_avx2,
 	.is_supported = blake3_is_avx2_supported,
 	.degree = 8,
@@ -211,6 +331,27 @@ static void blake3_hash_many_avx512(const uint8_t * const *inputs,
 	kfpu_end();
 }
 
+#if defined(BLAKE3_XOF_VEC)
+#define	XOF_LANES	16
+#define	XOF_SUFFIX	avx512
+#define	XOF_TARGET	"avx512f,avx512vl"
+#include "blake3_xof_many.h"
+#endif
+
+static void blake3_compress_xof_many_avx512(const uint32_t cv[8],
+    const uint8_t block[BLAKE3_BLOCK_LEN], uint8_t block_len,
+    uint64_t counter, uint8_t flags, uint8_t *out, size_t outblocks) {
+#if defined(BLAKE3_XOF_VEC)
+	kfpu_begin();
+	_blake3_compress_xof_many_avx512(cv, block, block_len, counter, flags,
+	    out, outblocks);
+	kfpu_end();
+#else
+	blake3_xof_many_loop(blake3_compress_xof_avx512, cv, block, block_len,
+	    counter, flags, out, outblocks);
+#endif
+}
+
 static boolean_t blake3_is_avx512_supported(void)
 {
 	return (kfpu_allowed() && zfs_avx512f_available() &&
@@ -220,9 +361,76 @@ static boolean_t blake3_is_avx512_supported(void)
 const blake3_impl_ops_t blake3_avx512_impl = {
 	.compress_in_place = blake3_compress_in_place_avx512,
 	.compress_xof = blake3_compress_xof_avx512,
+	.compress_xof_many = blake3_compress_xof_many_avx512,
 	.hash_many = blake3_hash_many_avx512,
 	.is_supported = blake3_is_avx512_supported,
 	.degree = 16,
 	.name = "avx512"
 };
 #endif
+
+#if defined(__x86_64)
+extern void _blake3_hash_many_avx512vl(const uint8_t * const *inputs,
+    size_t num_inputs, size_t blocks, const uint32_t key[8],
+    uint64_t counter, boolean_t increment_counter, uint8_t flags,
+    uint8_t flags_start, uint8_t flags_end, uint8_t *out);
+
+/*
+ * 8 lanes on ymm registers, which doesn't lower the core frequency. The asm
+ * hashes whole groups of 8 inputs, the rest goes to the sse41 kernel.
+ */
+static void blake3_hash_many_avx512vl(const uint8_t * const *inputs,
+    size_t num_inputs, size_t blocks, const uint32_t key[8],
+    uint64_t counter, boolean_t increment_counter, uint8_t flags,
+    uint8_t flags_start, uint8_t flags_end, uint8_t *out) {
+	size_t n = num_inputs & ~(size_t)7;
+
+	kfpu_begin();
+	_blake3_hash_many_avx512vl(inputs, n, blocks, key, counter,
+	    increment_counter, flags, flags_start, flags_end, out);
+	if (n < num_inputs)
+		_blake3_hash_many_sse41(inputs + n, num_inputs - n, blocks,
+		    key, increment_counter ? counter + n : counter,
+		    increment_counter, flags, flags_start, flags_end,
+		    out + n * BLAKE3_OUT_LEN);
+	kfpu_end();
+}
+
+#if defined(BLAKE3_XOF_VEC)
+#define	XOF_LANES	8
+#define	XOF_SUFFIX	avx512vl
+#define	XOF_TARGET	"avx512f,avx512vl"
+#include "blake3_xof_many.h"
+#endif
+
+static void blake3_compress_xof_many_avx512vl(const uint32_t cv[8],
+    const uint8_t block[BLAKE3_BLOCK_LEN], uint8_t block_len,
+    uint64_t counter, uint8_t flags, uint8_t *out, size_t outblocks) {
+#if defined(BLAKE3_XOF_VEC)
+	kfpu_begin();
+	_blake3_compress_xof_many_avx512vl(cv, block, block_len, counter,
+	    flags, out, outblocks);
+	kfpu_end();
+#else
+	blake3_xof_many_loop(blake3_compress_xof_avx512, cv, block, block_len,
+	    counter, flags, out, outblocks);
+#endif
+}
+
+/* EVEX on ymm and xmm registers, plus the sse41 kernel for the rest */
+static boolean_t blake3_is_avx512vl_supported(void)
+{
+	return (kfpu_allowed() && zfs_sse4_1_available() &&
+	    zfs_avx512f_available() && zfs_avx512vl_available());
+}
+
+const blake3_impl_ops_t blake3_avx512vl_impl = {
+	.compress_in_place = blake3_compress_in_place_avx512,
+	.compress_xof = blake3_compress_xof_avx512,
+	.compress_xof_many = blake3_compress_xof_many_avx512vl,
+	.hash_many = blake3_hash_many_avx512vl,
+	.is_supported = blake3_is_avx512vl_supported,
+	.degree = 8,
+	.name = "avx512vl"
+};
+#endif
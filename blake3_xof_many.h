@@ -0,0 +1,131 @@
+/**
+ * This work is released into the public domain with CC0 1.0.
+ *
+ * Copyright (c) 2021-2023 Tino Reichardt
+ *
+ * Latest version: https://github.com/mcmilk/BLAKE3-tests
+ */
+
+/*
+ * Template for the compress_xof_many() kernels, written with the vector
+ * extensions of gcc and clang. XOF_LANES consecutive output blocks are
+ * computed at once, one block per vector lane. Only the counter differs
+ * between the lanes, the chaining value and the message are broadcast.
+ *
+ * Needs XOF_LANES, XOF_SUFFIX and XOF_TARGET, and may be included several
+ * times for different instruction sets.
+ */
+
+#define	XOF_CAT2(a, b)	a##b
+#define	XOF_CAT(a, b)	XOF_CAT2(a, b)
+#define	XOF_VEC		XOF_CAT(xof_vec_, XOF_SUFFIX)
+#define	XOF_BLOCKS	XOF_CAT(xof_blocks_, XOF_SUFFIX)
+#define	XOF_MANY	XOF_CAT(_blake3_compress_xof_many_, XOF_SUFFIX)
+
+typedef uint32_t XOF_VEC __attribute__((vector_size(4 * XOF_LANES)));
+
+#define	XOF_ROTR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+#define	XOF_G(v, a, b, c, d, x, y) do {				\
+	v[a] = v[a] + v[b] + (x);					\
+	v[d] = XOF_ROTR(v[d] ^ v[a], 16);				\
+	v[c] = v[c] + v[d];						\
+	v[b] = XOF_ROTR(v[b] ^ v[c], 12);				\
+	v[a] = v[a] + v[b] + (y);					\
+	v[d] = XOF_ROTR(v[d] ^ v[a], 8);				\
+	v[c] = v[c] + v[d];						\
+	v[b] = XOF_ROTR(v[b] ^ v[c], 7);				\
+} while (0)
+
+#define	XOF_ROUND(v, m, r) do {						\
+	const uint8_t *s = MSG_SCHEDULE[r];				\
+	XOF_G(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);			\
+	XOF_G(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);			\
+	XOF_G(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);			\
+	XOF_G(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);			\
+	XOF_G(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);			\
+	XOF_G(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);			\
+	XOF_G(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);			\
+	XOF_G(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);			\
+} while (0)
+
+/* XOF_LANES output blocks, starting with counter */
+__attribute__((target(XOF_TARGET)))
+static void XOF_BLOCKS(const uint32_t cv[8],
+    const uint8_t block[BLAKE3_BLOCK_LEN], uint8_t block_len,
+    uint64_t counter, uint8_t flags, uint8_t *out)
+{
+	uint32_t words[16][XOF_LANES];
+	XOF_VEC v[16], m[16], t;
+	size_t i, lane;
+
+	for (i = 0; i < 16; i++)
+		m[i] = (XOF_VEC){0} + load32(block + 4 * i);
+
+	for (lane = 0; lane < XOF_LANES; lane++) {
+		words[0][lane] = counter_low(counter + lane);
+		words[1][lane] = counter_high(counter + lane);
+	}
+
+	for (i = 0; i < 8; i++)
+		v[i] = (XOF_VEC){0} + cv[i];
+	for (i = 0; i < 4; i++)
+		v[8 + i] = (XOF_VEC){0} + IV[i];
+	memcpy(&v[12], words[0], sizeof (XOF_VEC));
+	memcpy(&v[13], words[1], sizeof (XOF_VEC));
+	v[14] = (XOF_VEC){0} + (uint32_t)block_len;
+	v[15] = (XOF_VEC){0} + (uint32_t)flags;
+
+	XOF_ROUND(v, m, 0);
+	XOF_ROUND(v, m, 1);
+	XOF_ROUND(v, m, 2);
+	XOF_ROUND(v, m, 3);
+	XOF_ROUND(v, m, 4);
+	XOF_ROUND(v, m, 5);
+	XOF_ROUND(v, m, 6);
+
+	for (i = 0; i < 8; i++) {
+		t = v[i] ^ v[i + 8];
+		memcpy(words[i], &t, sizeof (XOF_VEC));
+		t = v[i + 8] ^ cv[i];
+		memcpy(words[i + 8], &t, sizeof (XOF_VEC));
+	}
+
+	/* transpose, every lane is one output block */
+	for (lane = 0; lane < XOF_LANES; lane++)
+		for (i = 0; i < 16; i++)
+			store32(out + lane * BLAKE3_BLOCK_LEN + 4 * i,
+			    words[i][lane]);
+}
+
+__attribute__((target(XOF_TARGET)))
+static void XOF_MANY(const uint32_t cv[8],
+    const uint8_t block[BLAKE3_BLOCK_LEN], uint8_t block_len,
+    uint64_t counter, uint8_t flags, uint8_t *out, size_t outblocks)
+{
+	uint8_t buf[XOF_LANES * BLAKE3_BLOCK_LEN];
+
+	while (outblocks >= XOF_LANES) {
+		XOF_BLOCKS(cv, block, block_len, counter, flags, out);
+		counter += XOF_LANES;
+		out += XOF_LANES * BLAKE3_BLOCK_LEN;
+		outblocks -= XOF_LANES;
+	}
+
+	if (outblocks > 0) {
+		XOF_BLOCKS(cv, block, block_len, counter, flags, buf);
+		memcpy(out, buf, outblocks * BLAKE3_BLOCK_LEN);
+	}
+}
+
+#undef	XOF_CAT2
+#undef	XOF_CAT
+#undef	XOF_VEC
+#undef	XOF_BLOCKS
+#undef	XOF_MANY
+#undef	XOF_ROTR
+#undef	XOF_G
+#undef	XOF_ROUND
+#undef	XOF_LANES
+#undef	XOF_SUFFIX
+#undef	XOF_TARGET
@@ -0,0 +1,268 @@
+/**
+ * This work is released into the public domain with CC0 1.0.
+ *
+ * Copyright (c) 2021-2023 Tino Reichardt
+ *
+ * Latest version: https://github.com/mcmilk/BLAKE3-tests
+ */
+
+/*
+ * Single-block compression for AVX2 hosts. The row layout is the one of
+ * blake3_sse41.c, but VEX encoded, so the avx2 implementation doesn't switch
+ * between legacy SSE and AVX code. The 2-block variant keeps one block per
+ * 128-bit lane of the ymm registers, every shuffle stays within its lane.
+ *
+ * asm/blake3_avx2_compress.S is generated with:
+ * gcc -O3 -mavx2 -fno-tree-reassoc -masm=intel \
+ *   -fno-asynchronous-unwind-tables -fno-verbose-asm \
+ *   -S blake3_avx2_compress.c
+ * and then laid out like asm/blake3_avx2.S: the license header and the
+ * __x86_64 guard, _CET_ENDBR at the global entry points, no .ident, and the
+ * GNU-stack note under __ELF__.
+ *
+ * -fno-tree-reassoc keeps the row0 + m + row1 order of the rounds, so only
+ * one add per half round waits for row1.
+ */
+
+#include <immintrin.h>
+
+#include "blake3_impl.h"
+
+#define _mm_shuffle_ps2(a, b, c)                                               \
+  (_mm_castps_si128(                                                           \
+      _mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b), (c))))
+
+#define _mm256_shuffle_ps2(a, b, c)                                            \
+  (_mm256_castps_si256(                                                        \
+      _mm256_shuffle_ps(_mm256_castsi256_ps(a), _mm256_castsi256_ps(b), (c))))
+
+INLINE __m128i loadu(const uint8_t src[16]) {
+  return _mm_loadu_si128((const __m128i *)src);
+}
+
+INLINE void storeu(__m128i src, uint8_t dest[16]) {
+  _mm_storeu_si128((__m128i *)dest, src);
+}
+
+INLINE void storeu2(__m256i src, uint8_t dest[32]) {
+  _mm256_storeu_si256((__m256i *)dest, src);
+}
+
+INLINE __m256i loadu2(const uint8_t src[16]) {
+  return _mm256_broadcastsi128_si256(loadu(src));
+}
+
+INLINE __m128i set4(uint32_t a, uint32_t b, uint32_t c, uint32_t d) {
+  return _mm_setr_epi32((int32_t)a, (int32_t)b, (int32_t)c, (int32_t)d);
+}
+
+INLINE __m128i rot16(__m128i x) {
+  return _mm_shuffle_epi8(
+      x, _mm_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2));
+}
+
+INLINE __m128i rot12(__m128i x) {
+  return _mm_xor_si128(_mm_srli_epi32(x, 12), _mm_slli_epi32(x, 32 - 12));
+}
+
+INLINE __m128i rot8(__m128i x) {
+  return _mm_shuffle_epi8(
+      x, _mm_set_epi8(12, 15, 14, 13, 8, 11, 10, 9, 4, 7, 6, 5, 0, 3, 2, 1));
+}
+
+INLINE __m128i rot7(__m128i x) {
+  return _mm_xor_si128(_mm_srli_epi32(x, 7), _mm_slli_epi32(x, 32 - 7));
+}
+
+INLINE __m256i rot16_2(__m256i x) {
+  return _mm256_shuffle_epi8(
+      x, _mm256_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+                         13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2));
+}
+
+INLINE __m256i rot12_2(__m256i x) {
+  return _mm256_xor_si256(_mm256_srli_epi32(x, 12),
+                          _mm256_slli_epi32(x, 32 - 12));
+}
+
+INLINE __m256i rot8_2(__m256i x) {
+  return _mm256_shuffle_epi8(
+      x, _mm256_set_epi8(12, 15, 14, 13, 8, 11, 10, 9, 4, 7, 6, 5, 0, 3, 2, 1,
+                         12, 15, 14, 13, 8, 11, 10, 9, 4, 7, 6, 5, 0, 3, 2, 1));
+}
+
+INLINE __m256i rot7_2(__m256i x) {
+  return _mm256_xor_si256(_mm256_srli_epi32(x, 7),
+                          _mm256_slli_epi32(x, 32 - 7));
+}
+
+/*
+ * One round on the rows. Row1 stays unrotated, the message loads are
+ * adjusted for it, see blake3_sse41.c.
+ */
+#define ROUND(add, xor, shuf, r16, r12, r8, r7, row, t0, t1, t2, t3)           \
+  do {                                                                         \
+    row[0] = add(add(row[0], t0), row[1]);                                     \
+    row[3] = r16(xor(row[3], row[0]));                                         \
+    row[2] = add(row[2], row[3]);                                              \
+    row[1] = r12(xor(row[1], row[2]));                                         \
+    row[0] = add(add(row[0], t1), row[1]);                                     \
+    row[3] = r8(xor(row[3], row[0]));                                          \
+    row[2] = add(row[2], row[3]);                                              \
+    row[1] = r7(xor(row[1], row[2]));                                          \
+    row[0] = shuf(row[0], _MM_SHUFFLE(2, 1, 0, 3));                            \
+    row[3] = shuf(row[3], _MM_SHUFFLE(1, 0, 3, 2));                            \
+    row[2] = shuf(row[2], _MM_SHUFFLE(0, 3, 2, 1));                            \
+    row[0] = add(add(row[0], t2), row[1]);                                     \
+    row[3] = r16(xor(row[3], row[0]));                                         \
+    row[2] = add(row[2], row[3]);                                              \
+    row[1] = r12(xor(row[1], row[2]));                                         \
+    row[0] = add(add(row[0], t3), row[1]);                                     \
+    row[3] = r8(xor(row[3], row[0]));                                          \
+    row[2] = add(row[2], row[3]);                                              \
+    row[1] = r7(xor(row[1], row[2]));                                          \
+    row[0] = shuf(row[0], _MM_SHUFFLE(0, 3, 2, 1));                            \
+    row[3] = shuf(row[3], _MM_SHUFFLE(1, 0, 3, 2));                            \
+    row[2] = shuf(row[2], _MM_SHUFFLE(2, 1, 0, 3));                            \
+  } while (0)
+
+#define ROUND1(row, t0, t1, t2, t3)                                            \
+  ROUND(_mm_add_epi32, _mm_xor_si128, _mm_shuffle_epi32, rot16, rot12, rot8,   \
+        rot7, row, t0, t1, t2, t3)
+
+#define ROUND2(row, t0, t1, t2, t3)                                            \
+  ROUND(_mm256_add_epi32, _mm256_xor_si256, _mm256_shuffle_epi32, rot16_2,     \
+        rot12_2, rot8_2, rot7_2, row, t0, t1, t2, t3)
+
+INLINE void compress_pre(__m128i rows[4], const uint32_t cv[8],
+                         const uint8_t block[BLAKE3_BLOCK_LEN],
+                         uint8_t block_len, uint64_t counter, uint8_t flags) {
+  __m128i m0, m1, m2, m3, t0, t1, t2, t3, tt;
+
+  rows[0] = loadu((const uint8_t *)&cv[0]);
+  rows[1] = loadu((const uint8_t *)&cv[4]);
+  rows[2] = set4(IV[0], IV[1], IV[2], IV[3]);
+  rows[3] = set4(counter_low(counter), counter_high(counter),
+                 (uint32_t)block_len, (uint32_t)flags);
+
+  m0 = loadu(&block[sizeof(__m128i) * 0]);
+  m1 = loadu(&block[sizeof(__m128i) * 1]);
+  m2 = loadu(&block[sizeof(__m128i) * 2]);
+  m3 = loadu(&block[sizeof(__m128i) * 3]);
+
+  // Round 1 permutes the message words from the input order.
+  t0 = _mm_shuffle_ps2(m0, m1, _MM_SHUFFLE(2, 0, 2, 0));
+  t1 = _mm_shuffle_ps2(m0, m1, _MM_SHUFFLE(3, 1, 3, 1));
+  t2 = _mm_shuffle_ps2(m2, m3, _MM_SHUFFLE(2, 0, 2, 0));
+  t2 = _mm_shuffle_epi32(t2, _MM_SHUFFLE(2, 1, 0, 3));
+  t3 = _mm_shuffle_ps2(m2, m3, _MM_SHUFFLE(3, 1, 3, 1));
+  t3 = _mm_shuffle_epi32(t3, _MM_SHUFFLE(2, 1, 0, 3));
+  ROUND1(rows, t0, t1, t2, t3);
+
+  // Rounds 2 to 7 apply a fixed permutation to the words of the round before.
+  for (int r = 1; r < 7; r++) {
+    m0 = t0;
+    m1 = t1;
+    m2 = t2;
+    m3 = t3;
+    t0 = _mm_shuffle_ps2(m0, m1, _MM_SHUFFLE(3, 1, 1, 2));
+    t0 = _mm_shuffle_epi32(t0, _MM_SHUFFLE(0, 3, 2, 1));
+    t1 = _mm_shuffle_ps2(m2, m3, _MM_SHUFFLE(3, 3, 2, 2));
+    tt = _mm_shuffle_epi32(m0, _MM_SHUFFLE(0, 0, 3, 3));
+    t1 = _mm_blend_epi16(tt, t1, 0xCC);
+    t2 = _mm_unpacklo_epi64(m3, m1);
+    tt = _mm_blend_epi16(t2, m2, 0xC0);
+    t2 = _mm_shuffle_epi32(tt, _MM_SHUFFLE(1, 3, 2, 0));
+    t3 = _mm_unpackhi_epi32(m1, m3);
+    tt = _mm_unpacklo_epi32(m2, t3);
+    t3 = _mm_shuffle_epi32(tt, _MM_SHUFFLE(0, 1, 3, 2));
+    ROUND1(rows, t0, t1, t2, t3);
+  }
+}
+
+/* the same for two blocks, which differ only in the counter */
+INLINE void compress2_pre(__m256i rows[4], const uint32_t cv[8],
+                          const uint8_t block[BLAKE3_BLOCK_LEN],
+                          uint8_t block_len, uint64_t counter,
+                          uint8_t flags) {
+  __m256i m0, m1, m2, m3, t0, t1, t2, t3, tt;
+
+  rows[0] = loadu2((const uint8_t *)&cv[0]);
+  rows[1] = loadu2((const uint8_t *)&cv[4]);
+  rows[2] = _mm256_broadcastsi128_si256(set4(IV[0], IV[1], IV[2], IV[3]));
+  rows[3] = _mm256_setr_epi32(
+      (int32_t)counter_low(counter), (int32_t)counter_high(counter),
+      (int32_t)block_len, (int32_t)flags, (int32_t)counter_low(counter + 1),
+      (int32_t)counter_high(counter + 1), (int32_t)block_len, (int32_t)flags);
+
+  m0 = loadu2(&block[sizeof(__m128i) * 0]);
+  m1 = loadu2(&block[sizeof(__m128i) * 1]);
+  m2 = loadu2(&block[sizeof(__m128i) * 2]);
+  m3 = loadu2(&block[sizeof(__m128i) * 3]);
+
+  t0 = _mm256_shuffle_ps2(m0, m1, _MM_SHUFFLE(2, 0, 2, 0));
+  t1 = _mm256_shuffle_ps2(m0, m1, _MM_SHUFFLE(3, 1, 3, 1));
+  t2 = _mm256_shuffle_ps2(m2, m3, _MM_SHUFFLE(2, 0, 2, 0));
+  t2 = _mm256_shuffle_epi32(t2, _MM_SHUFFLE(2, 1, 0, 3));
+  t3 = _mm256_shuffle_ps2(m2, m3, _MM_SHUFFLE(3, 1, 3, 1));
+  t3 = _mm256_shuffle_epi32(t3, _MM_SHUFFLE(2, 1, 0, 3));
+  ROUND2(rows, t0, t1, t2, t3);
+
+  for (int r = 1; r < 7; r++) {
+    m0 = t0;
+    m1 = t1;
+    m2 = t2;
+    m3 = t3;
+    t0 = _mm256_shuffle_ps2(m0, m1, _MM_SHUFFLE(3, 1, 1, 2));
+    t0 = _mm256_shuffle_epi32(t0, _MM_SHUFFLE(0, 3, 2, 1));
+    t1 = _mm256_shuffle_ps2(m2, m3, _MM_SHUFFLE(3, 3, 2, 2));
+    tt = _mm256_shuffle_epi32(m0, _MM_SHUFFLE(0, 0, 3, 3));
+    t1 = _mm256_blend_epi16(tt, t1, 0xCC);
+    t2 = _mm256_unpacklo_epi64(m3, m1);
+    tt = _mm256_blend_epi16(t2, m2, 0xC0);
+    t2 = _mm256_shuffle_epi32(tt, _MM_SHUFFLE(1, 3, 2, 0));
+    t3 = _mm256_unpackhi_epi32(m1, m3);
+    tt = _mm256_unpacklo_epi32(m2, t3);
+    t3 = _mm256_shuffle_epi32(tt, _MM_SHUFFLE(0, 1, 3, 2));
+    ROUND2(rows, t0, t1, t2, t3);
+  }
+}
+
+void _blake3_compress_in_place_avx2(uint32_t cv[8],
+                                    const uint8_t block[BLAKE3_BLOCK_LEN],
+                                    uint8_t block_len, uint64_t counter,
+                                    uint8_t flags) {
+  __m128i rows[4];
+  compress_pre(rows, cv, block, block_len, counter, flags);
+  storeu(_mm_xor_si128(rows[0], rows[2]), (uint8_t *)&cv[0]);
+  storeu(_mm_xor_si128(rows[1], rows[3]), (uint8_t *)&cv[4]);
+}
+
+void _blake3_compress_xof_avx2(const uint32_t cv[8],
+                               const uint8_t block[BLAKE3_BLOCK_LEN],
+                               uint8_t block_len, uint64_t counter,
+                               uint8_t flags, uint8_t out[64]) {
+  __m128i rows[4];
+  compress_pre(rows, cv, block, block_len, counter, flags);
+  storeu(_mm_xor_si128(rows[0], rows[2]), &out[0]);
+  storeu(_mm_xor_si128(rows[1], rows[3]), &out[16]);
+  storeu(_mm_xor_si128(rows[2], loadu((const uint8_t *)&cv[0])), &out[32]);
+  storeu(_mm_xor_si128(rows[3], loadu((const uint8_t *)&cv[4])), &out[48]);
+}
+
+/* output blocks counter and counter + 1 */
+void _blake3_compress_xof2_avx2(const uint32_t cv[8],
+                                const uint8_t block[BLAKE3_BLOCK_LEN],
+                                uint8_t block_len, uint64_t counter,
+                                uint8_t flags, uint8_t out[128]) {
+  __m256i rows[4], o0, o1, o2, o3;
+  compress2_pre(rows, cv, block, block_len, counter, flags);
+  o0 = _mm256_xor_si256(rows[0], rows[2]);
+  o1 = _mm256_xor_si256(rows[1], rows[3]);
+  o2 = _mm256_xor_si256(rows[2], loadu2((const uint8_t *)&cv[0]));
+  o3 = _mm256_xor_si256(rows[3], loadu2((const uint8_t *)&cv[4]));
+  storeu2(_mm256_permute2x128_si256(o0, o1, 0x20), &out[0]);
+  storeu2(_mm256_permute2x128_si256(o2, o3, 0x20), &out[32]);
+  storeu2(_mm256_permute2x128_si256(o0, o1, 0x31), &out[64]);
+  storeu2(_mm256_permute2x128_si256(o2, o3, 0x31), &out[96]);
+}
@@ -6,12 +6,19 @@
  * Latest version: https://github.com/mcmilk/BLAKE3-tests
  */
 
+#define _POSIX_C_SOURCE 200809L
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
 #include <assert.h>
 #include <errno.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #ifdef __linux__
 #include <alloca.h>
@@ -62,16 +69,300 @@ static int parse_key(char *hex_key, uint8_t out[BLAKE3_KEY_LEN]) {
   return 0;
 }
 
+/*
+ * Tuning cache of the startup benchmark, so each run doesn't measure again.
+ * BLAKE3_TUNE_CACHE sets the file, an empty value disables it.
+ */
+static const char *tune_path(char *buf, size_t len) {
+  const char *path = getenv("BLAKE3_TUNE_CACHE");
+  const char *dir;
+
+  if (path != NULL) {
+    return path[0] != '\0' ? path : NULL;
+  }
+  dir = getenv("XDG_CACHE_HOME");
+  if (dir != NULL && dir[0] != '\0') {
+    return snprintf(buf, len, "%s/blake3.tune", dir) < (int)len ? buf : NULL;
+  }
+  dir = getenv("HOME");
+  if (dir == NULL || dir[0] == '\0') {
+    return NULL;
+  }
+  return snprintf(buf, len, "%s/.cache/blake3.tune", dir) < (int)len ? buf
+                                                                      : NULL;
+}
+
+// Save the tuning cache, its directory is created when it is missing.
+static void tune_save(const char *path) {
+  char dir[4096];
+  const char *slash = strrchr(path, '/');
+  int err;
+
+  if (slash != NULL && slash != path &&
+      (size_t)(slash - path) < sizeof(dir)) {
+    memcpy(dir, path, slash - path);
+    dir[slash - path] = '\0';
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+      fprintf(stderr, "Cannot create %s: %s\n", dir, strerror(errno));
+      return;
+    }
+  }
+  err = blake3_tune_save(path);
+  if (err != 0) {
+    fprintf(stderr, "Cannot write tuning cache %s: %s\n", path,
+            strerror(-err));
+  }
+}
+
+// Outboard file, the nodes are written at their pre-order offsets as they
+// are produced, so memory use doesn't grow with the input.
+typedef struct {
+  int fd;
+  int failed;
+} outboard_file_t;
+
+static void outboard_write(void *priv, uint64_t offset, const void *buf,
+                           size_t len) {
+  outboard_file_t *of = priv;
+  while (len > 0 && !of->failed) {
+    ssize_t n = pwrite(of->fd, buf, len, (off_t)offset);
+    if (n <= 0) {
+      of->failed = 1;
+      break;
+    }
+    buf = (const uint8_t *)buf + n;
+    offset += (uint64_t)n;
+    len -= (size_t)n;
+  }
+}
+
+/* reads the input from stdin and the outboard from a file */
+static int read_fd(int fd, uint64_t offset, void *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = pread(fd, buf, len, (off_t)offset);
+    if (n <= 0) {
+      return -1;
+    }
+    buf = (uint8_t *)buf + n;
+    offset += (uint64_t)n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+static int range_read_input(void *priv, uint64_t offset, void *buf,
+                            size_t len) {
+  (void)priv;
+  return read_fd(fileno(stdin), offset, buf, len);
+}
+
+static int range_read_outboard(void *priv, uint64_t offset, void *buf,
+                               size_t len) {
+  return read_fd(fileno((FILE *)priv), offset, buf, len);
+}
+
+// Writes the verified bytes [offset, offset + len) of stdin to stdout.
+static int verify_range(const BLAKE3_CTX *hasher, const char *outboard_path,
+                        const uint8_t hash[BLAKE3_OUT_LEN], uint64_t offset,
+                        size_t len) {
+  FILE *f = fopen(outboard_path, "rb");
+  uint8_t *out = malloc(len ? len : 1);
+  int ret = 1;
+
+  if (f == NULL || out == NULL) {
+    fprintf(stderr, "Reading the outboard failed.\n");
+  } else {
+    blake3_range_reader_t rd = {
+        .read_input = range_read_input,
+        .read_outboard = range_read_outboard,
+        .priv = f,
+    };
+    int err = Blake3_VerifyRange(hasher, hash, &rd, offset, len, out);
+    if (err != 0) {
+      fprintf(stderr, "Verifying the range failed: %s\n", strerror(-err));
+    } else if (fwrite(out, 1, len, stdout) != len) {
+      fprintf(stderr, "Writing the range failed.\n");
+    } else {
+      ret = 0;
+    }
+  }
+  if (f != NULL) {
+    fclose(f);
+  }
+  free(out);
+  return ret;
+}
+
+// Subtree on the pipe: len as LE64, input_cv, block, block_len and flags.
+// The coordinator knows the first chunk.
+#define SUBTREE_WIRE_LEN (8 + BLAKE3_OUT_LEN + BLAKE3_BLOCK_LEN + 2)
+
+static void subtree_encode(const blake3_subtree_t *st,
+                           uint8_t buf[SUBTREE_WIRE_LEN]) {
+  for (int i = 0; i < 8; i++) {
+    buf[i] = (uint8_t)(st->len >> (8 * i));
+  }
+  memcpy(&buf[8], st->input_cv, BLAKE3_OUT_LEN);
+  memcpy(&buf[8 + BLAKE3_OUT_LEN], st->block, BLAKE3_BLOCK_LEN);
+  buf[SUBTREE_WIRE_LEN - 2] = st->block_len;
+  buf[SUBTREE_WIRE_LEN - 1] = st->flags;
+}
+
+static void subtree_decode(const uint8_t buf[SUBTREE_WIRE_LEN], uint64_t chunk,
+                           blake3_subtree_t *st) {
+  st->chunk = chunk;
+  st->len = 0;
+  for (int i = 0; i < 8; i++) {
+    st->len |= (uint64_t)buf[i] << (8 * i);
+  }
+  memcpy(st->input_cv, &buf[8], BLAKE3_OUT_LEN);
+  memcpy(st->block, &buf[8 + BLAKE3_OUT_LEN], BLAKE3_BLOCK_LEN);
+  st->block_len = buf[SUBTREE_WIRE_LEN - 2];
+  st->flags = buf[SUBTREE_WIRE_LEN - 1];
+}
+
+// Worker process: hashes its subtree of stdin in pieces of BUFSIZE and sends
+// it to the pipe.
+static int hash_worker(const BLAKE3_CTX *hasher, uint64_t offset, uint64_t len,
+                       int fd) {
+  uint64_t chunk = offset / BLAKE3_CHUNK_LEN;
+  uint8_t buf[BUFSIZE], wire[SUBTREE_WIRE_LEN];
+  blake3_subtree_t st;
+  BLAKE3_CTX sub;
+
+  Blake3_SubtreeInit(&sub, hasher, chunk);
+  while (len > 0) {
+    size_t n = len < BUFSIZE ? (size_t)len : BUFSIZE;
+    if (read_fd(fileno(stdin), offset, buf, n) != 0) {
+      return 1;
+    }
+    Blake3_Update(&sub, buf, n);
+    offset += n;
+    len -= n;
+  }
+  if (Blake3_SubtreeFinal(&sub, chunk, &st) != 0) {
+    return 1;
+  }
+  subtree_encode(&st, wire);
+  return write(fd, wire, sizeof(wire)) == (ssize_t)sizeof(wire) ? 0 : 1;
+}
+
+// Splits stdin into power of 2 subtrees, one per worker process, and
+// combines their results.
+static int hash_workers(const BLAKE3_CTX *hasher, unsigned long workers,
+                        uint8_t *out, size_t out_len) {
+  uint64_t input_len, chunks, width = 1, n, started, i;
+  blake3_subtree_t *st;
+  pid_t *pids;
+  int *fds;
+  struct stat sb;
+  int ret = 0;
+
+  if (fstat(fileno(stdin), &sb) != 0 || !S_ISREG(sb.st_mode)) {
+    fprintf(stderr, "--workers needs a regular file as input.\n");
+    return 1;
+  }
+  input_len = (uint64_t)sb.st_size;
+  chunks = input_len ? (input_len + BLAKE3_CHUNK_LEN - 1) / BLAKE3_CHUNK_LEN
+                     : 1;
+  while (width * workers < chunks) {
+    width *= 2;
+  }
+  n = (chunks + width - 1) / width;
+
+  st = calloc(n, sizeof(blake3_subtree_t));
+  pids = calloc(n, sizeof(pid_t));
+  fds = calloc(n, sizeof(int));
+  if (st == NULL || pids == NULL || fds == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    free(fds);
+    free(pids);
+    free(st);
+    return 1;
+  }
+
+  // The results fit into the pipe buffers, so all workers run at once.
+  for (started = 0; started < n; started++) {
+    uint64_t offset = started * width * BLAKE3_CHUNK_LEN;
+    uint64_t len = width * BLAKE3_CHUNK_LEN;
+    int pipefd[2];
+
+    if (len > input_len - offset) {
+      len = input_len - offset;
+    }
+    if (pipe(pipefd) != 0) {
+      ret = 1;
+      break;
+    }
+    pids[started] = fork();
+    if (pids[started] < 0) {
+      close(pipefd[0]);
+      close(pipefd[1]);
+      ret = 1;
+      break;
+    }
+    if (pids[started] == 0) {
+      close(pipefd[0]);
+      _exit(hash_worker(hasher, offset, len, pipefd[1]));
+    }
+    close(pipefd[1]);
+    fds[started] = pipefd[0];
+  }
+
+  // Every started worker is read from and reaped, also after an error.
+  for (i = 0; i < started; i++) {
+    uint8_t wire[SUBTREE_WIRE_LEN];
+    int status;
+    if (read(fds[i], wire, sizeof(wire)) != (ssize_t)sizeof(wire)) {
+      ret = 1;
+    } else {
+      subtree_decode(wire, i * width, &st[i]);
+    }
+    close(fds[i]);
+    if (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+      ret = 1;
+    }
+  }
+
+  if (ret == 0 && Blake3_CombineSubtrees(hasher, st, n, out, out_len) != 0) {
+    ret = 1;
+  }
+  if (ret != 0) {
+    fprintf(stderr, "Hashing with workers failed.\n");
+  }
+  free(fds);
+  free(pids);
+  free(st);
+  return ret;
+}
+
 int main(int argc, char **argv) {
   size_t out_len = BLAKE3_OUT_LEN;
   uint8_t *key = alloca(BLAKE3_KEY_LEN);
   uint8_t mode = HASH_MODE;
+  const char *context = NULL;
+  const char *outboard_path = NULL;
+  outboard_file_t of = {.fd = -1, .failed = 0};
+  blake3_outboard_t ob;
+  const char *verify_path = NULL;
+  uint8_t *hash = alloca(BLAKE3_OUT_LEN);
+  bool have_hash = false;
+  unsigned long long range_offset = 0, range_len = 0;
+  unsigned long workers = 0;
   uint8_t *buf, *B = alloca(BUFSIZE);
+  char tune_buf[4096];
+  const char *tune = tune_path(tune_buf, sizeof(tune_buf));
 
   //blake3_set_impl_name("generic");
-  blake3_set_impl_name("sse2");
+  //blake3_set_impl_name("sse2");
   //blake3_set_impl_name("sse41");
-  printf("GET current: %s\n", blake3_get_impl_name());
+  /* the cache is only a hint, a stale or missing one is measured again */
+  bool tuned = tune != NULL && blake3_tune_load(tune) == 0;
+  blake3_setup_impl();
+  if (tune != NULL && !tuned) {
+    tune_save(tune);
+  }
 
   while (argc > 1) {
     if (argc <= 2) {
@@ -94,6 +385,45 @@ int main(int argc, char **argv) {
       if (ret != 0) {
         return ret;
       }
+    } else if (strcmp("--derive-key", argv[1]) == 0) {
+      mode = DERIVE_KEY_MODE;
+      context = argv[2];
+    } else if (strcmp("--outboard", argv[1]) == 0) {
+      outboard_path = argv[2];
+    } else if (strcmp("--workers", argv[1]) == 0) {
+      char *endptr = NULL;
+      errno = 0;
+      workers = strtoul(argv[2], &endptr, 10);
+      if (errno != 0 || endptr == argv[2] || *endptr != 0 || workers == 0 ||
+          workers > 1024) {
+        fprintf(stderr, "Bad number of workers.\n");
+        return 1;
+      }
+    } else if (strcmp("--verify", argv[1]) == 0) {
+      verify_path = argv[2];
+    } else if (strcmp("--hash", argv[1]) == 0) {
+      int ret = parse_key(argv[2], hash);
+      if (ret != 0) {
+        return ret;
+      }
+      have_hash = true;
+    } else if (strcmp("--range", argv[1]) == 0) {
+      char *endptr = NULL;
+      errno = 0;
+      range_offset = strtoull(argv[2], &endptr, 10);
+      if (errno == 0 && endptr != argv[2] && *endptr == ':') {
+        char *len_str = endptr + 1;
+        range_len = strtoull(len_str, &endptr, 10);
+        if (endptr == len_str) {
+          errno = EINVAL;
+        }
+      } else {
+        errno = EINVAL;
+      }
+      if (errno != 0 || *endptr != 0 || range_len > SIZE_MAX) {
+        fprintf(stderr, "Bad range argument, expected OFFSET:LEN.\n");
+        return 1;
+      }
     } else {
       fprintf(stderr, "Unknown flag.\n");
       return 1;
@@ -102,6 +432,14 @@ int main(int argc, char **argv) {
     argv += 2;
   }
 
+  if (verify_path != NULL && !have_hash) {
+    fprintf(stderr, "--verify needs the root hash in --hash.\n");
+    return 1;
+  }
+  if (verify_path == NULL) {
+    printf("GET current: %s\n", blake3_get_impl_name());
+  }
+
   {
     cycles_t start, stop;
 
@@ -114,10 +452,52 @@ int main(int argc, char **argv) {
     case KEYED_HASH_MODE:
       Blake3_InitKeyed(hasher, key);
       break;
+    case DERIVE_KEY_MODE:
+      Blake3_InitDeriveKey(hasher, context);
+      break;
     default:
       abort();
     }
 
+    // Only the range and its path to the root are read from stdin.
+    if (verify_path != NULL) {
+      return verify_range(hasher, verify_path, hash, range_offset,
+                          (size_t)range_len);
+    }
+
+    // Each worker process hashes a subtree of stdin.
+    if (workers > 0) {
+      uint8_t *out = malloc(out_len ? out_len : 1);
+      if (out == NULL || hash_workers(hasher, workers, out, out_len) != 0) {
+        return 1;
+      }
+      for (size_t i = 0; i < out_len; i++) {
+        printf("%02x", out[i]);
+      }
+      printf("\n");
+      free(out);
+      return 0;
+    }
+
+    // The shape of the tree depends on the input length, so it has to be
+    // known in advance.
+    if (outboard_path != NULL) {
+      struct stat st;
+      if (fstat(fileno(stdin), &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "--outboard needs a regular file as input.\n");
+        return 1;
+      }
+      of.fd = open(outboard_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (of.fd < 0) {
+        fprintf(stderr, "Opening the outboard failed.\n");
+        return 1;
+      }
+      ob.write = outboard_write;
+      ob.input_len = (uint64_t)st.st_size;
+      ob.priv = &of;
+      Blake3_SetOutboard(hasher, &ob);
+    }
+
     buf = B;
     while (1) {
       size_t n = fread(buf, 1, BUFSIZE, stdin);
@@ -133,6 +513,11 @@ int main(int argc, char **argv) {
       printf("%02x", buf[i]);
     }
     printf(" cycles=%llu\n", (long long unsigned)(stop - start));
+
+    if (of.fd >= 0 && (close(of.fd) != 0 || of.failed)) {
+      fprintf(stderr, "Writing the outboard failed.\n");
+      return 1;
+    }
   }
   printf("  -\n");
 